@@ -0,0 +1,865 @@
+/**************************************************************
+ * Copyright (C) 2017 by Chan Russell, Robert                 *
+ *                                                            *
+ * Project: Audio Looper                                      *
+ *                                                            *
+ * This file contains an offline benchmark of the process     *
+ * path, built with 'make bench', no Jack server, audio       *
+ * interface or serial port needed                            *
+ *                                                            *
+ * Functionality:                                             *
+ * - Stand in for the Jack calls made by playRecord           *
+ * - Record 1 to 16 tracks with a scripted command sequence   *
+ * - Time playback for period sizes of 32 to 1024 frames      *
+ * - Report ns per period and the cost of each track          *
+ * - 'bench check' verifies loop alignment instead, for each  *
+ *   period size and a few command offsets into the period:  *
+ *   a first take of an impulse train starts and stops on     *
+ *   the command's sample, a take played along to it and an  *
+ *   overdub of it land on its impulses, sample exact, and   *
+ *   the cost of a track is within BENCH_CHECK_SLOWDOWN of    *
+ *   the baseline recorded on this machine                    *
+ *   Exits 1 if any check fails or there is no baseline,      *
+ *   'make check' runs it                                     *
+ * - 'bench baseline', or 'make baseline', records the track  *
+ *   costs the checks are compared against, only ever on      *
+ *   request and only if the alignment checks pass            *
+ *                                                            *
+ *************************************************************/
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdbool.h>
+#include <math.h>
+#include <time.h>
+
+#include <jack/jack.h>
+
+#include "local.h"
+
+/**************************************************************
+ * Macros and defines                                         *
+ *************************************************************/
+#define BENCH_SAMPLE_RATE       (48000)
+#define BENCH_LOOP_FRAMES       (BENCH_SAMPLE_RATE)     // first take, one second
+#define BENCH_MIN_PERIOD        (32)
+#define BENCH_MAX_PERIOD        (1024)
+#define BENCH_MEASURE_FRAMES    (BENCH_SAMPLE_RATE * 10)
+#define BENCH_GROUP             (1)
+#define BENCH_TONE_HZ           (440.0)
+// Alignment checks, see checkAlignment
+#define BENCH_CHECK_LOOP_FRAMES (BENCH_SAMPLE_RATE / 2)
+#define BENCH_CHECK_SPACING     (1009)  // frames between impulses, prime so they drift through every period
+#define BENCH_CHECK_TRAIN_LEVEL (0.5f)  // impulses of the first take
+#define BENCH_CHECK_HIT_LEVEL   (0.25f) // the performer's, too quiet to be played along to on its own
+#define BENCH_CHECK_HEARD_LEVEL (0.45f) // output level the performer plays along to
+#define BENCH_CHECK_TOLERANCE   (1.0f / 8192)   // int16 tracks round what they store
+#define BENCH_CHECK_MIN_HITS    (3)     // fewer means the performer never heard the take
+#define BENCH_CHECK_SLOWDOWN    (1.25)  // a track may cost this much more than the baseline
+#define BENCH_CHECK_RUNS        (10)    // the cheapest run is kept, a busy machine only adds time
+#define BENCH_BASELINE_FILE     "bench_baseline"
+#define BENCH_PERIOD_SIZES      (6)     // BENCH_MIN_PERIOD to BENCH_MAX_PERIOD
+#define BENCH_HISTORY_FRAMES    (8192)  // power of 2, more than the record latency and a period
+
+/**************************************************************
+ * Data types                                                 *
+ *************************************************************/
+enum BenchPort
+{
+    BENCH_PORT_IN_LEFT,
+    BENCH_PORT_IN_RIGHT,
+    BENCH_PORT_OUT_LEFT,
+    BENCH_PORT_OUT_RIGHT,
+    BENCH_PORT_COUNT
+};
+
+// What each period's input is
+enum BenchInput
+{
+    BENCH_INPUT_TONE,               // the same tone every period, set up by benchInit
+    BENCH_INPUT_SILENT,
+    BENCH_INPUT_TRAIN,              // impulses at capture times that are multiples of BENCH_CHECK_SPACING
+    BENCH_INPUT_PERFORMER           // a hit for every mixed impulse heard, recordLatency after it was mixed
+};
+
+static struct MasterLooper looper;
+static jack_default_audio_sample_t *portBuffers[BENCH_PORT_COUNT];
+static jack_nframes_t frameCounter;     // absolute frame of the period being processed
+static enum BenchInput input;
+static jack_default_audio_sample_t history[BENCH_HISTORY_FRAMES];  // left output by absolute frame
+
+/**************************************************************
+ * Jack stand ins, the ports point at portBuffers entries
+ *************************************************************/
+void *jack_port_get_buffer(jack_port_t *port, jack_nframes_t nframes)
+{
+    return *(jack_default_audio_sample_t **)port;
+}
+
+jack_nframes_t jack_last_frame_time(const jack_client_t *client)
+{
+    return frameCounter;
+}
+
+jack_nframes_t jack_frame_time(const jack_client_t *client)
+{
+    return frameCounter;
+}
+
+/**************************************************************
+ * Static functions
+ *************************************************************/
+
+/*
+ * Function: nowNs
+ * Input: none
+ * Output: monotonic time in nanoseconds
+ *
+ */
+static uint64_t nowNs(void)
+{
+    struct timespec now;
+    clock_gettime(CLOCK_MONOTONIC, &now);
+    return ((uint64_t)now.tv_sec * 1000000000ULL) + now.tv_nsec;
+}
+
+/*
+ * Function: fillTone
+ * Input: none
+ * Output: none
+ * Description:
+ *   The tone is left in the input buffers and played every period
+ *
+ */
+static void fillTone(void)
+{
+    jack_nframes_t i;
+
+    for (i = 0; i < BENCH_MAX_PERIOD; i++)
+    {
+        portBuffers[BENCH_PORT_IN_LEFT][i] = 0.25f * sinf(2.0 * M_PI * BENCH_TONE_HZ * i / BENCH_SAMPLE_RATE);
+        portBuffers[BENCH_PORT_IN_RIGHT][i] = -portBuffers[BENCH_PORT_IN_LEFT][i];
+    }
+}
+
+/*
+ * Function: fillInput
+ * Input: number of frames in the period
+ * Output: none
+ * Description:
+ *   Input sample k of the period was captured at frameCounter -
+ *   captureLatency + k, the frame a command stamped for it carries. The
+ *   performer hears the output recordLatency before it reaches the input
+ *
+ */
+static void fillInput(jack_nframes_t nframes)
+{
+    jack_default_audio_sample_t *in = portBuffers[BENCH_PORT_IN_LEFT];
+    jack_nframes_t captured = frameCounter - looper.captureLatency;
+    jack_nframes_t heard = frameCounter - looper.recordLatency;
+    jack_nframes_t k;
+
+    for (k = 0; k < nframes; k++)
+    {
+        switch (input)
+        {
+            case BENCH_INPUT_TRAIN:
+                in[k] = ((captured + k) % BENCH_CHECK_SPACING == 0) ? BENCH_CHECK_TRAIN_LEVEL : 0.0f;
+                break;
+            case BENCH_INPUT_PERFORMER:
+                in[k] = (history[(heard + k) & (BENCH_HISTORY_FRAMES - 1)] >= BENCH_CHECK_HEARD_LEVEL) ?
+                    BENCH_CHECK_HIT_LEVEL : 0.0f;
+                break;
+            default:
+                in[k] = 0.0f;
+                break;
+        }
+    }
+    memcpy(portBuffers[BENCH_PORT_IN_RIGHT], in, nframes * sizeof(jack_default_audio_sample_t));
+}
+
+/*
+ * Function: runPeriod
+ * Input: number of frames in the period
+ * Output: none
+ * Description:
+ *   One call of the process callback, the checks keep the output it mixed
+ *
+ */
+static void runPeriod(jack_nframes_t nframes)
+{
+    jack_nframes_t k;
+
+    if (input != BENCH_INPUT_TONE)
+    {
+        fillInput(nframes);
+    }
+    playRecord(&looper, nframes);
+    if (input != BENCH_INPUT_TONE)
+    {
+        for (k = 0; k < nframes; k++)
+        {
+            history[(frameCounter + k) & (BENCH_HISTORY_FRAMES - 1)] = portBuffers[BENCH_PORT_OUT_LEFT][k];
+        }
+    }
+    frameCounter += nframes;
+}
+
+/*
+ * Function: sendCommand
+ * Input: system event, track and group
+ * Output: none
+ * Description:
+ *   Queue a command stamped so it applies on the first frame of the next period
+ *
+ */
+static void sendCommand(uint8_t event, uint8_t track, uint8_t group)
+{
+    struct ControlCommand cmd = {
+        .frameTime = frameCounter - looper.captureLatency,
+        .track = track,
+        .group = group,
+        .event = event,
+        .repeat = false
+    };
+    if (!controlQueueCommand(COMMAND_SOURCE_SERIAL, &cmd))
+    {
+        printf("** bench command queue full\n");
+    }
+    runPeriod(looper.periodSize);
+}
+
+/*
+ * Function: recordTracks
+ * Input: number of tracks to record
+ * Output: none
+ * Description:
+ *   Record the first take for BENCH_LOOP_FRAMES, then each following track from
+ *   the top of the loop to just short of its end so every track plays throughout
+ *
+ */
+static void recordTracks(uint8_t numTracks)
+{
+    jack_nframes_t period = looper.periodSize;
+    uint32_t frames;
+    uint8_t track;
+
+    sendCommand(SYSTEM_EVENT_RECORD_TRACK, 0, BENCH_GROUP);
+    for (frames = 0; frames < BENCH_LOOP_FRAMES; frames += period)
+    {
+        runPeriod(period);
+    }
+    sendCommand(SYSTEM_EVENT_PLAY_TRACK, 0, BENCH_GROUP);
+
+    for (track = 1; track < numTracks; track++)
+    {
+        while (looper.masterCurrIdx >= period)
+        {
+            runPeriod(period);
+        }
+        sendCommand(SYSTEM_EVENT_RECORD_TRACK, track, BENCH_GROUP);
+        while (looper.masterCurrIdx + (3 * period) < looper.masterLength[BENCH_GROUP])
+        {
+            runPeriod(period);
+        }
+        sendCommand(SYSTEM_EVENT_PLAY_TRACK, track, BENCH_GROUP);
+    }
+}
+
+/*
+ * Function: measure
+ * Input: none
+ * Output: average time per period in nanoseconds
+ * Description:
+ *   Run BENCH_MEASURE_FRAMES worth of periods in the current state
+ *
+ */
+static double measure(void)
+{
+    jack_nframes_t period = looper.periodSize;
+    uint32_t periods = BENCH_MEASURE_FRAMES / period;
+    uint32_t p;
+    uint64_t start;
+
+    // warm the caches and let any pending command apply
+    for (p = 0; p < (periods / 10) + 1; p++)
+    {
+        runPeriod(period);
+    }
+    start = nowNs();
+    for (p = 0; p < periods; p++)
+    {
+        runPeriod(period);
+    }
+    return (double)(nowNs() - start) / periods;
+}
+
+/*
+ * Function: setPeriod
+ * Input: number of frames per period
+ * Output: none
+ * Description:
+ *   Latencies of one period each way, as a two period Jack setup has
+ *
+ */
+static void setPeriod(jack_nframes_t period)
+{
+    looper.periodSize = period;
+    looper.captureLatency = period;
+    looper.playbackLatency = period;
+    looper.recordLatency = 2 * period;
+}
+
+/*
+ * Function: commandAt
+ * Input: system event, track and group
+ *        capture frame the command is for
+ * Output: none
+ * Description:
+ *   Queue a command stamped for the input sample captured on the frame and
+ *   run periods until the one holding that sample has been processed
+ *
+ */
+static void commandAt(uint8_t event, uint8_t track, uint8_t group, jack_nframes_t frame)
+{
+    struct ControlCommand cmd = {
+        .frameTime = frame,
+        .track = track,
+        .group = group,
+        .event = event,
+        .repeat = false
+    };
+    if (!controlQueueCommand(COMMAND_SOURCE_SERIAL, &cmd))
+    {
+        printf("** bench command queue full\n");
+    }
+    while ((int32_t)(frameCounter - looper.captureLatency - frame) <= 0)
+    {
+        runPeriod(looper.periodSize);
+    }
+}
+
+/*
+ * Function: nextCapture
+ * Input: none
+ * Output: capture frame of the first sample of the next period
+ *
+ */
+static jack_nframes_t nextCapture(void)
+{
+    return frameCounter - looper.captureLatency;
+}
+
+/*
+ * Function: trackValue
+ * Input: pointer to the track
+ *        track index
+ * Output: left sample at the index, 1 is full scale, 0 where nothing was recorded
+ *
+ */
+static float trackValue(const struct Track *track, uint32_t idx)
+{
+    if ((idx >= track->numChunks * CHUNK_FRAMES) || (track->chunksLeft[idx >> CHUNK_FRAMES_SHIFT] == NULL))
+    {
+        return 0.0f;
+    }
+#if TRACK_FORMAT == TRACK_FORMAT_FLOAT
+    return *chunkSample(track->chunksLeft, idx);
+#else
+    return *chunkSample(track->chunksLeft, idx) / TRACK_SAMPLE_SCALE;
+#endif
+}
+
+/*
+ * Function: near
+ * Input: sample value and the value it should be
+ * Output: true if they match within BENCH_CHECK_TOLERANCE
+ *
+ */
+static bool near(float value, float expected)
+{
+    return (value - expected < BENCH_CHECK_TOLERANCE) && (expected - value < BENCH_CHECK_TOLERANCE);
+}
+
+/*
+ * Function: checkTake
+ * Input: capture frames of the record and play commands
+ * Output: true if the take holds exactly the input between them, and the
+ *         tail the input after them
+ * Description:
+ *   A first take has no record offset, track index i is the input captured
+ *   on frame start + i
+ *
+ */
+static bool checkTake(jack_nframes_t start, jack_nframes_t stop)
+{
+    const struct Track *track = &looper.tracks[0];
+    float expected;
+    uint32_t idx;
+
+    if ((track->startIdx != 0) || (track->endIdx != stop - start))
+    {
+        printf("  take: expected 0 to %u, got %u to %u\n", stop - start, track->startIdx, track->endIdx);
+        return false;
+    }
+    if (track->tailFrames != LOOP_SEAM_FADE_FRAMES)
+    {
+        printf("  take: tail of %u frames, expected %u\n", track->tailFrames, LOOP_SEAM_FADE_FRAMES);
+        return false;
+    }
+    for (idx = 0; idx < track->endIdx + track->tailFrames; idx++)
+    {
+        expected = ((start + idx) % BENCH_CHECK_SPACING == 0) ? BENCH_CHECK_TRAIN_LEVEL : 0.0f;
+        if (!near(trackValue(track, idx), expected))
+        {
+            printf("  take: index %u is %f, expected %f\n", idx, trackValue(track, idx), expected);
+            return false;
+        }
+    }
+    return true;
+}
+
+/*
+ * Function: isImpulse
+ * Input: capture frame of the take's first sample
+ *        track index
+ * Output: true if the first take has an impulse at the index
+ *
+ */
+static bool isImpulse(jack_nframes_t start, uint32_t idx)
+{
+    return (idx < looper.tracks[0].endIdx) && ((start + idx) % BENCH_CHECK_SPACING == 0);
+}
+
+/*
+ * Function: heardLevel
+ * Input: master index
+ * Output: the first take's level in the output there, once the loop has
+ *         gone round
+ * Description:
+ *   The take's tail fades out under the start of every pass after the first
+ *
+ */
+static float heardLevel(uint32_t idx)
+{
+    const struct Track *take = &looper.tracks[0];
+    float level = (idx < take->endIdx) ? trackValue(take, idx) : 0.0f;
+
+    if (idx < LOOP_SEAM_FADE_FRAMES)
+    {
+        level = (level * seamEnvelope(idx)) +
+            (trackValue(take, take->endIdx + idx) * (1.0f - seamEnvelope(idx)));
+    }
+    return level;
+}
+
+/*
+ * Function: checkPlayAlong
+ * Input: none
+ * Output: true if track 1 holds a hit wherever the performer heard one
+ * Description:
+ *   Track 1 was recorded from the top of the loop, its index is the master
+ *   index. Every frame the take was loud enough on must be hit, across the
+ *   seam crossfade too, and nothing else
+ *
+ */
+static bool checkPlayAlong(void)
+{
+    const struct Track *track = &looper.tracks[1];
+    uint32_t hits = 0;
+    uint32_t idx;
+    float value;
+    float expected;
+
+    for (idx = track->startIdx; idx < track->endIdx; idx++)
+    {
+        value = trackValue(track, idx);
+        expected = (heardLevel(idx) >= BENCH_CHECK_HEARD_LEVEL) ? BENCH_CHECK_HIT_LEVEL : 0.0f;
+        if (!near(value, expected))
+        {
+            printf("  play along: index %u is %f, expected %f\n", idx, value, expected);
+            return false;
+        }
+        if (expected != 0.0f)
+        {
+            hits++;
+        }
+    }
+    if (hits < BENCH_CHECK_MIN_HITS)
+    {
+        printf("  play along: only %u hits\n", hits);
+        return false;
+    }
+    return true;
+}
+
+/*
+ * Function: checkOverdub
+ * Input: capture frame of the first take's first sample
+ * Output: true if the overdub added hits on the take's impulses only
+ * Description:
+ *   The overdub covers less than a loop, each impulse is the take's level or
+ *   that with one hit on top, everything else is still silent
+ *
+ */
+static bool checkOverdub(jack_nframes_t start)
+{
+    const struct Track *track = &looper.tracks[0];
+    uint32_t hits = 0;
+    uint32_t idx;
+    float value;
+
+    for (idx = 0; idx < track->endIdx; idx++)
+    {
+        value = trackValue(track, idx);
+        if (!isImpulse(start, idx))
+        {
+            if (value != 0.0f)
+            {
+                printf("  overdub: hit at %u is off the impulses, %f\n", idx, value);
+                return false;
+            }
+        }
+        else if (near(value, BENCH_CHECK_TRAIN_LEVEL + BENCH_CHECK_HIT_LEVEL))
+        {
+            hits++;
+        }
+        else if (!near(value, BENCH_CHECK_TRAIN_LEVEL))
+        {
+            printf("  overdub: impulse at %u is %f\n", idx, value);
+            return false;
+        }
+    }
+    if (hits < BENCH_CHECK_MIN_HITS)
+    {
+        printf("  overdub: only %u hits\n", hits);
+        return false;
+    }
+    return true;
+}
+
+/*
+ * Function: checkAlignment
+ * Input: frames into a period the commands land on
+ * Output: true if every check passed
+ * Description:
+ *   Record a first take of the impulse train, starting offset frames into a
+ *   period and a loop plus offset long. Then record track 1 along to it
+ *   from the top of the loop for half of it, and overdub the take from a
+ *   third of the way in for another third, with the performer playing
+ *   along. Everything is reset afterwards
+ *
+ */
+static bool checkAlignment(jack_nframes_t offset)
+{
+    jack_nframes_t period = looper.periodSize;
+    jack_nframes_t start;
+    jack_nframes_t frame;
+    uint32_t length;
+    bool pass;
+
+    input = BENCH_INPUT_TRAIN;
+    start = nextCapture() + period + offset;
+    commandAt(SYSTEM_EVENT_RECORD_TRACK, 0, BENCH_GROUP, start);
+    commandAt(SYSTEM_EVENT_PLAY_TRACK, 0, BENCH_GROUP, start + BENCH_CHECK_LOOP_FRAMES + offset);
+    while ((int32_t)(nextCapture() - (start + BENCH_CHECK_LOOP_FRAMES + offset + LOOP_SEAM_FADE_FRAMES)) < 0)
+    {
+        // the take's tail is recorded from the train too
+        runPeriod(period);
+    }
+    pass = checkTake(start, start + BENCH_CHECK_LOOP_FRAMES + offset);
+    length = looper.tracks[0].endIdx;
+
+    // a loop of the take alone, so the performer does not play along to the train monitored live
+    input = BENCH_INPUT_SILENT;
+    for (frame = 0; frame < length; frame += period)
+    {
+        runPeriod(period);
+    }
+    input = BENCH_INPUT_PERFORMER;
+    if (pass)
+    {
+        while (looper.masterCurrIdx >= period)
+        {
+            runPeriod(period);
+        }
+        frame = nextCapture() + offset;
+        commandAt(SYSTEM_EVENT_RECORD_TRACK, 1, BENCH_GROUP, frame);
+        commandAt(SYSTEM_EVENT_PLAY_TRACK, 1, BENCH_GROUP, frame + (length / 2));
+        pass = checkPlayAlong();
+    }
+    if (pass)
+    {
+        while (looper.masterCurrIdx < length / 3)
+        {
+            runPeriod(period);
+        }
+        frame = nextCapture() + offset;
+        commandAt(SYSTEM_EVENT_OVERDUB_TRACK, 0, BENCH_GROUP, frame);
+        commandAt(SYSTEM_EVENT_PLAY_TRACK, 0, BENCH_GROUP, frame + (length / 3));
+        pass = checkOverdub(start);
+    }
+
+    input = BENCH_INPUT_SILENT;
+    sendCommand(SYSTEM_EVENT_PASSTHROUGH, 0, 0);
+    return pass;
+}
+
+/*
+ * Function: trackCost
+ * Input: none
+ * Output: ns per period each of NUM_TRACKS tracks adds to passthrough
+ * Description:
+ *   The cheapest of BENCH_CHECK_RUNS each of passthrough and of the tracks,
+ *   so the checks hold on a machine that is doing something else too
+ *
+ */
+static double trackCost(void)
+{
+    double baseline = 0.0;
+    double tracks = 0.0;
+    double ns;
+    uint8_t run;
+
+    input = BENCH_INPUT_TONE;
+    fillTone();
+    for (run = 0; run < BENCH_CHECK_RUNS; run++)
+    {
+        ns = measure();
+        baseline = ((run == 0) || (ns < baseline)) ? ns : baseline;
+    }
+    recordTracks(NUM_TRACKS);
+    for (run = 0; run < BENCH_CHECK_RUNS; run++)
+    {
+        ns = measure();
+        tracks = ((run == 0) || (ns < tracks)) ? ns : tracks;
+    }
+    sendCommand(SYSTEM_EVENT_PASSTHROUGH, 0, 0);
+    input = BENCH_INPUT_SILENT;
+    return (tracks - baseline) / NUM_TRACKS;
+}
+
+/*
+ * Function: loadBaseline
+ * Input: track cost of each period size to fill
+ * Output: true if BENCH_BASELINE_FILE has one for every period size
+ *
+ */
+static bool loadBaseline(double costs[])
+{
+    FILE *file = fopen(BENCH_BASELINE_FILE, "r");
+    jack_nframes_t period;
+    uint8_t n;
+    bool pass = (file != NULL);
+
+    for (n = 0; (pass) && (n < BENCH_PERIOD_SIZES); n++)
+    {
+        pass = (fscanf(file, "%u %lf", &period, &costs[n]) == 2) && (period == (BENCH_MIN_PERIOD << n));
+    }
+    if (file)
+    {
+        fclose(file);
+    }
+    return pass;
+}
+
+/*
+ * Function: saveBaseline
+ * Input: track cost of each period size
+ * Output: none
+ * Description:
+ *   One line per period size, the period and the ns per track
+ *
+ */
+static void saveBaseline(const double costs[])
+{
+    FILE *file = fopen(BENCH_BASELINE_FILE, "w");
+    uint8_t n;
+
+    if (file == NULL)
+    {
+        printf("** could not write %s\n", BENCH_BASELINE_FILE);
+        return;
+    }
+    for (n = 0; n < BENCH_PERIOD_SIZES; n++)
+    {
+        fprintf(file, "%u %.1f\n", BENCH_MIN_PERIOD << n, costs[n]);
+    }
+    fclose(file);
+    printf("track costs recorded to %s\n", BENCH_BASELINE_FILE);
+}
+
+/*
+ * Function: runChecks
+ * Input: true to record the track costs instead of checking them
+ * Output: number of failed checks
+ * Description:
+ *   Alignment with commands on the first, second, a middle and the last
+ *   frame of a period, then the track cost, for every period size. Without a
+ *   baseline the costs are reported and the check fails, a baseline is only
+ *   recorded on request and not from a build that fails alignment
+ *
+ */
+static uint32_t runChecks(bool record)
+{
+    jack_nframes_t period;
+    jack_nframes_t offsets[4];
+    double baseline[BENCH_PERIOD_SIZES];
+    double costs[BENCH_PERIOD_SIZES];
+    uint32_t failed = 0;
+    uint8_t n = 0;
+    uint8_t o;
+    bool pass;
+    bool haveBaseline = (!record) && (loadBaseline(baseline));
+
+    for (period = BENCH_MIN_PERIOD; period <= BENCH_MAX_PERIOD; period *= 2, n++)
+    {
+        setPeriod(period);
+        offsets[0] = 0;
+        offsets[1] = 1;
+        offsets[2] = period / 2 + 1;
+        offsets[3] = period - 1;
+        for (o = 0; o < 4; o++)
+        {
+            pass = checkAlignment(offsets[o]);
+            printf("period %4u offset %4u alignment %s\n", period, offsets[o], (pass) ? "ok" : "FAILED");
+            failed += (pass) ? 0 : 1;
+        }
+
+        costs[n] = trackCost();
+        if (!haveBaseline)
+        {
+            printf("period %4u track cost %.0f ns\n", period, costs[n]);
+            continue;
+        }
+        pass = (costs[n] <= baseline[n] * BENCH_CHECK_SLOWDOWN);
+        printf("period %4u track cost %.0f ns, baseline %.0f ns %s\n", period, costs[n], baseline[n],
+            (pass) ? "ok" : "FAILED");
+        failed += (pass) ? 0 : 1;
+    }
+    if ((record) && (failed == 0))
+    {
+        saveBaseline(costs);
+    }
+    else if (record)
+    {
+        printf("alignment failed, no baseline recorded\n");
+    }
+    else if (!haveBaseline)
+    {
+        printf("no baseline in %s, track costs not checked, record one with 'make baseline'\n",
+            BENCH_BASELINE_FILE);
+        failed++;
+    }
+    printf("\n%u checks failed\n", failed);
+    return failed;
+}
+
+/*
+ * Function: benchInit
+ * Input: none
+ * Output: pass/fail of the allocations
+ * Description:
+ *   Set up the looper the way init.c does for a stereo device, with a tone on
+ *   both inputs and latencies of one period each way
+ *
+ */
+static bool benchInit(void)
+{
+    int port;
+
+    for (port = 0; port < BENCH_PORT_COUNT; port++)
+    {
+        portBuffers[port] = calloc(BENCH_MAX_PERIOD, sizeof(jack_default_audio_sample_t));
+        if (portBuffers[port] == NULL)
+        {
+            return false;
+        }
+    }
+    fillTone();
+
+    looper.input_portL[0] = (jack_port_t *)&portBuffers[BENCH_PORT_IN_LEFT];
+    looper.input_portR[0] = (jack_port_t *)&portBuffers[BENCH_PORT_IN_RIGHT];
+    looper.output_portL[0] = (jack_port_t *)&portBuffers[BENCH_PORT_OUT_LEFT];
+    looper.output_portR[0] = (jack_port_t *)&portBuffers[BENCH_PORT_OUT_RIGHT];
+    looper.numPortPairs = 1;
+    looper.sampleRate = BENCH_SAMPLE_RATE;
+    looper.periodSize = BENCH_MAX_PERIOD;
+    looper.selectedGroup = BENCH_GROUP;
+
+    // the group bus cache is not started, every block mixes the tracks themselves
+    if ((!logInit(&looper)) || (!poolInit(&looper)) || (!undoInit(&looper)) ||
+        (!controlInit(&looper)) ||
+        (!workersResize(BENCH_MAX_PERIOD)) || (!workersInit(&looper, -1)))
+    {
+        return false;
+    }
+    logSetProcessThread(pthread_self());
+    logSetLevel(LOG_LEVEL_WARN);
+    return true;
+}
+
+/**************************************************************
+ * Public functions
+ *************************************************************/
+
+/*
+ * Function: main
+ * Input: 'check' to run the alignment and track cost checks instead,
+ *        'baseline' to run them and record the track costs
+ * Output: 0 on success, 1 if setup or a check failed
+ * Description:
+ *   For each period size time passthrough as the baseline, then playback of
+ *   1 to NUM_TRACKS tracks. Per track cost is the time above the baseline
+ *   divided by the number of tracks
+ *
+ */
+int main(int argc, char *argv[])
+{
+    jack_nframes_t period;
+    double baseline;
+    double ns;
+    uint8_t numTracks;
+    uint32_t failed;
+
+    if (!benchInit())
+    {
+        printf("bench setup failed\n");
+        return 1;
+    }
+
+    if ((argc > 1) && ((strcmp(argv[1], "check") == 0) || (strcmp(argv[1], "baseline") == 0)))
+    {
+        failed = runChecks(strcmp(argv[1], "baseline") == 0);
+        looper.exitNow = true;
+        logJoin();
+        workersJoin();
+        return (failed == 0) ? 0 : 1;
+    }
+
+    printf("\n%8s %8s %12s %12s %8s\n", "period", "tracks", "ns/period", "ns/track", "load%");
+    for (period = BENCH_MIN_PERIOD; period <= BENCH_MAX_PERIOD; period *= 2)
+    {
+        setPeriod(period);
+
+        baseline = measure();
+        printf("%8u %8u %12.0f %12s %8.2f\n", period, 0, baseline, "-",
+            100.0 * baseline * BENCH_SAMPLE_RATE / (period * 1e9));
+
+        for (numTracks = 1; numTracks <= NUM_TRACKS; numTracks++)
+        {
+            recordTracks(numTracks);
+            ns = measure();
+            printf("%8u %8u %12.0f %12.0f %8.2f\n", period, numTracks, ns,
+                (ns - baseline) / numTracks,
+                100.0 * ns * BENCH_SAMPLE_RATE / (period * 1e9));
+            sendCommand(SYSTEM_EVENT_PASSTHROUGH, 0, 0);
+        }
+    }
+
+    looper.exitNow = true;
+    logJoin();
+    workersJoin();
+    return 0;
+}
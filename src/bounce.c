@@ -0,0 +1,387 @@
+/**************************************************************
+ * Copyright (C) 2017 by Chan Russell, Robert                 *
+ *                                                            *
+ * Project: Audio Looper                                      *
+ *                                                            *
+ * This file contains the track bounce, merging the playing   *
+ * tracks of a group into one track                           *
+ *                                                            *
+ * Functionality:                                             *
+ * - The process thread takes the chunks for the result and   *
+ *   snapshots the group, see groupSignature                  *
+ * - A low priority thread renders the group into them        *
+ * - The process thread swaps the result into the target      *
+ *   track between blocks, dropping it if the group changed   *
+ *   meanwhile, and frees the merged tracks for reuse         *
+ *                                                            *
+ *************************************************************/
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdbool.h>
+#include <unistd.h>
+
+#include "local.h"
+
+/**************************************************************
+ * Macros and defines                                         *
+ *************************************************************/
+#define BOUNCE_POLL_US          (20 * 1000)
+
+/**************************************************************
+ * Data types                                                 *
+ *************************************************************/
+enum BounceState
+{
+    BOUNCE_IDLE,                    // process thread owns the job and the result track
+    BOUNCE_RUNNING,                 // bounce thread is rendering
+    BOUNCE_DONE                     // rendered, waiting for the process thread
+};
+
+struct BounceJob
+{
+    struct GroupSignature sig;      // the playing tracks being merged
+    uint8_t group;
+    uint8_t track;                  // target track
+};
+
+static struct MasterLooper *looper;
+static struct BounceJob job;
+static struct Track result;          // chunks being rendered, swapped into the target when done
+static _Atomic uint8_t state;        // enum BounceState
+static pthread_t bounceTh;
+static bool running;
+
+// Render scratch, one chunk at a time, only used by the bounce thread
+static jack_default_audio_sample_t blockLeft[CHUNK_FRAMES];
+static jack_default_audio_sample_t blockRight[CHUNK_FRAMES];
+
+/**************************************************************
+ * Static functions
+ *************************************************************/
+
+/*
+ * Function: playingSignature
+ * Input: group
+ *        mask of the tracks to keep
+ *        pointer to the signature to fill
+ * Output: none
+ * Description:
+ *   The group's signature cut down to the given tracks
+ *
+ */
+static void playingSignature(uint8_t group, uint32_t tracks, struct GroupSignature *sig)
+{
+    uint32_t dropped;
+
+    groupSignature(group, sig);
+    dropped = sig->tracks & ~tracks;
+    sig->tracks &= tracks;
+    while (dropped)
+    {
+        memset(&sig->sources[nextTrack(&dropped)], 0, sizeof(struct MixSource));
+    }
+}
+
+/*
+ * Function: renderJob
+ * Input: none
+ * Output: none
+ * Description:
+ *   Render the whole master loop into the result track, chunk by chunk
+ *   The merged tracks already crossfade at the master seam, the result's
+ *   tail is its own start so its crossfade there changes nothing
+ *
+ */
+static void renderJob(void)
+{
+    uint32_t length = job.sig.masterLength;
+    uint32_t idx;
+    uint32_t run;
+
+    for (idx = 0; idx < length; idx += run)
+    {
+        run = chunkRun(idx, length - idx);
+        groupRender(&job.sig, idx, run, blockLeft, blockRight);
+        dspTrackStore(chunkSample(result.chunksLeft, idx), blockLeft, run);
+        if (result.channels == 2)
+        {
+            dspTrackStore(chunkSample(result.chunksRight, idx), blockRight, run);
+        }
+    }
+    if (result.tailFrames > 0)
+    {
+        groupRender(&job.sig, 0, result.tailFrames, blockLeft, blockRight);
+        trackWrite(result.chunksLeft, length, blockLeft, result.tailFrames);
+        if (result.channels == 2)
+        {
+            trackWrite(result.chunksRight, length, blockRight, result.tailFrames);
+        }
+    }
+}
+
+/*
+ * Function: bounceThread
+ * Input: none
+ * Output: none
+ * Description:
+ *   Low priority thread, render any job the process thread hands over
+ *
+ */
+static void *bounceThread(void *arg)
+{
+    while (!looper->exitNow)
+    {
+        if (atomic_load_explicit(&state, memory_order_acquire) == BOUNCE_RUNNING)
+        {
+            renderJob();
+            atomic_store_explicit(&state, BOUNCE_DONE, memory_order_release);
+        }
+        usleep(BOUNCE_POLL_US);
+    }
+    pthread_exit(NULL);
+}
+
+/*
+ * Function: freeTrack
+ * Input: track
+ * Output: none
+ * Description:
+ *   Take a merged track out of the group, once it is in no group at all return
+ *   its audio to the pool so it can be recorded again
+ *
+ */
+static void freeTrack(uint8_t t)
+{
+    struct Track *track = &looper->tracks[t];
+    uint8_t group;
+
+    looper->groupedTracks[job.group][t] = NULL;
+    looper->groupMembers[job.group] &= ~(1u << t);
+    for (group = 0; group < NUM_GROUPS; group++)
+    {
+        if (looper->groupMembers[group] & (1u << t))
+        {
+            trackUpdateActive(looper, t);
+            return;
+        }
+    }
+    track->state = TRACK_STATE_OFF;
+    trackRelease(track);
+    track->endIdx = 0;
+    track->currIdx = 0;
+    track->startIdx = 0;
+    track->repeat = false;
+    trackNewTake(track);
+    trackUpdateActive(looper, t);
+}
+
+/*
+ * Function: swapResult
+ * Input: none
+ * Output: none
+ * Description:
+ *   Give the target track the rendered audio at unity gain, centred, playing
+ *   from where the master is, so the group sounds the same across the swap
+ *
+ */
+static void swapResult(void)
+{
+    struct Track *track = &looper->tracks[job.track];
+    track_sample_t **chunks;
+    uint32_t sources = job.sig.tracks & ~(1u << job.track);
+
+    while (sources)
+    {
+        freeTrack(nextTrack(&sources));
+    }
+
+    trackRelease(track);
+    chunks = track->chunksLeft;
+    track->chunksLeft = result.chunksLeft;
+    result.chunksLeft = chunks;
+    chunks = track->chunksRight;
+    track->chunksRight = result.chunksRight;
+    result.chunksRight = chunks;
+    track->numChunks = result.numChunks;
+    result.numChunks = 0;
+
+    track->channels = result.channels;
+    track->startIdx = 0;
+    track->endIdx = job.sig.masterLength;
+    track->tailFrames = result.tailFrames;
+    track->cutIdx = job.sig.masterLength;
+    track->currIdx = (looper->selectedGroup == job.group) ? looper->masterCurrIdx : 0;
+    track->repeat = false;
+    track->gain = 1.0f;
+    track->pan = 0.0f;
+    track->levelLeft = 1.0f;
+    track->levelRight = 1.0f;
+    track->state = TRACK_STATE_PLAYBACK;
+    trackNewTake(track);
+    looper->groupedTracks[job.group][job.track] = track;
+    looper->groupMembers[job.group] |= 1u << job.track;
+    trackUpdateActive(looper, job.track);
+}
+
+/**************************************************************
+ * Public functions
+ *************************************************************/
+
+/*
+ * Function: bounceInit
+ * Input: pointer to the master looper context, the pool must be set up
+ * Output: pass/fail of init process
+ * Description:
+ *   Allocate the chunk tables the result is rendered into and start the
+ *   bounce thread at normal priority
+ *
+ */
+bool bounceInit(struct MasterLooper *mLooper)
+{
+    int rc;
+
+    looper = mLooper;
+    result.chunksLeft = calloc(looper->trackMaxChunks, sizeof(track_sample_t *));
+    result.chunksRight = calloc(looper->trackMaxChunks, sizeof(track_sample_t *));
+    if ((result.chunksLeft == NULL) || (result.chunksRight == NULL))
+    {
+        printf("Error allocating bounce chunk tables\n");
+        return false;
+    }
+
+    if ((rc = pthread_create(&bounceTh, NULL, bounceThread, NULL)))
+    {
+        printf("Error: pthread_create, rc: %d\n", rc);
+        return false;
+    }
+    running = true;
+    return true;
+}
+
+/*
+ * Function: bounceJoin
+ * Input: none
+ * Output: none
+ * Description:
+ *   Wait for the bounce thread to exit, exitNow must be set
+ *
+ */
+void bounceJoin(void)
+{
+    if (running)
+    {
+        pthread_join(bounceTh, NULL);
+    }
+}
+
+/*
+ * Function: bounceStart
+ * Input: group
+ *        target track, one of the group's playing tracks or an empty track
+ *        in no other group
+ * Output: none
+ * Description:
+ *   Process thread only, in playback. Take chunks for a full master loop and
+ *   hand the group's playing tracks to the bounce thread. Muted tracks are
+ *   left as they are. One bounce runs at a time
+ *
+ */
+void bounceStart(uint8_t group, uint8_t track)
+{
+    const struct MixSource *source;
+    uint32_t playing = 0;
+    uint32_t active;
+    uint32_t others = 0;
+    uint8_t t;
+    uint8_t g;
+
+    if ((!running) || (atomic_load_explicit(&state, memory_order_acquire) != BOUNCE_IDLE))
+    {
+        logEvent(LOG_MSG_BOUNCE_BUSY, group, 0, 0);
+        return;
+    }
+
+    active = looper->activeTracks[group];
+    while (active)
+    {
+        t = nextTrack(&active);
+        if (looper->tracks[t].state == TRACK_STATE_PLAYBACK)
+        {
+            playing |= 1u << t;
+        }
+    }
+    for (g = 0; g < NUM_GROUPS; g++)
+    {
+        others |= (g == group) ? 0 : looper->groupMembers[g];
+    }
+    if ((looper->masterLength[group] == 0) ||
+        (__builtin_popcount(playing) < 2) ||
+        (others & (1u << track)) ||
+        ((!(playing & (1u << track))) && (looper->tracks[track].endIdx > 0)))
+    {
+        logEvent(LOG_MSG_BOUNCE_INVALID, group, track, 0);
+        return;
+    }
+
+    // stereo if any merged track is, or a mono one is panned off centre
+    playingSignature(group, playing, &job.sig);
+    result.channels = 1;
+    active = playing;
+    while (active)
+    {
+        source = &job.sig.sources[nextTrack(&active)];
+        if ((source->channels == 2) || (source->levelLeft != source->levelRight))
+        {
+            result.channels = 2;
+        }
+    }
+    result.tailFrames = (looper->masterLength[group] >= LOOP_SEAM_FADE_FRAMES) ? LOOP_SEAM_FADE_FRAMES : 0;
+    if (!trackReserve(&result, 0, looper->masterLength[group] + result.tailFrames))
+    {
+        trackRelease(&result);
+        logEvent(LOG_MSG_BOUNCE_NO_MEMORY, group, poolFreeChunks(), 0);
+        return;
+    }
+    job.group = group;
+    job.track = track;
+    atomic_store_explicit(&state, BOUNCE_RUNNING, memory_order_release);
+    logEvent(LOG_MSG_BOUNCE_START, group, track, __builtin_popcount(playing));
+}
+
+/*
+ * Function: bounceApply
+ * Input: none
+ * Output: none
+ * Description:
+ *   Process thread only, once per period. When a bounce has finished rendering
+ *   and the system is in playback, swap it in if the merged tracks are exactly
+ *   as they were rendered, otherwise give its chunks back
+ *
+ */
+void bounceApply(void)
+{
+    struct GroupSignature live;
+
+    if ((atomic_load_explicit(&state, memory_order_acquire) != BOUNCE_DONE) ||
+        (looper->state != SYSTEM_STATE_PLAYBACK))
+    {
+        return;
+    }
+
+    playingSignature(job.group, job.sig.tracks, &live);
+    if ((memcmp(&live, &job.sig, sizeof(live)) == 0) &&
+        (looper->tracks[job.track].state != TRACK_STATE_RECORDING) &&
+        ((job.sig.tracks & (1u << job.track)) || (looper->tracks[job.track].endIdx == 0)))
+    {
+        swapResult();
+        logEvent(LOG_MSG_BOUNCE_DONE, job.group, job.track, 0);
+    }
+    else
+    {
+        logEvent(LOG_MSG_BOUNCE_STALE, job.group, 0, 0);
+    }
+    trackRelease(&result);
+    atomic_store_explicit(&state, BOUNCE_IDLE, memory_order_release);
+}
@@ -3,34 +3,19 @@
  *                                                            *
  * Project: Audio Looper                                      *
  *                                                            *
- * This file contains control functionality and user          *
- * interface handling                                         *
+ * This file contains control functionality, the looper     *
+ * state machine driven by commands from the user interfaces  *
  *                                                            *
- * Functionality: (commands are in ASCII)                     *
- * - Record: record a track and assign track to a group       *
- *   rXXgY: command - r, track XX, group Y,                   *
- * - Overdub: overdub on a track                              *
- *   oXX00: command - o, track XX, pad 00                     *
- * - Mute: mute a track                                       *
- *   mXX00: command - m, track XX, pad 00                     *
- * - Unmute: unmute a track                                   *
- *   uXX00: command - u, track XX, pad 00                     *
- * - Play: stop recording and play all tracks on active group *
- *   p0000, pXX00r: command - p, track XX, pad 00,            *
- *       optional r for repeat on, s for repeat off           *
- *       track is only valid when changing repeat status and  *
- *       in playback mode already -- track is ignored if cmd  *
- *       is used to stop recording or overdubbing             *
- * - Track: add a track to a group                            *
- *   tXXgY: command - t, track XX, group Y                    *
- * - Delete: remove a track from a group                      *
- *   dXXgY: command - d, track XX, group Y                    *
- * - Group: set active group                                  *
- *   gY000: command - g, group Y, pad 000                     *
- * - Stop: reset and return to passthrough state              *
- *   s0000: command - s, pad 0000                             *
- * - Quit: stops the looper application and Jack server       *
- *   q0000: command - q, pad 0000                             *
+ * Functionality:                                             *
+ * - Queue commands from the interface threads, see serial.c  *
+ *   and footswitch.c                                         *
+ * - Hand them to the process callback at their frame time    *
+ * - Apply record, overdub, play, mute, group and reset       *
+ * - Set track gain and pan in any state                      *
+ * - Start a group bounce in playback                         *
+ * - Undo and redo overdub passes in playback                 *
+ * - Quantize record start and stop of later tracks to a grid *
+ *   on the group's first loop                                *
  *                                                            *
  *************************************************************/
 
@@ -42,37 +27,83 @@
 #include <stdbool.h>
 #include <limits.h>
 #include <float.h>
-#include <poll.h>
 
 #include <jack/jack.h>
-#include <wiringPi.h>
-#include <wiringSerial.h>
 
 #include "local.h"
 
 /**************************************************************
  * Macros and defines                                         *
  *************************************************************/
+#define DEFERRED_SLOT           (COMMAND_SOURCE_COUNT)  // pending slot of the command waiting for its grid point
 
 /**************************************************************
  * Data types                                                 *
  *************************************************************/
-struct ControlContext
-{
-    uint8_t track;
-    uint8_t group;
-    uint8_t event;
-    bool repeat;
-    bool updated;
-};
-
 static struct MasterLooper *looper;
-static struct ControlContext cc;        // for storing command info until read by record_play
+static struct ControlCommand cc;        // command being applied, only used by the process callback
+
+// Commands from the interface threads to the process callback, a queue for
+// each thread that queues them
+static struct ControlCommand commandRecords[COMMAND_SOURCE_COUNT][COMMAND_QUEUE_SLOTS];
+static struct SpscQueue commandQueue[COMMAND_SOURCE_COUNT];
+
+// Next command of each queue, taken off but not due yet, and the quantized
+// command moved to its grid point, only used by the process callback
+static struct ControlCommand pendingCmd[COMMAND_SOURCE_COUNT + 1];
+static bool pending[COMMAND_SOURCE_COUNT + 1];
+static int8_t nextSource = -1;          // slot of the earliest pending command, -1 if none
 
 /**************************************************************
  * Static functions
  *************************************************************/
 
+/*
+ * Function: groupAddTrack
+ * Input: group and track
+ * Output: none
+ * Description:
+ *   Point the group's slot at the track and keep the group's bitmasks in step
+ *
+ */
+static void groupAddTrack(uint8_t group, uint8_t track)
+{
+    looper->groupedTracks[group][track] = &looper->tracks[track];
+    looper->groupMembers[group] |= 1u << track;
+    trackUpdateActive(looper, track);
+}
+
+/*
+ * Function: groupRemoveTrack
+ * Input: group and track
+ * Output: none
+ * Description:
+ *   Clear the group's slot for the track and keep the group's bitmasks in step
+ *
+ */
+static void groupRemoveTrack(uint8_t group, uint8_t track)
+{
+    looper->groupedTracks[group][track] = NULL;
+    looper->groupMembers[group] &= ~(1u << track);
+    trackUpdateActive(looper, track);
+}
+
+/*
+ * Function: startsNewLoop
+ * Input: group and track about to be recorded
+ * Output: true if the recording sets a new loop length for the group
+ * Description:
+ *   There is nothing to play along to, or the only track is recorded again,
+ *   or the recording is on a group other than the active one
+ *
+ */
+static bool startsNewLoop(uint8_t group, uint8_t track)
+{
+    return (getNumActiveTracks() == 0) ||
+           (group != looper->selectedGroup) ||
+           ((getNumActiveTracks() == 1) && (looper->selectedTrack == track));
+}
+
 /*
  * Function: startRecording
  * Input: none
@@ -84,29 +115,23 @@ static struct ControlContext cc;        // for storing command info until read b
  */
 static void startRecording(void)
 {
-/*
-    looper->tracks[0].endIdx = TRACK_DEBUG_FRAME_COUNT;
-    looper->selectedGroup = 1;
-    looper->selectedTrack = 1;
-    looper->groupedTracks[1][0] = &looper->tracks[0];
-    looper->tracks[0].state = TRACK_STATE_PLAYBACK;
-    looper->masterLength[1] = TRACK_DEBUG_FRAME_COUNT;
-*/
+    bool newLoop = false;
+
     // Handle case where track is not assigned to the given group
     if (looper->groupedTracks[cc.group][cc.track] == NULL)
     {
-        looper->groupedTracks[cc.group][cc.track] = &looper->tracks[cc.track];
+        groupAddTrack(cc.group, cc.track);
     }
 
     // If numTracks == 0 or selectedTrack is same as new track and numTracks == 1
     // or if we are recording on a new group
     // --> reset master index and length
-    if ( (getNumActiveTracks() == 0) ||
-         (cc.group != looper->selectedGroup) ||
-        ((getNumActiveTracks() == 1) && (looper->selectedTrack == cc.track)) )
+    if (startsNewLoop(cc.group, cc.track))
     {
         looper->masterCurrIdx = 0;
         looper->masterLength[cc.group] = 0;
+        looper->barLength[cc.group] = 0;
+        newLoop = true;
     }
 
     // Recording so reset repeat to false
@@ -114,16 +139,27 @@ static void startRecording(void)
 
     // reset end, set current and start to the master's current index
     // this prevents user from waiting for looper to restart and remain silent until
-    // their desired spot -- downside: doesn't erase earlier recorded stuff
+    // their desired spot -- the previous take's chunks go back to the pool
+    trackRelease(&looper->tracks[cc.track]);
     looper->tracks[cc.track].endIdx = 0;
-    looper->tracks[cc.track].currIdx = looper->masterCurrIdx;
-    looper->tracks[cc.track].startIdx = looper->masterCurrIdx;
+    looper->tracks[cc.track].channels = (looper->input_portR[looper->tracks[cc.track].inputPair]) ? 2 : 1;
+    trackUpdateActive(looper, cc.track);
+    trackNewTake(&looper->tracks[cc.track]);
     looper->selectedGroup = cc.group;
     looper->selectedTrack = cc.track;
 
+    // Playing along to other tracks - the input lags what the performer heard
+    looper->tracks[cc.track].recordOffset =
+        ((!newLoop) && (getNumActiveTracks() > 0)) ? looper->recordLatency : 0;
+    looper->tracks[cc.track].currIdx = looper->masterCurrIdx;
+    looper->tracks[cc.track].wrapDelta = 0;
+    looper->tracks[cc.track].startIdx =
+        (looper->masterCurrIdx > looper->tracks[cc.track].recordOffset) ?
+        looper->masterCurrIdx - looper->tracks[cc.track].recordOffset : 0;
+
     looper->tracks[cc.track].state = TRACK_STATE_RECORDING;
     looper->state = SYSTEM_STATE_RECORDING;
-    printf("Recording track %d on group %d, frame delay %d\n", cc.track, cc.group, looper->rec_frame_delay);
+    logEvent(LOG_MSG_RECORDING, cc.track, cc.group, looper->tracks[cc.track].recordOffset);
 }
 
 /*
@@ -144,9 +180,39 @@ static void startOverdubbing(void)
 
     looper->selectedTrack = cc.track;
 
+    // The performer plays along to the track itself
+    looper->tracks[cc.track].recordOffset = looper->recordLatency;
     looper->tracks[cc.track].state = TRACK_STATE_RECORDING;
     looper->state = SYSTEM_STATE_OVERDUBBING;
-    printf("Overdubbing track %d\n", cc.track);
+    undoBegin(&looper->tracks[cc.track]);
+    logEvent(LOG_MSG_OVERDUBBING, cc.track, 0, 0);
+}
+
+/*
+ * Function: rewindGroup
+ * Input: group to rewind
+ * Output: none
+ * Description:
+ *   The master index has just been reset to the top of the loop, bring the
+ *   group's tracks back to their loop start in the same frame
+ *
+ */
+static void rewindGroup(uint8_t group)
+{
+    uint32_t members = looper->groupMembers[group];
+    struct Track *track;
+    uint32_t idx;
+    while (members)
+    {
+        track = &looper->tracks[nextTrack(&members)];
+        idx = (track->repeat) ? track->startIdx : 0;
+        if (track->currIdx != idx)
+        {
+            track->cutIdx = track->currIdx;
+        }
+        track->wrapDelta = track->currIdx - idx;
+        track->currIdx = idx;
+    }
 }
 
 /*
@@ -155,6 +221,7 @@ static void startOverdubbing(void)
  * Output: none
  * Description:
  *   For the recording track and group, update indexes and set states to playback
+ *   Runs on the exact frame the command was received on, so the track ends here
  *
  */
 static void stopRecording(void)
@@ -169,17 +236,33 @@ static void stopRecording(void)
         looper->tracks[cc.track].repeat = cc.repeat;
     }
 
-    looper->tracks[cc.track].endIdx = looper->tracks[cc.track].currIdx + looper->play_frame_delay;
+    looper->tracks[cc.track].endIdx =
+        (looper->tracks[cc.track].currIdx > looper->tracks[cc.track].recordOffset) ?
+        looper->tracks[cc.track].currIdx - looper->tracks[cc.track].recordOffset : 0;
+    trackUpdateActive(looper, cc.track);
+    trackPublish(&looper->tracks[cc.track]);
 
-    if (looper->masterLength[cc.group] < looper->masterCurrIdx)
+    looper->state = SYSTEM_STATE_PLAYBACK;
+    looper->tracks[cc.track].state = TRACK_STATE_PLAYBACK;
+
+    // recording ran to or past the end of the loop - this frame becomes the loop point
+    if (looper->masterLength[cc.group] <= looper->masterCurrIdx)
     {
-        looper->masterLength[cc.group] = looper->masterCurrIdx + looper->play_frame_delay;
+        looper->masterLength[cc.group] = looper->masterCurrIdx;
         looper->masterCurrIdx = 0;
+        rewindGroup(cc.group);
+    }
+    // the take's first pass follows the recording, not a cut, the input from
+    // here on is its tail
+    looper->tracks[cc.track].cutIdx = 0;
+    looper->tracks[cc.track].tailDue = (looper->tracks[cc.track].endIdx > 0) ? LOOP_SEAM_FADE_FRAMES : 0;
+    // the first loop of the group is the quantize grid
+    if (looper->barLength[cc.group] == 0)
+    {
+        looper->barLength[cc.group] = looper->masterLength[cc.group];
     }
 
-    looper->state = SYSTEM_STATE_PLAYBACK;
-    looper->tracks[cc.track].state = TRACK_STATE_PLAYBACK;
-    printf("Playing track %d, frame delay %d\n", cc.track, looper->play_frame_delay);
+    logEvent(LOG_MSG_PLAYING_LENGTH, cc.track, looper->tracks[cc.track].endIdx, 0);
 }
 
 /*
@@ -202,18 +285,15 @@ static void stopOverdubbing(void)
         looper->tracks[cc.track].repeat = cc.repeat;
     }
 
-    if (looper->tracks[cc.track].endIdx < looper->tracks[cc.track].currIdx)
-    {
-        looper->tracks[cc.track].endIdx = looper->tracks[cc.track].currIdx + looper->play_frame_delay;
-    }
-    if (looper->masterLength[cc.group] < looper->masterCurrIdx)
-    {
-        looper->masterLength[cc.group] = looper->masterCurrIdx + looper->play_frame_delay;
-        looper->masterCurrIdx = 0;
-    }
+    // the overdub only wrote inside the track, its end stays where it was so
+    // the pass can be undone as a whole
+    undoEnd(&looper->tracks[cc.track]);
+    // the overdub changed audio the session writer already has
+    trackNewTake(&looper->tracks[cc.track]);
+    // the master kept looping through the overdub
     looper->state = SYSTEM_STATE_PLAYBACK;
     looper->tracks[cc.track].state = TRACK_STATE_PLAYBACK;
-    printf("Playing track %d\n", cc.track);
+    logEvent(LOG_MSG_PLAYING, cc.track, 0, 0);
 }
 
 /*
@@ -233,28 +313,34 @@ static void resetSystem(void)
     for (group = 0; group < NUM_GROUPS; group++)
     {
         looper->masterLength[group] = 0;
+        looper->barLength[group] = 0;
+        looper->groupMembers[group] = 0;
+        looper->activeTracks[group] = 0;
+        looper->numActiveTracks[group] = 0;
     }
     looper->masterCurrIdx = 0;
     looper->selectedTrack = 0;
     looper->selectedGroup = 0;
     looper->monitoringOff = false;
-    looper->controlLocked = false;
 
     // Update tracks
     for (track = 0; track < NUM_TRACKS; track++)
     {
         looper->tracks[track].state = TRACK_STATE_OFF;
+        trackRelease(&looper->tracks[track]);
         looper->tracks[track].endIdx = 0;
         looper->tracks[track].currIdx = 0;
         looper->tracks[track].startIdx = 0;
         looper->tracks[track].repeat = false;
+        trackNewTake(&looper->tracks[track]);
         for (group = 0; group < NUM_GROUPS; group++)
         {
             looper->groupedTracks[group][track] = NULL;
         }
     }
     looper->state = SYSTEM_STATE_PASSTHROUGH;
-    printf("System reset\n");
+    pending[DEFERRED_SLOT] = false;
+    logEvent(LOG_MSG_SYSTEM_RESET, 0, 0, 0);
 }
 
 /*
@@ -262,7 +348,7 @@ static void resetSystem(void)
  * Input: none
  * Output: none
  * Description:
- *   Change the selected track to mute
+ *   Change the selected track to mute, the mix fades it out over TRACK_FADE_MS
  *
  */
 static void muteTrack(void)
@@ -281,7 +367,7 @@ static void muteTrack(void)
  * Input: none
  * Output: none
  * Description:
- *   Change selected track to playback
+ *   Change selected track to playback, the mix fades it back in
  *
  */
 static void unmuteTrack(void)
@@ -305,8 +391,8 @@ static void unmuteTrack(void)
  */
 static void assignTrackToGroup(void)
 {
-    looper->groupedTracks[cc.group][cc.track] = &looper->tracks[cc.track];
-    printf("Add track %d to group %d\n", cc.track, cc.group);
+    groupAddTrack(cc.group, cc.track);
+    logEvent(LOG_MSG_ADD_TRACK, cc.track, cc.group, 0);
 }
 
 /*
@@ -319,8 +405,8 @@ static void assignTrackToGroup(void)
  */
 static void removeTrackFromGroup(void)
 {
-    looper->groupedTracks[cc.group][cc.track] = NULL;
-    printf("Remove track %d from group %d\n", cc.track, cc.group);
+    groupRemoveTrack(cc.group, cc.track);
+    logEvent(LOG_MSG_REMOVE_TRACK, cc.track, cc.group, 0);
 }
 
 /*
@@ -336,26 +422,271 @@ static void removeTrackFromGroup(void)
 static void setActiveGroup(void)
 {
     looper->selectedGroup = cc.group;
+    uint32_t members = looper->groupMembers[looper->selectedGroup];
     int track = 0;
     for (track = 0; track < NUM_TRACKS; track++)
     {
-        if (looper->groupedTracks[looper->selectedGroup][track]->state != TRACK_STATE_OFF)
+        if (looper->tracks[track].state != TRACK_STATE_OFF)
         {
             looper->tracks[track].state = TRACK_STATE_MUTE;
         }
     }
 
-    for (track = 0; track < NUM_TRACKS; track++)
+    while (members)
     {
-        if ((looper->groupedTracks[looper->selectedGroup][track]) &&
-           (looper->groupedTracks[looper->selectedGroup][track]->state != TRACK_STATE_OFF))
+        track = nextTrack(&members);
+        if (looper->tracks[track].state != TRACK_STATE_OFF)
         {
-            looper->groupedTracks[looper->selectedGroup][track]->state = TRACK_STATE_PLAYBACK;
-            looper->tracks[track].currIdx = (looper->tracks[track].repeat) ? looper->tracks[track].startIdx : 0;            
+            looper->tracks[track].state = TRACK_STATE_PLAYBACK;
+            looper->tracks[track].currIdx = (looper->tracks[track].repeat) ? looper->tracks[track].startIdx : 0;
+            // the group restarts from the top, fade in rather than cut in
+            looper->tracks[track].levelLeft = 0.0f;
+            looper->tracks[track].levelRight = 0.0f;
         }
     }
     looper->masterCurrIdx = 0;
-    printf("Setting group to %d\n", looper->selectedGroup);
+    logEvent(LOG_MSG_SET_GROUP, looper->selectedGroup, 0, 0);
+}
+
+/*
+ * Function: setTrackGain
+ * Input: none
+ * Output: none
+ * Description:
+ *   Set the track's gain from the command level, TRACK_GAIN_UNITY_LEVEL is unity
+ *   The mix ramps to it, a track may be set before it is recorded
+ *
+ */
+static void setTrackGain(void)
+{
+    looper->tracks[cc.track].gain = (float)cc.value / TRACK_GAIN_UNITY_LEVEL;
+    logEvent(LOG_MSG_SET_GAIN, cc.track, cc.value, 0);
+}
+
+/*
+ * Function: setTrackPan
+ * Input: none
+ * Output: none
+ * Description:
+ *   Set the track's pan from the command level, TRACK_PAN_CENTRE_LEVEL is the
+ *   centre, 1 below it hard left and 99 hard right
+ *
+ */
+static void setTrackPan(void)
+{
+    float pan = ((float)cc.value - TRACK_PAN_CENTRE_LEVEL) / (99 - TRACK_PAN_CENTRE_LEVEL);
+    looper->tracks[cc.track].pan = (pan < -1.0f) ? -1.0f : (pan > 1.0f) ? 1.0f : pan;
+    logEvent(LOG_MSG_SET_PAN, cc.track, cc.value, 0);
+}
+
+/*
+ * Function: bounceGroup
+ * Input: none
+ * Output: none
+ * Description:
+ *   Merge the group's playing tracks into the given track, rendered in the
+ *   background and swapped in once done, see bounce.c
+ *
+ */
+static void bounceGroup(void)
+{
+    bounceStart(cc.group, cc.track);
+}
+
+/*
+ * Function: setQuantize
+ * Input: none
+ * Output: none
+ * Description:
+ *   Set the grid later recordings start and stop on, the command value is
+ *   the number of points in the first loop, 0 turns quantizing off
+ *
+ */
+static void setQuantize(void)
+{
+    looper->quantizeDivisions = cc.value;
+    logEvent(LOG_MSG_SET_QUANTIZE, cc.value, 0, 0);
+}
+
+/*
+ * Function: setTrackInput
+ * Input: none
+ * Output: none
+ * Description:
+ *   Route a track to the port pair it records and overdubs from, the command
+ *   value is the pair. A take under way keeps the channel count it started
+ *   with, a pair that is not registered is ignored
+ *
+ */
+static void setTrackInput(void)
+{
+    if (cc.value < looper->numPortPairs)
+    {
+        looper->tracks[cc.track].inputPair = cc.value;
+        logEvent(LOG_MSG_SET_INPUT, cc.track, cc.value, 0);
+    }
+}
+
+/*
+ * Function: isQuantized
+ * Input: pointer to a command
+ * Output: true if the command waits for the grid in the current state
+ * Description:
+ *   Starting or stopping the recording of a track played along to other
+ *   tracks, barLength is only set once the first loop is. Checked again when
+ *   a deferred command comes due
+ *
+ */
+static bool isQuantized(const struct ControlCommand *cmd)
+{
+    return ((cmd->event == SYSTEM_EVENT_RECORD_TRACK) && (looper->state == SYSTEM_STATE_PLAYBACK) &&
+            (!startsNewLoop(cmd->group, cmd->track))) ||
+           ((cmd->event == SYSTEM_EVENT_PLAY_TRACK) && (looper->state == SYSTEM_STATE_RECORDING));
+}
+
+/*
+ * Function: quantizeDelay
+ * Input: pointer to a command that is due
+ * Output: frames to the next grid point, 0 to apply the command now
+ * Description:
+ *   Starting or stopping the recording of a track played along to other
+ *   tracks waits for the next grid point. Point k of the grid is master
+ *   frame k * barLength / quantizeDivisions, so points a loop apart stay
+ *   exactly a loop apart. In playback the top of the loop is a point
+ *
+ */
+static uint32_t quantizeDelay(const struct ControlCommand *cmd)
+{
+    uint8_t sg = looper->selectedGroup;
+    uint32_t bar = looper->barLength[sg];
+    uint32_t idx = looper->masterCurrIdx;
+    uint64_t point;
+    uint32_t frame;
+
+    if ((looper->quantizeDivisions == 0) || (bar == 0) || (!isQuantized(cmd)))
+    {
+        return 0;
+    }
+
+    point = (((uint64_t)idx * looper->quantizeDivisions) + bar - 1) / bar;
+    frame = (uint32_t)((point * bar) / looper->quantizeDivisions);
+    if ((looper->state == SYSTEM_STATE_PLAYBACK) && (frame > looper->masterLength[sg]))
+    {
+        frame = looper->masterLength[sg];
+    }
+    return (frame > idx) ? frame - idx : 0;
+}
+
+/*
+ * Function: nextEmptyTrack
+ * Input: none
+ * Output: first track with nothing recorded, NUM_TRACKS if every track is taken
+ *
+ */
+static uint8_t nextEmptyTrack(void)
+{
+    uint8_t track;
+
+    for (track = 0; track < NUM_TRACKS; track++)
+    {
+        if ((looper->tracks[track].endIdx == 0) &&
+            (looper->tracks[track].state == TRACK_STATE_OFF))
+        {
+            break;
+        }
+    }
+    return track;
+}
+
+/*
+ * Function: mapFootswitch
+ * Input: none
+ * Output: false if the press leaves nothing to apply
+ * Description:
+ *   Turn the footswitch press in cc into the command it stands for, from the
+ *   state on the frame it lands on. Record and overdub play instead while
+ *   recording or overdubbing, and take back a start or stop that is waiting
+ *   for its grid point, so a second press always undoes the first
+ *
+ */
+static bool mapFootswitch(void)
+{
+    bool stopping = (looper->state == SYSTEM_STATE_RECORDING) ||
+                    (looper->state == SYSTEM_STATE_OVERDUBBING);
+
+    cc.group = looper->selectedGroup;
+    cc.track = looper->selectedTrack;
+    cc.repeat = false;
+    switch (cc.value)
+    {
+        case FOOTSWITCH_ACTION_RECORD:
+        case FOOTSWITCH_ACTION_OVERDUB:
+            if (pending[DEFERRED_SLOT])
+            {
+                pending[DEFERRED_SLOT] = false;
+                logEvent(LOG_MSG_QUANTIZE_CANCEL, pendingCmd[DEFERRED_SLOT].event, 0, 0);
+                return false;
+            }
+            if (stopping)
+            {
+                cc.event = SYSTEM_EVENT_PLAY_TRACK;
+                startTimer(TIMER_RECORD_STOP_DELAY);
+            }
+            else if (cc.value == FOOTSWITCH_ACTION_RECORD)
+            {
+                cc.event = SYSTEM_EVENT_RECORD_TRACK;
+                cc.track = nextEmptyTrack();
+                if (cc.track >= NUM_TRACKS)
+                {
+                    logEvent(LOG_MSG_NO_EMPTY_TRACK, cc.group, 0, 0);
+                    return false;
+                }
+                startTimer(TIMER_RECORD_START_DELAY);
+            }
+            else
+            {
+                cc.event = SYSTEM_EVENT_OVERDUB_TRACK;
+                startTimer(TIMER_RECORD_START_DELAY);
+            }
+            break;
+        case FOOTSWITCH_ACTION_UNDO:
+            cc.event = SYSTEM_EVENT_UNDO_TRACK;
+            break;
+        case FOOTSWITCH_ACTION_RESET:
+        default:
+            cc.event = SYSTEM_EVENT_PASSTHROUGH;
+            cc.group = 0;
+            break;
+    }
+    return true;
+}
+
+/*
+ * Function: undoOverdub
+ * Input: false to undo, true to redo
+ * Output: none
+ * Description:
+ *   Swap the track's last overdub pass out, or the last one undone back in,
+ *   see undo.c
+ *
+ */
+static void undoOverdub(bool redo)
+{
+    struct Track *track = &looper->tracks[cc.track];
+    uint32_t chunks = 0;
+
+    if ((track->state != TRACK_STATE_OFF) && (track->state != TRACK_STATE_RECORDING))
+    {
+        chunks = undoStep(track, redo);
+    }
+    if (chunks == 0)
+    {
+        logEvent((redo) ? LOG_MSG_REDO_EMPTY : LOG_MSG_UNDO_EMPTY, cc.track, 0, 0);
+        return;
+    }
+    trackNewTake(track);
+    logEvent((redo) ? LOG_MSG_REDO : LOG_MSG_UNDO, cc.track, chunks,
+        (redo) ? track->history.numLayers - track->history.applied : track->history.applied);
 }
 
 /*
@@ -376,11 +707,11 @@ static void updateRepeatStatus(void)
         looper->tracks[cc.track].repeat = cc.repeat;
         if (cc.repeat)
         {
-            printf("Repeat enabled for track %d\n", cc.track);
+            logEvent(LOG_MSG_REPEAT_ON, cc.track, 0, 0);
         }
         else
         {
-            printf("Repeat disabled for track %d\n", cc.track);
+            logEvent(LOG_MSG_REPEAT_OFF, cc.track, 0, 0);
         }
     }
 }
@@ -417,6 +748,24 @@ static void eventHandlerPassthrough(event)
             break;
         case SYSTEM_EVENT_SET_ACTIVE_GROUP:          // Do nothing
             break;
+        case SYSTEM_EVENT_SET_GAIN:                  // Set a track's gain - track # & value required
+            setTrackGain();
+            break;
+        case SYSTEM_EVENT_SET_PAN:                   // Set a track's pan - track # & value required
+            setTrackPan();
+            break;
+        case SYSTEM_EVENT_BOUNCE_GROUP:              // Do nothing
+            break;
+        case SYSTEM_EVENT_UNDO_TRACK:                // Do nothing
+            break;
+        case SYSTEM_EVENT_REDO_TRACK:                // Do nothing
+            break;
+        case SYSTEM_EVENT_SET_QUANTIZE:              // Set the record grid - value required
+            setQuantize();
+            break;
+        case SYSTEM_EVENT_SET_INPUT:                 // Set a track's input pair - track # & value required
+            setTrackInput();
+            break;
         default:
             break;
     }
@@ -461,6 +810,27 @@ static void eventHandlerPlayback(event)
         case SYSTEM_EVENT_SET_ACTIVE_GROUP:          // Sets the currently active group - group # required
             setActiveGroup();
             break;
+        case SYSTEM_EVENT_SET_GAIN:                  // Set a track's gain - track # & value required
+            setTrackGain();
+            break;
+        case SYSTEM_EVENT_SET_PAN:                   // Set a track's pan - track # & value required
+            setTrackPan();
+            break;
+        case SYSTEM_EVENT_BOUNCE_GROUP:              // Merge the group's playing tracks into a track - track # & group # required
+            bounceGroup();
+            break;
+        case SYSTEM_EVENT_UNDO_TRACK:                // Take back the track's last overdub pass - track # required
+            undoOverdub(false);
+            break;
+        case SYSTEM_EVENT_REDO_TRACK:                // Put back the last overdub pass undone - track # required
+            undoOverdub(true);
+            break;
+        case SYSTEM_EVENT_SET_QUANTIZE:              // Set the record grid - value required
+            setQuantize();
+            break;
+        case SYSTEM_EVENT_SET_INPUT:                 // Set a track's input pair - track # & value required
+            setTrackInput();
+            break;
         default:
             break;
     }
@@ -498,6 +868,24 @@ static void eventHandlerRecording(event)
             break;
         case SYSTEM_EVENT_SET_ACTIVE_GROUP:          // Do nothing
             break;
+        case SYSTEM_EVENT_SET_GAIN:                  // Set a track's gain - track # & value required
+            setTrackGain();
+            break;
+        case SYSTEM_EVENT_SET_PAN:                   // Set a track's pan - track # & value required
+            setTrackPan();
+            break;
+        case SYSTEM_EVENT_BOUNCE_GROUP:              // Do nothing
+            break;
+        case SYSTEM_EVENT_UNDO_TRACK:                // Do nothing
+            break;
+        case SYSTEM_EVENT_REDO_TRACK:                // Do nothing
+            break;
+        case SYSTEM_EVENT_SET_QUANTIZE:              // Set the record grid - value required
+            setQuantize();
+            break;
+        case SYSTEM_EVENT_SET_INPUT:                 // Set a track's input pair - track # & value required
+            setTrackInput();
+            break;
         default:
             break;
     }
@@ -535,6 +923,24 @@ static void eventHandlerOverdubbing(event)
             break;
         case SYSTEM_EVENT_SET_ACTIVE_GROUP:          // Do nothing
             break;
+        case SYSTEM_EVENT_SET_GAIN:                  // Set a track's gain - track # & value required
+            setTrackGain();
+            break;
+        case SYSTEM_EVENT_SET_PAN:                   // Set a track's pan - track # & value required
+            setTrackPan();
+            break;
+        case SYSTEM_EVENT_BOUNCE_GROUP:              // Do nothing
+            break;
+        case SYSTEM_EVENT_UNDO_TRACK:                // Do nothing
+            break;
+        case SYSTEM_EVENT_REDO_TRACK:                // Do nothing
+            break;
+        case SYSTEM_EVENT_SET_QUANTIZE:              // Set the record grid - value required
+            setQuantize();
+            break;
+        case SYSTEM_EVENT_SET_INPUT:                 // Set a track's input pair - track # & value required
+            setTrackInput();
+            break;
         default:
             break;
     }
@@ -569,214 +975,135 @@ static void controlStateMachine(uint8_t event)
     }
 }
 
+/**************************************************************
+ * Public functions
+ *************************************************************/
+
 /*
- * Function: processUART
- * Input: character buffer from UART
- * Output: none
+ * Function: controlFrameTime
+ * Input: none
+ * Output: the current frame, the frameTime of a command received now
  * Description:
- *   Processing the UART buffer for 5 characters plus either 'r' for repeat or
- *   carriage return, char 13.
- *   Commands are processed and data, track or group, is checked and changes stored
- *   in the static struct for control context
+ *   For the interface threads, jack_last_frame_time is only valid in the
+ *   process callback, jack_frame_time gives the frame from any thread
  *
  */
-static void processUART(char buf[])
+jack_nframes_t controlFrameTime(void)
 {
-    bool invalidData = false;
-
-    if ((looper->min_serial_data_length >= MIN_SERIAL_DATA_LENGTH) &&
-        (buf[SERIAL_LAST_CHAR] != 13) &&
-        (buf[SERIAL_LAST_CHAR] != SERIAL_CMD_OPTION_REPEAT_ON) &&
-        (buf[SERIAL_LAST_CHAR] != SERIAL_CMD_OPTION_REPEAT_OFF))
-    {
-        printf("Invalid last char\n");
-        serialFlush(looper->sfd);
-        return;
-    }
-
-    switch(buf[SERIAL_CMD_OFFSET])
-    {
-        case SERIAL_CMD_OVERDUB_LC:
-        case SERIAL_CMD_OVERDUB_UC:
-            cc.event = SYSTEM_EVENT_OVERDUB_TRACK;
-            cc.track = (buf[SERIAL_TRACK_UPPER_DIGIT] - 48) * 10;
-            cc.track += (buf[SERIAL_TRACK_LOWER_DIGIT] - 48);
-            break;
-        case SERIAL_CMD_RECORD_LC:
-        case SERIAL_CMD_RECORD_UC:
-            if ((buf[SERIAL_SUB_CMD_OFFSET] == SERIAL_CMD_GROUP_SELECT_LC) ||
-                (buf[SERIAL_SUB_CMD_OFFSET] == SERIAL_CMD_GROUP_SELECT_UC))
-            {
-                printf("Recording CC %d\n",looper->callCounter);
-                cc.event = SYSTEM_EVENT_RECORD_TRACK;
-                cc.track = (buf[SERIAL_TRACK_UPPER_DIGIT] - 48) * 10;
-                cc.track += (buf[SERIAL_TRACK_LOWER_DIGIT] - 48);
-                cc.group = (buf[SERIAL_TRACK_GROUP_LOWER_DIGIT] - 48);
-            }
-            break;
-        case SERIAL_CMD_TRACK_MUTE_LC: // set track to mute
-        case SERIAL_CMD_TRACK_MUTE_UC:
-            cc.event = SYSTEM_EVENT_MUTE_TRACK;
-            cc.track = (buf[SERIAL_TRACK_UPPER_DIGIT] - 48) * 10;
-            cc.track += (buf[SERIAL_TRACK_LOWER_DIGIT] - 48);
-            break;
-        case SERIAL_CMD_TRACK_UNMUTE_LC: // set track to play
-        case SERIAL_CMD_TRACK_UNMUTE_UC:
-            cc.event = SYSTEM_EVENT_UNMUTE_TRACK;
-            cc.track = (buf[SERIAL_TRACK_UPPER_DIGIT] - 48) * 10;
-            cc.track += (buf[SERIAL_TRACK_LOWER_DIGIT] - 48);
-            break;
-        case SERIAL_CMD_ADD_TRACK2GROUP_LC: // add track to group
-        case SERIAL_CMD_ADD_TRACK2GROUP_UC:
-            if ((buf[SERIAL_SUB_CMD_OFFSET] == SERIAL_CMD_GROUP_SELECT_LC) ||
-                (buf[SERIAL_SUB_CMD_OFFSET] == SERIAL_CMD_GROUP_SELECT_UC))
-            {
-                cc.event = SYSTEM_EVENT_ADD_TRACK_TO_GROUP;
-                cc.track = (buf[SERIAL_TRACK_UPPER_DIGIT] - 48) * 10;
-                cc.track += (buf[SERIAL_TRACK_LOWER_DIGIT] - 48);
-                cc.group = (buf[SERIAL_TRACK_GROUP_LOWER_DIGIT] - 48);
-            }
-            break;
-        case SERIAL_CMD_RMV_TRACK_GROUP_LC: // remove track from group
-        case SERIAL_CMD_RMV_TRACK_GROUP_UC:
-            if ((buf[SERIAL_SUB_CMD_OFFSET] == SERIAL_CMD_GROUP_SELECT_LC) ||
-                (buf[SERIAL_SUB_CMD_OFFSET] == SERIAL_CMD_GROUP_SELECT_UC))
-            {
-                cc.event = SYSTEM_EVENT_REMOVE_TRACK_FROM_GROUP;
-                cc.track = (buf[SERIAL_TRACK_UPPER_DIGIT] - 48) * 10;
-                cc.track += (buf[SERIAL_TRACK_LOWER_DIGIT] - 48);
-                cc.group = (buf[SERIAL_TRACK_GROUP_LOWER_DIGIT] - 48);
-            }
-            break;
-        case SERIAL_CMD_GROUP_SELECT_LC: // select active group
-        case SERIAL_CMD_GROUP_SELECT_UC:
-            cc.event = SYSTEM_EVENT_SET_ACTIVE_GROUP;
-            cc.group = (buf[SERIAL_GROUP_SELECT_LOWER_DIGIT] - 48);
-            break;
-        case SERIAL_CMD_PLAY_LC: // set system to play
-        case SERIAL_CMD_PLAY_UC:
-            cc.event = SYSTEM_EVENT_PLAY_TRACK;
-            printf("Playing CC %d\n", looper->callCounter);
-            if (buf[SERIAL_LAST_CHAR] == SERIAL_CMD_OPTION_REPEAT_ON)
-            {
-                cc.track = (buf[SERIAL_TRACK_UPPER_DIGIT] - 48) * 10;
-                cc.track += (buf[SERIAL_TRACK_LOWER_DIGIT] - 48);
-                cc.repeat = true;
-            }
-            if (buf[SERIAL_LAST_CHAR] == SERIAL_CMD_OPTION_REPEAT_OFF)
-            {
-                cc.track = (buf[SERIAL_TRACK_UPPER_DIGIT] - 48) * 10;
-                cc.track += (buf[SERIAL_TRACK_LOWER_DIGIT] - 48);
-                cc.repeat = false;
-            }
-            break;
-        case SERIAL_CMD_SYSTEM_RESET_LC: // set system to passthrough
-        case SERIAL_CMD_SYSTEM_RESET_UC:
-            cc.track = 0;
-            cc.group = 0;
-            cc.event = SYSTEM_EVENT_PASSTHROUGH;
-            break;
-        case SERIAL_CMD_QUIT_LC: // exit application
-        case SERIAL_CMD_QUIT_UC:
-            printf("quitting\n");
-            looper->exitNow = true;
-            break;
-        default:
-            invalidData = true;
-            break;
-    }
-
-    if ((cc.track >= 0) && (cc.track < NUM_TRACKS) &&
-        (cc.group >= 0) && (cc.group < NUM_GROUPS) &&
-        (invalidData == false))    
-    {
-        cc.updated = true;
-        serialPutchar(looper->sfd, SERIAL_CMD_ACCEPTED);
-    }
-    else
-    {
-        printf("\n** Invalid Cmd or Cmd args\n");
-        serialPutchar(looper->sfd, SERIAL_CMD_REJECTED);
-    }
+    return jack_frame_time(looper->client);
+}
 
-    serialFlush(looper->sfd);
+/*
+ * Function: controlQueueCommand
+ * Input: interface the command is from, see enum CommandSource
+ *        pointer to the command, frameTime set to the frame it was received on
+ * Output: false if the queue is full and the command was dropped
+ * Description:
+ *   Pass a command to the process callback, only one thread may queue for
+ *   each source
+ *
+ */
+bool controlQueueCommand(uint8_t source, const struct ControlCommand *cmd)
+{
+    return queuePush(&commandQueue[source], cmd);
 }
 
 /*
- * Function:  controlThread
- * Input: none
- * Output: none
+ * Function: controlPeekCommand
+ * Input: pointer to the frame time to fill
+ * Output: true if a command is waiting
  * Description:
- *   Main control thread to monitor user input interfaces
- *   Copy any data to the buffer for processing by the main thread
+ *   A public interface for the main process to find out if a command is queued
+ *   and the absolute frame it was received on, without applying it
+ *   Commands come out in the order they were received, across every source,
+ *   a quantized command in the order of its grid point
  *
  */
-static void *controlThread(void *arg)
+bool controlPeekCommand(jack_nframes_t *frameTime)
 {
-    struct pollfd fds[1];
-    fds[0].fd = looper->sfd;
-    fds[0].events = POLLIN;
-    int timeout = 20 * 1000; // check for exit every 1 sec
-    int rc;
-    int byte = 0;
-    char buf[] = {0,0,0,0,0,0};
-    serialFlush(looper->sfd);
-    while(!looper->exitNow)
+    uint8_t source;
+
+    nextSource = -1;
+    for (source = 0; source < COMMAND_SOURCE_COUNT; source++)
     {
-        rc = poll(fds, 1, timeout);
-        if (rc == -1)
+        if (!pending[source])
         {
-            printf("Poll error\n");
+            pending[source] = queuePop(&commandQueue[source], &pendingCmd[source]);
         }
-        if ((rc > 0) && (fds[0].revents & POLLIN))
+        if ((pending[source]) &&
+            ((nextSource < 0) ||
+             ((int32_t)(pendingCmd[source].frameTime - pendingCmd[nextSource].frameTime) < 0)))
         {
-            buf[byte] = serialGetchar(looper->sfd);
-            byte++;
-            if (byte == looper->min_serial_data_length)
-            {
-                if ((buf[0] == 'r') || (buf[0] == 'R') || (buf[0] == 'o') || (buf[0] == 'O'))
-                {
-                    looper->rec_frame_delay = jack_frames_since_cycle_start(looper->client);
-                    startTimer(TIMER_RECORD_START_DELAY);
-                }
-                if (((buf[0] == 'p') || (buf[0] == 'P')) && (looper->state == SYSTEM_STATE_RECORDING))
-                {
-                    looper->play_frame_delay = jack_frames_since_cycle_start(looper->client);
-                    startTimer(TIMER_RECORD_STOP_DELAY);
-                }
-
-                startTimer(TIMER_UART_PROCESS);
-                processUART(buf);
-                stopTimer(TIMER_UART_PROCESS);
-                byte = 0;
-            }
+            nextSource = source;
         }
     }
-
-    printf("control thread exiting\n");
-    pthread_exit(NULL);
+    if ((pending[DEFERRED_SLOT]) &&
+        ((nextSource < 0) ||
+         ((int32_t)(pendingCmd[DEFERRED_SLOT].frameTime - pendingCmd[nextSource].frameTime) < 0)))
+    {
+        nextSource = DEFERRED_SLOT;
+    }
+    if (nextSource >= 0)
+    {
+        *frameTime = pendingCmd[nextSource].frameTime;
+    }
+    return (nextSource >= 0);
 }
 
-
-/**************************************************************
- * Public functions
- *************************************************************/
-
 /*
- * Function: controlStateCheck
- * Input: none
+ * Function: controlApplyCommand
+ * Input: absolute frame the command is applied on
  * Output: none
  * Description:
- *   A public interface for the main process to determine if the control state has changed
- *   and if changed, process the changes
+ *   Process the command returned by controlPeekCommand, the main process calls
+ *   this once it has run every frame before the command's frame
+ *   A footswitch press becomes its command here, see mapFootswitch
+ *   A quantized command is stamped with its grid point instead and moved to
+ *   its own slot, replacing any command already there, so its source keeps
+ *   draining. It is dropped when the state changes before it comes due
  *
  */
-void controlStateCheck(void)
+void controlApplyCommand(jack_nframes_t frameTime)
 {
-    if (cc.updated)
+    uint8_t state = looper->state;
+    uint32_t delay;
+
+    if (nextSource < 0)
     {
-        controlStateMachine(cc.event);
-        cc.updated = false;
+        return;
+    }
+    cc = pendingCmd[nextSource];
+    pending[nextSource] = false;
+    if (nextSource == DEFERRED_SLOT)
+    {
+        nextSource = -1;
+        if (!isQuantized(&cc))
+        {
+            logEvent(LOG_MSG_QUANTIZE_DROP, cc.event, 0, 0);
+            return;
+        }
+    }
+    else
+    {
+        nextSource = -1;
+        if ((cc.event == SYSTEM_EVENT_FOOTSWITCH) && (!mapFootswitch()))
+        {
+            return;
+        }
+        delay = quantizeDelay(&cc);
+        if (delay > 0)
+        {
+            pendingCmd[DEFERRED_SLOT] = cc;
+            pendingCmd[DEFERRED_SLOT].frameTime = frameTime + delay;
+            pending[DEFERRED_SLOT] = true;
+            logEvent(LOG_MSG_QUANTIZE, cc.event, delay, 0);
+            return;
+        }
+    }
+    controlStateMachine(cc.event);
+    if (looper->state != state)
+    {
+        pending[DEFERRED_SLOT] = false;
     }
 }
 
@@ -785,52 +1112,28 @@ void controlStateCheck(void)
  * Input: pointer to the master looper context
  * Output: pass/fail of init process
  * Description:
- *   Intialize the serial port, create the serial monitoring thread
+ *   Intialize the command queues, track levels and quantize grid. Call
+ *   before any interface starts queueing, the session restores tracks and
+ *   the client is activated, MIDI queues from the process callback
  *
  */
 bool controlInit(struct MasterLooper *mLooper)
 {
     looper = mLooper;
-
-    if (wiringPiSetup() == -1)
+    looper->quantizeDivisions = QUANTIZE_DIVISIONS;
+    uint8_t source;
+    for (source = 0; source < COMMAND_SOURCE_COUNT; source++)
     {
-        printf("WiringPiSetup failed\n");
-        return false;
+        queueInit(&commandQueue[source], commandRecords[source], COMMAND_QUEUE_SLOTS,
+            sizeof(struct ControlCommand));
     }
 
-    looper->sfd = serialOpen("/dev/ttyAMA0",  115200);
-    if (looper->sfd < 0)
+    int track = 0;
+    for (track = 0; track < NUM_TRACKS; track++)
     {
-        printf("Error setting up serial port\n");
-        return false;
+        looper->tracks[track].gain = 1.0f;
+        looper->tracks[track].pan = 0.0f;
     }
-    serialFlush(looper->sfd);
-    looper->min_serial_data_length = MIN_SERIAL_DATA_LENGTH;
-
-    // Setup interface monitoring thread
-    int rc;
-    if ((rc = pthread_create(&looper->controlTh, NULL, controlThread, NULL)))
-    {
-        printf("Error: pthread_create, rc: %d\n", rc);
-        return false;
-    }
-/*
-    // Testing for offset managment -- sync track 1 to track 0
-    int j = 0;
-    for (j=0; j<TRACK_DEBUG_FRAME_COUNT; j++)
-      looper->tracks[0].channelLeft[j] = FLT_MAX;
-
-    looper->tracks[0].endIdx = TRACK_DEBUG_FRAME_COUNT;
-    looper->selectedGroup = 1;
-    looper->selectedTrack = 1;
-    looper->groupedTracks[1][0] = &looper->tracks[0];
-    looper->tracks[0].state = TRACK_STATE_PLAYBACK;
-    looper->masterLength[1] = TRACK_DEBUG_FRAME_COUNT;
-    looper->state = SYSTEM_STATE_PLAYBACK;
-*/
-//    looper->groupedTracks[0][1] = &looper->tracks[1];
-//    looper->tracks[1].state = TRACK_STATE_RECORDING;
-//    looper->state = SYSTEM_STATE_CALIBRATION;
 
     return true;
 }
@@ -838,23 +1141,15 @@ bool controlInit(struct MasterLooper *mLooper)
 /*
  * Function: getNumActiveTracks
  * Input: none
- * Output: number of active tracks, regardless of group
+ * Output: number of active tracks in the selected group
  * Description:
- *   Determine the number of tracks that have recorded data, endIdx is 0 if track is empty or reset
+ *   Number of tracks in the selected group that have recorded data, endIdx is 0 if track is empty or reset
+ *   Kept up to date as tracks are recorded, grouped and reset, see trackUpdateActive
  *
  */
 int getNumActiveTracks(void)
 {
-    int track = 0;
-    int activeTracks = 0;
-    for (track = 0; track < NUM_TRACKS; track++)
-    {
-        if (looper->groupedTracks[looper->selectedGroup][track]->endIdx > 0)
-        {
-            activeTracks++;
-        }
-    }
-    return activeTracks;
+    return looper->numActiveTracks[looper->selectedGroup];
 }
 
 
@@ -0,0 +1,538 @@
+/**************************************************************
+ * Copyright (C) 2017 by Chan Russell, Robert                 *
+ *                                                            *
+ * Project: Audio Looper                                      *
+ *                                                            *
+ * This file contains the vectorized sample kernels used by   *
+ * the mixdown and overdub paths                              *
+ *                                                            *
+ * Functionality:                                             *
+ * - Accumulate a contiguous sample range into a buffer       *
+ * - Mix tracks with per block gain ramps                     *
+ * - Soft clip of the master bus, once per block              *
+ * - Conversion between Jack samples and the track storage    *
+ *   format, see TRACK_FORMAT                                 *
+ * - NEON on the Pi, SSE/AVX on x86, plain C otherwise        *
+ *                                                            *
+ *************************************************************/
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdbool.h>
+
+#include "local.h"
+
+#if defined(__ARM_NEON) || defined(__ARM_NEON__)
+#include <arm_neon.h>
+#define DSP_USE_NEON
+#elif defined(__AVX__)
+#include <immintrin.h>
+#define DSP_USE_AVX
+#elif defined(__SSE__)
+#include <xmmintrin.h>
+#define DSP_USE_SSE
+#endif
+#if defined(__SSE2__)
+#include <emmintrin.h>
+#define DSP_USE_SSE2
+#endif
+
+/**************************************************************
+ * Macros and defines                                         *
+ *************************************************************/
+#define LIMITER_KNEE        (0.9f)  // soft clip starts here, Jack full scale is 1.0
+#define TRACK_SAMPLE_MIN    (-32768.0f)
+#define TRACK_SAMPLE_MAX    (32767.0f)
+
+// Vector path for the track mix kernels, int16 tracks are widened with SSE2
+#if defined(DSP_USE_NEON)
+#elif (TRACK_FORMAT == TRACK_FORMAT_FLOAT) && defined(DSP_USE_AVX)
+#define DSP_TRACK_AVX
+#elif (TRACK_FORMAT == TRACK_FORMAT_FLOAT) && defined(DSP_USE_SSE)
+#define DSP_TRACK_SSE
+#elif (TRACK_FORMAT != TRACK_FORMAT_FLOAT) && defined(DSP_USE_SSE2)
+#define DSP_TRACK_SSE
+#endif
+
+/**************************************************************
+ * Data types                                                 *
+ *************************************************************/
+
+/**************************************************************
+ * Static functions
+ *************************************************************/
+
+#if defined(DSP_USE_NEON)
+/*
+ * Function: trackLoad4
+ * Input: pointer to four track samples
+ * Output: the samples as floats, int16 samples keep their integer scale
+ *
+ */
+static inline float32x4_t trackLoad4(const track_sample_t *src)
+{
+#if TRACK_FORMAT == TRACK_FORMAT_FLOAT
+    return vld1q_f32(src);
+#else
+    return vcvtq_f32_s32(vmovl_s16(vld1_s16(src)));
+#endif
+}
+#elif defined(DSP_TRACK_SSE)
+/*
+ * Function: trackLoad4
+ * Input: pointer to four track samples
+ * Output: the samples as floats, int16 samples keep their integer scale
+ *
+ */
+static inline __m128 trackLoad4(const track_sample_t *src)
+{
+#if TRACK_FORMAT == TRACK_FORMAT_FLOAT
+    return _mm_loadu_ps(src);
+#else
+    __m128i s = _mm_loadl_epi64((const __m128i *)src);
+    return _mm_cvtepi32_ps(_mm_srai_epi32(_mm_unpacklo_epi16(s, s), 16));
+#endif
+}
+#endif
+
+/*
+ * Function: blockPeak
+ * Input: pointer to the buffer
+ *        number of samples
+ * Output: largest absolute sample value
+ *
+ */
+static float blockPeak(const jack_default_audio_sample_t *buf, jack_nframes_t count)
+{
+    jack_nframes_t i = 0;
+    float peak = 0.0f;
+    float a;
+
+#if defined(DSP_USE_NEON)
+    float32x4_t m = vdupq_n_f32(0.0f);
+    for (; i + 4 <= count; i += 4)
+    {
+        m = vmaxq_f32(m, vabsq_f32(vld1q_f32(&buf[i])));
+    }
+    float32x2_t m2 = vpmax_f32(vget_low_f32(m), vget_high_f32(m));
+    peak = vget_lane_f32(vpmax_f32(m2, m2), 0);
+#elif defined(DSP_USE_AVX)
+    __m256 sign = _mm256_set1_ps(-0.0f);
+    __m256 m = _mm256_setzero_ps();
+    for (; i + 8 <= count; i += 8)
+    {
+        m = _mm256_max_ps(m, _mm256_andnot_ps(sign, _mm256_loadu_ps(&buf[i])));
+    }
+    __m128 m4 = _mm_max_ps(_mm256_castps256_ps128(m), _mm256_extractf128_ps(m, 1));
+    m4 = _mm_max_ps(m4, _mm_movehl_ps(m4, m4));
+    peak = _mm_cvtss_f32(_mm_max_ss(m4, _mm_shuffle_ps(m4, m4, 1)));
+#elif defined(DSP_USE_SSE)
+    __m128 sign = _mm_set1_ps(-0.0f);
+    __m128 m = _mm_setzero_ps();
+    for (; i + 4 <= count; i += 4)
+    {
+        m = _mm_max_ps(m, _mm_andnot_ps(sign, _mm_loadu_ps(&buf[i])));
+    }
+    m = _mm_max_ps(m, _mm_movehl_ps(m, m));
+    peak = _mm_cvtss_f32(_mm_max_ss(m, _mm_shuffle_ps(m, m, 1)));
+#endif
+    for (; i < count; i++)
+    {
+        a = (buf[i] < 0.0f) ? -buf[i] : buf[i];
+        peak = (a > peak) ? a : peak;
+    }
+    return peak;
+}
+
+/**************************************************************
+ * Public functions
+ *************************************************************/
+
+/*
+ * Function: dspAccumulate
+ * Input: pointer to the destination buffer
+ *        pointer to the source samples
+ *        number of samples to accumulate
+ * Output: none
+ * Description:
+ *   dst[i] += src[i] over a contiguous range, no limiting
+ *   Source and destination may be unaligned
+ *
+ */
+void dspAccumulate(
+    jack_default_audio_sample_t *dst,
+    const jack_default_audio_sample_t *src,
+    jack_nframes_t count)
+{
+    jack_nframes_t i = 0;
+
+#if defined(DSP_USE_NEON)
+    for (; i + 4 <= count; i += 4)
+    {
+        vst1q_f32(&dst[i], vaddq_f32(vld1q_f32(&dst[i]), vld1q_f32(&src[i])));
+    }
+#elif defined(DSP_USE_AVX)
+    for (; i + 8 <= count; i += 8)
+    {
+        _mm256_storeu_ps(&dst[i], _mm256_add_ps(_mm256_loadu_ps(&dst[i]), _mm256_loadu_ps(&src[i])));
+    }
+#elif defined(DSP_USE_SSE)
+    for (; i + 4 <= count; i += 4)
+    {
+        _mm_storeu_ps(&dst[i], _mm_add_ps(_mm_loadu_ps(&dst[i]), _mm_loadu_ps(&src[i])));
+    }
+#endif
+    for (; i < count; i++)
+    {
+        dst[i] += src[i];
+    }
+}
+
+/*
+ * Function: dspSoftClip
+ * Input: pointer to the buffer to clip
+ *        number of samples to clip
+ * Output: none
+ * Description:
+ *   Master bus saturation, run once over a mixed block. Samples up to
+ *   LIMITER_KNEE pass unchanged, above it the curve
+ *   knee + (1 - knee) * u / (1 + u), u = (|x| - knee) / (1 - knee)
+ *   bends towards full scale without reaching it. The slope is 1 at the
+ *   knee so there is no step in gain, and the output never leaves +-1.0
+ *   A block that peaks below the knee is left as it is after one max pass
+ *
+ */
+void dspSoftClip(jack_default_audio_sample_t *buf, jack_nframes_t count)
+{
+    const float range = 1.0f - LIMITER_KNEE;
+    jack_nframes_t i = 0;
+    float a;
+    float u;
+
+    if (blockPeak(buf, count) <= LIMITER_KNEE)
+    {
+        return;
+    }
+
+#if defined(DSP_USE_NEON)
+    float32x4_t knee = vdupq_n_f32(LIMITER_KNEE);
+    float32x4_t rangev = vdupq_n_f32(range);
+    float32x4_t inverse = vdupq_n_f32(1.0f / range);
+    float32x4_t one = vdupq_n_f32(1.0f);
+    float32x4_t zero = vdupq_n_f32(0.0f);
+    uint32x4_t sign = vdupq_n_u32(0x80000000u);
+    for (; i + 4 <= count; i += 4)
+    {
+        float32x4_t x = vld1q_f32(&buf[i]);
+        float32x4_t ax = vabsq_f32(x);
+        float32x4_t uv = vmaxq_f32(vmulq_f32(vsubq_f32(ax, knee), inverse), zero);
+        float32x4_t d = vaddq_f32(one, uv);
+        // 1 / (1 + u), estimate and two Newton-Raphson steps, ARMv7 NEON has no divide
+        float32x4_t r = vrecpeq_f32(d);
+        r = vmulq_f32(vrecpsq_f32(d, r), r);
+        r = vmulq_f32(vrecpsq_f32(d, r), r);
+        float32x4_t y = vbslq_f32(vcgtq_f32(ax, knee), vmlaq_f32(knee, vmulq_f32(uv, r), rangev), ax);
+        y = vreinterpretq_f32_u32(vorrq_u32(vreinterpretq_u32_f32(y),
+                                            vandq_u32(vreinterpretq_u32_f32(x), sign)));
+        vst1q_f32(&buf[i], y);
+    }
+#elif defined(DSP_USE_AVX)
+    __m256 knee = _mm256_set1_ps(LIMITER_KNEE);
+    __m256 rangev = _mm256_set1_ps(range);
+    __m256 inverse = _mm256_set1_ps(1.0f / range);
+    __m256 one = _mm256_set1_ps(1.0f);
+    __m256 two = _mm256_set1_ps(2.0f);
+    __m256 zero = _mm256_setzero_ps();
+    __m256 sign = _mm256_set1_ps(-0.0f);
+    for (; i + 8 <= count; i += 8)
+    {
+        __m256 x = _mm256_loadu_ps(&buf[i]);
+        __m256 ax = _mm256_andnot_ps(sign, x);
+        __m256 uv = _mm256_max_ps(_mm256_mul_ps(_mm256_sub_ps(ax, knee), inverse), zero);
+        __m256 d = _mm256_add_ps(one, uv);
+        // 1 / (1 + u), estimate and one Newton-Raphson step, cheaper than a divide
+        __m256 r = _mm256_rcp_ps(d);
+        r = _mm256_mul_ps(r, _mm256_sub_ps(two, _mm256_mul_ps(d, r)));
+        __m256 y = _mm256_add_ps(knee, _mm256_mul_ps(rangev, _mm256_mul_ps(uv, r)));
+        y = _mm256_blendv_ps(ax, y, _mm256_cmp_ps(ax, knee, _CMP_GT_OQ));
+        _mm256_storeu_ps(&buf[i], _mm256_or_ps(y, _mm256_and_ps(x, sign)));
+    }
+#elif defined(DSP_USE_SSE)
+    __m128 knee = _mm_set1_ps(LIMITER_KNEE);
+    __m128 rangev = _mm_set1_ps(range);
+    __m128 inverse = _mm_set1_ps(1.0f / range);
+    __m128 one = _mm_set1_ps(1.0f);
+    __m128 two = _mm_set1_ps(2.0f);
+    __m128 zero = _mm_setzero_ps();
+    __m128 sign = _mm_set1_ps(-0.0f);
+    for (; i + 4 <= count; i += 4)
+    {
+        __m128 x = _mm_loadu_ps(&buf[i]);
+        __m128 ax = _mm_andnot_ps(sign, x);
+        __m128 uv = _mm_max_ps(_mm_mul_ps(_mm_sub_ps(ax, knee), inverse), zero);
+        __m128 d = _mm_add_ps(one, uv);
+        __m128 r = _mm_rcp_ps(d);
+        r = _mm_mul_ps(r, _mm_sub_ps(two, _mm_mul_ps(d, r)));
+        __m128 y = _mm_add_ps(knee, _mm_mul_ps(rangev, _mm_mul_ps(uv, r)));
+        __m128 over = _mm_cmpgt_ps(ax, knee);
+        y = _mm_or_ps(_mm_and_ps(over, y), _mm_andnot_ps(over, ax));
+        _mm_storeu_ps(&buf[i], _mm_or_ps(y, _mm_and_ps(x, sign)));
+    }
+#endif
+    for (; i < count; i++)
+    {
+        a = (buf[i] < 0.0f) ? -buf[i] : buf[i];
+        if (a > LIMITER_KNEE)
+        {
+            u = (a - LIMITER_KNEE) / range;
+            a = LIMITER_KNEE + range * u / (1.0f + u);
+            buf[i] = (buf[i] < 0.0f) ? -a : a;
+        }
+    }
+}
+
+/*
+ * Function: dspTrackAccumulate
+ * Input: pointer to the destination buffer
+ *        pointer to the track samples
+ *        number of samples to accumulate
+ * Output: none
+ * Description:
+ *   dst[i] += track[i] converted to a Jack sample, no limiting
+ *
+ */
+void dspTrackAccumulate(
+    jack_default_audio_sample_t *dst,
+    const track_sample_t *src,
+    jack_nframes_t count)
+{
+#if TRACK_FORMAT == TRACK_FORMAT_FLOAT
+    dspAccumulate(dst, src, count);
+#else
+    const float k = 1.0f / TRACK_SAMPLE_SCALE;
+    jack_nframes_t i = 0;
+
+#if defined(DSP_USE_NEON)
+    float32x4_t kv = vdupq_n_f32(k);
+    for (; i + 8 <= count; i += 8)
+    {
+        int16x8_t s = vld1q_s16(&src[i]);
+        float32x4_t lo = vcvtq_f32_s32(vmovl_s16(vget_low_s16(s)));
+        float32x4_t hi = vcvtq_f32_s32(vmovl_s16(vget_high_s16(s)));
+        vst1q_f32(&dst[i], vaddq_f32(vld1q_f32(&dst[i]), vmulq_f32(lo, kv)));
+        vst1q_f32(&dst[i + 4], vaddq_f32(vld1q_f32(&dst[i + 4]), vmulq_f32(hi, kv)));
+    }
+#elif defined(DSP_USE_SSE2)
+    __m128 kv = _mm_set1_ps(k);
+    for (; i + 8 <= count; i += 8)
+    {
+        // sign extend by unpacking into the top half and shifting back down
+        __m128i s = _mm_loadu_si128((const __m128i *)&src[i]);
+        __m128 lo = _mm_cvtepi32_ps(_mm_srai_epi32(_mm_unpacklo_epi16(s, s), 16));
+        __m128 hi = _mm_cvtepi32_ps(_mm_srai_epi32(_mm_unpackhi_epi16(s, s), 16));
+        _mm_storeu_ps(&dst[i], _mm_add_ps(_mm_loadu_ps(&dst[i]), _mm_mul_ps(lo, kv)));
+        _mm_storeu_ps(&dst[i + 4], _mm_add_ps(_mm_loadu_ps(&dst[i + 4]), _mm_mul_ps(hi, kv)));
+    }
+#endif
+    for (; i < count; i++)
+    {
+        dst[i] += (float)src[i] * k;
+    }
+#endif
+}
+
+/*
+ * Function: dspTrackStore
+ * Input: pointer to the track samples
+ *        pointer to the Jack samples
+ *        number of samples to store
+ * Output: none
+ * Description:
+ *   Convert Jack samples to the track format, int16 saturates at full scale
+ *   and truncates toward zero in every path
+ *
+ */
+void dspTrackStore(
+    track_sample_t *dst,
+    const jack_default_audio_sample_t *src,
+    jack_nframes_t count)
+{
+#if TRACK_FORMAT == TRACK_FORMAT_FLOAT
+    memcpy(dst, src, count * sizeof(track_sample_t));
+#else
+    jack_nframes_t i = 0;
+    float x;
+
+#if defined(DSP_USE_NEON)
+    float32x4_t kv = vdupq_n_f32(TRACK_SAMPLE_SCALE);
+    for (; i + 8 <= count; i += 8)
+    {
+        // the convert and the narrow both saturate
+        int32x4_t lo = vcvtq_s32_f32(vmulq_f32(vld1q_f32(&src[i]), kv));
+        int32x4_t hi = vcvtq_s32_f32(vmulq_f32(vld1q_f32(&src[i + 4]), kv));
+        vst1q_s16(&dst[i], vcombine_s16(vqmovn_s32(lo), vqmovn_s32(hi)));
+    }
+#elif defined(DSP_USE_SSE2)
+    __m128 kv = _mm_set1_ps(TRACK_SAMPLE_SCALE);
+    __m128 minv = _mm_set1_ps(TRACK_SAMPLE_MIN);
+    __m128 maxv = _mm_set1_ps(TRACK_SAMPLE_MAX);
+    for (; i + 8 <= count; i += 8)
+    {
+        __m128 lo = _mm_min_ps(_mm_max_ps(_mm_mul_ps(_mm_loadu_ps(&src[i]), kv), minv), maxv);
+        __m128 hi = _mm_min_ps(_mm_max_ps(_mm_mul_ps(_mm_loadu_ps(&src[i + 4]), kv), minv), maxv);
+        _mm_storeu_si128((__m128i *)&dst[i],
+            _mm_packs_epi32(_mm_cvttps_epi32(lo), _mm_cvttps_epi32(hi)));
+    }
+#endif
+    for (; i < count; i++)
+    {
+        x = src[i] * TRACK_SAMPLE_SCALE;
+        x = (x < TRACK_SAMPLE_MIN) ? TRACK_SAMPLE_MIN : (x > TRACK_SAMPLE_MAX) ? TRACK_SAMPLE_MAX : x;
+        dst[i] = (track_sample_t)x;
+    }
+#endif
+}
+
+/*
+ * Function: dspTrackMix
+ * Input: pointer to the mix buffer
+ *        pointer to the track samples
+ *        number of samples to mix
+ *        gain for the first sample
+ *        gain change per sample
+ * Output: none
+ * Description:
+ *   dst[i] += src[i] * (gain + step * i), the ramp takes a level change
+ *   across the block so there is no zipper noise. int16 samples are
+ *   rescaled by folding the scale into the ramp
+ *
+ */
+void dspTrackMix(
+    jack_default_audio_sample_t *dst,
+    const track_sample_t *src,
+    jack_nframes_t count,
+    float gain,
+    float step)
+{
+    jack_nframes_t i = 0;
+
+#if TRACK_FORMAT != TRACK_FORMAT_FLOAT
+    gain *= 1.0f / TRACK_SAMPLE_SCALE;
+    step *= 1.0f / TRACK_SAMPLE_SCALE;
+#endif
+
+#if defined(DSP_USE_NEON)
+    float32x4_t g = { gain, gain + step, gain + 2 * step, gain + 3 * step };
+    float32x4_t g4 = vdupq_n_f32(4 * step);
+    for (; i + 4 <= count; i += 4)
+    {
+        vst1q_f32(&dst[i], vmlaq_f32(vld1q_f32(&dst[i]), trackLoad4(&src[i]), g));
+        g = vaddq_f32(g, g4);
+    }
+#elif defined(DSP_TRACK_AVX)
+    __m256 g = _mm256_setr_ps(gain, gain + step, gain + 2 * step, gain + 3 * step,
+        gain + 4 * step, gain + 5 * step, gain + 6 * step, gain + 7 * step);
+    __m256 g8 = _mm256_set1_ps(8 * step);
+    for (; i + 8 <= count; i += 8)
+    {
+        _mm256_storeu_ps(&dst[i], _mm256_add_ps(_mm256_loadu_ps(&dst[i]),
+            _mm256_mul_ps(_mm256_loadu_ps(&src[i]), g)));
+        g = _mm256_add_ps(g, g8);
+    }
+#elif defined(DSP_TRACK_SSE)
+    __m128 g = _mm_setr_ps(gain, gain + step, gain + 2 * step, gain + 3 * step);
+    __m128 g4 = _mm_set1_ps(4 * step);
+    for (; i + 4 <= count; i += 4)
+    {
+        _mm_storeu_ps(&dst[i], _mm_add_ps(_mm_loadu_ps(&dst[i]), _mm_mul_ps(trackLoad4(&src[i]), g)));
+        g = _mm_add_ps(g, g4);
+    }
+#endif
+    for (; i < count; i++)
+    {
+        dst[i] += (float)src[i] * (gain + step * i);
+    }
+}
+
+/*
+ * Function: dspTrackMixMono
+ * Input: pointers to the left and right mix buffers
+ *        pointer to the track samples
+ *        number of samples to mix
+ *        first sample gain and gain change per sample, left then right
+ * Output: none
+ * Description:
+ *   dspTrackMix of a mono track into both sides of the mix, each track
+ *   sample is loaded and converted once
+ *
+ */
+void dspTrackMixMono(
+    jack_default_audio_sample_t *dstL,
+    jack_default_audio_sample_t *dstR,
+    const track_sample_t *src,
+    jack_nframes_t count,
+    float gainL,
+    float stepL,
+    float gainR,
+    float stepR)
+{
+    jack_nframes_t i = 0;
+    float x;
+
+#if TRACK_FORMAT != TRACK_FORMAT_FLOAT
+    gainL *= 1.0f / TRACK_SAMPLE_SCALE;
+    stepL *= 1.0f / TRACK_SAMPLE_SCALE;
+    gainR *= 1.0f / TRACK_SAMPLE_SCALE;
+    stepR *= 1.0f / TRACK_SAMPLE_SCALE;
+#endif
+
+#if defined(DSP_USE_NEON)
+    float32x4_t gl = { gainL, gainL + stepL, gainL + 2 * stepL, gainL + 3 * stepL };
+    float32x4_t gr = { gainR, gainR + stepR, gainR + 2 * stepR, gainR + 3 * stepR };
+    float32x4_t gl4 = vdupq_n_f32(4 * stepL);
+    float32x4_t gr4 = vdupq_n_f32(4 * stepR);
+    for (; i + 4 <= count; i += 4)
+    {
+        float32x4_t s = trackLoad4(&src[i]);
+        vst1q_f32(&dstL[i], vmlaq_f32(vld1q_f32(&dstL[i]), s, gl));
+        vst1q_f32(&dstR[i], vmlaq_f32(vld1q_f32(&dstR[i]), s, gr));
+        gl = vaddq_f32(gl, gl4);
+        gr = vaddq_f32(gr, gr4);
+    }
+#elif defined(DSP_TRACK_AVX)
+    __m256 gl = _mm256_setr_ps(gainL, gainL + stepL, gainL + 2 * stepL, gainL + 3 * stepL,
+        gainL + 4 * stepL, gainL + 5 * stepL, gainL + 6 * stepL, gainL + 7 * stepL);
+    __m256 gr = _mm256_setr_ps(gainR, gainR + stepR, gainR + 2 * stepR, gainR + 3 * stepR,
+        gainR + 4 * stepR, gainR + 5 * stepR, gainR + 6 * stepR, gainR + 7 * stepR);
+    __m256 gl8 = _mm256_set1_ps(8 * stepL);
+    __m256 gr8 = _mm256_set1_ps(8 * stepR);
+    for (; i + 8 <= count; i += 8)
+    {
+        __m256 s = _mm256_loadu_ps(&src[i]);
+        _mm256_storeu_ps(&dstL[i], _mm256_add_ps(_mm256_loadu_ps(&dstL[i]), _mm256_mul_ps(s, gl)));
+        _mm256_storeu_ps(&dstR[i], _mm256_add_ps(_mm256_loadu_ps(&dstR[i]), _mm256_mul_ps(s, gr)));
+        gl = _mm256_add_ps(gl, gl8);
+        gr = _mm256_add_ps(gr, gr8);
+    }
+#elif defined(DSP_TRACK_SSE)
+    __m128 gl = _mm_setr_ps(gainL, gainL + stepL, gainL + 2 * stepL, gainL + 3 * stepL);
+    __m128 gr = _mm_setr_ps(gainR, gainR + stepR, gainR + 2 * stepR, gainR + 3 * stepR);
+    __m128 gl4 = _mm_set1_ps(4 * stepL);
+    __m128 gr4 = _mm_set1_ps(4 * stepR);
+    for (; i + 4 <= count; i += 4)
+    {
+        __m128 s = trackLoad4(&src[i]);
+        _mm_storeu_ps(&dstL[i], _mm_add_ps(_mm_loadu_ps(&dstL[i]), _mm_mul_ps(s, gl)));
+        _mm_storeu_ps(&dstR[i], _mm_add_ps(_mm_loadu_ps(&dstR[i]), _mm_mul_ps(s, gr)));
+        gl = _mm_add_ps(gl, gl4);
+        gr = _mm_add_ps(gr, gr4);
+    }
+#endif
+    for (; i < count; i++)
+    {
+        x = (float)src[i];
+        dstL[i] += x * (gainL + stepL * i);
+        dstR[i] += x * (gainR + stepR * i);
+    }
+}
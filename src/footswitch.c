@@ -0,0 +1,166 @@
+/**************************************************************
+ * Copyright (C) 2017 by Chan Russell, Robert                 *
+ *                                                            *
+ * Project: Audio Looper                                      *
+ *                                                            *
+ * This file contains the footswitch user interface, GPIO     *
+ * inputs read through wiringPi interrupts                    *
+ *                                                            *
+ * Functionality:                                             *
+ * - Record: record the next empty track on the active group, *
+ *   pressed while recording or overdubbing it plays instead  *
+ * - Overdub: overdub the selected track, pressed while       *
+ *   recording or overdubbing it plays instead                *
+ * - Either, pressed while a start or stop waits for the      *
+ *   quantize grid, takes it back                             *
+ * - Undo: take back the selected track's last overdub pass   *
+ * - Reset: return to passthrough state                       *
+ * - Each press is stamped with the Jack frame its interrupt  *
+ *   ran on, so it lands on the frame it was pressed on       *
+ * - A press is queued as it is, the process callback picks   *
+ *   the command from the state it lands in, see control.c   *
+ * - Presses within GPIO_ISR_DEBOUNCE_MS of the last one are  *
+ *   contact bounce and ignored, nothing sleeps               *
+ *                                                            *
+ *************************************************************/
+
+#include <stdio.h>
+#include <errno.h>
+#include <unistd.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdbool.h>
+
+#include <jack/jack.h>
+#include <wiringPi.h>
+
+#include "local.h"
+
+/**************************************************************
+ * Macros and defines                                         *
+ *************************************************************/
+
+/**************************************************************
+ * Data types                                                 *
+ *************************************************************/
+// Each footswitch is only touched by its own ISR thread once set up
+struct Footswitch
+{
+    int pin;
+    enum FootswitchAction action;
+    void (*isr)(void);
+    bool pressed;                   // lastPress is valid
+    jack_nframes_t lastPress;       // frame of the last press that was acted on
+};
+
+static struct MasterLooper *looper;
+static jack_nframes_t debounceFrames;
+
+static void footswitchIsr0(void);
+static void footswitchIsr1(void);
+static void footswitchIsr2(void);
+static void footswitchIsr3(void);
+
+static struct Footswitch footswitches[FOOTSWITCH_COUNT] = {
+    {FOOTSWITCH_PIN_RECORD,  FOOTSWITCH_ACTION_RECORD,  footswitchIsr0, false, 0},
+    {FOOTSWITCH_PIN_OVERDUB, FOOTSWITCH_ACTION_OVERDUB, footswitchIsr1, false, 0},
+    {FOOTSWITCH_PIN_UNDO,    FOOTSWITCH_ACTION_UNDO,    footswitchIsr2, false, 0},
+    {FOOTSWITCH_PIN_RESET,   FOOTSWITCH_ACTION_RESET,   footswitchIsr3, false, 0},
+};
+
+/**************************************************************
+ * Static functions
+ *************************************************************/
+
+/*
+ * Function: footswitchPressed
+ * Input: index of the footswitch
+ * Output: none
+ * Description:
+ *   Stamp the press, drop it if it is bounce, then queue it on the
+ *   footswitch's own queue. It reads nothing of the looper, the process
+ *   callback turns it into a command when it comes due, see mapFootswitch
+ *
+ */
+static void footswitchPressed(uint8_t index)
+{
+    struct Footswitch *fs = &footswitches[index];
+    struct ControlCommand cmd = {0};
+
+    cmd.frameTime = controlFrameTime();
+    if ((fs->pressed) && (cmd.frameTime - fs->lastPress < debounceFrames))
+    {
+        return;
+    }
+    fs->pressed = true;
+    fs->lastPress = cmd.frameTime;
+
+    cmd.event = SYSTEM_EVENT_FOOTSWITCH;
+    cmd.value = fs->action;
+    if (!controlQueueCommand(COMMAND_SOURCE_FOOTSWITCH + index, &cmd))
+    {
+        printf("\n** Command queue full\n");
+    }
+}
+
+/*
+ * Function: footswitchIsrN
+ * Input: none
+ * Output: none
+ * Description:
+ *   wiringPi passes nothing to an ISR, one for each footswitch
+ *
+ */
+static void footswitchIsr0(void)
+{
+    footswitchPressed(0);
+}
+
+static void footswitchIsr1(void)
+{
+    footswitchPressed(1);
+}
+
+static void footswitchIsr2(void)
+{
+    footswitchPressed(2);
+}
+
+static void footswitchIsr3(void)
+{
+    footswitchPressed(3);
+}
+
+/**************************************************************
+ * Public functions
+ *************************************************************/
+
+/*
+ * Function: footswitchInit
+ * Input: pointer to the master looper context
+ * Output: pass/fail of init process
+ * Description:
+ *   Pull the footswitch pins up and attach an ISR to each falling edge
+ *   serialInit must have set up wiringPi and controlInit the command queues
+ *
+ */
+bool footswitchInit(struct MasterLooper *mLooper)
+{
+    uint8_t index;
+
+    looper = mLooper;
+    debounceFrames = (jack_nframes_t)(((uint64_t)GPIO_ISR_DEBOUNCE_MS * looper->sampleRate) / 1000);
+
+    for (index = 0; index < FOOTSWITCH_COUNT; index++)
+    {
+        pinMode(footswitches[index].pin, INPUT);
+        pullUpDnControl(footswitches[index].pin, PUD_UP);
+        if (wiringPiISR(footswitches[index].pin, INT_EDGE_FALLING, footswitches[index].isr) < 0)
+        {
+            printf("Error setting up footswitch on pin %d, %s\n",
+                footswitches[index].pin, strerror(errno));
+            return false;
+        }
+    }
+    return true;
+}
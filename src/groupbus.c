@@ -0,0 +1,518 @@
+/**************************************************************
+ * Copyright (C) 2017 by Chan Russell, Robert                 *
+ *                                                            *
+ * Project: Audio Looper                                      *
+ *                                                            *
+ * This file contains the group bus cache, a pre-mixed stereo *
+ * bus per group so a settled group plays back as one stream  *
+ *                                                            *
+ * Functionality:                                             *
+ * - Low priority thread rebuilds the bus of any group whose  *
+ *   member tracks changed: take, length, repeat, gain, pan   *
+ *   or mute                                                  *
+ * - Each bus records what it was built from, the process     *
+ *   thread only plays it while the group still matches and  *
+ *   every track is where the bus expects it                  *
+ * - New buses are published with an atomic pointer swap, a   *
+ *   retired bus is only reused once the process thread has   *
+ *   let go of it                                             *
+ * - Group snapshot and render, shared with the bounce        *
+ *                                                            *
+ *************************************************************/
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdbool.h>
+#include <unistd.h>
+
+#include "local.h"
+
+/**************************************************************
+ * Macros and defines                                         *
+ *************************************************************/
+#define GROUP_BUS_PERIOD_US     (200 * 1000)
+#define GROUP_BUS_COUNT         (NUM_GROUPS + 1)    // one more than can be published, to build into
+#define GROUP_BUS_MIN_TRACKS    (2)                 // a single track is already one stream
+#define GROUP_BUS_RETIRE_US     (1000)
+#define GROUP_RENDER_FRAMES     (256)               // keeps a window inside MIX_TRACK_SEGMENTS
+
+/**************************************************************
+ * Data types                                                 *
+ *************************************************************/
+
+struct GroupBus
+{
+    struct GroupSignature sig;
+    jack_default_audio_sample_t *left;      // indexed by the master index
+    jack_default_audio_sample_t *right;
+};
+
+static struct MasterLooper *looper;
+static struct GroupBus buses[GROUP_BUS_COUNT];
+static struct GroupBus *freeBuses[GROUP_BUS_COUNT]; // only used by the bus thread
+static uint8_t numFree;
+static _Atomic(struct GroupBus *) published[NUM_GROUPS];
+static _Atomic(struct GroupBus *) busInUse;         // bus the process thread is reading, NULL otherwise
+static uint32_t busFrames;                          // longest loop a bus holds, 0 when disabled
+static pthread_t busTh;
+
+/**************************************************************
+ * Static functions
+ *************************************************************/
+
+/*
+ * Function: busTrackIdx
+ * Input: pointer to the track's entry in the signature
+ *        master index
+ * Output: the track index the bus holds at that master index
+ * Description:
+ *   Tracks start from the top with the master, a repeating track goes round
+ *   from its startIdx
+ *
+ */
+static uint32_t busTrackIdx(const struct MixSource *src, uint32_t masterIdx)
+{
+    uint32_t length = src->endIdx - src->startIdx;
+    if ((!src->repeat) || (length == 0))
+    {
+        return masterIdx;
+    }
+    return src->startIdx + (masterIdx % length);
+}
+
+/*
+ * Function: busCutIdx
+ * Input: pointer to the track's entry in the signature
+ *        master length
+ *        master index
+ * Output: where the track's pass before the one at the master index was cut
+ * Description:
+ *   The first pass of the loop follows the track being cut by the master
+ *   seam, later passes of a repeating track follow its own wrap at endIdx
+ *
+ */
+static uint32_t busCutIdx(const struct MixSource *src, uint32_t masterLength, uint32_t masterIdx)
+{
+    uint32_t length = src->endIdx - src->startIdx;
+    if ((!src->repeat) || (length == 0))
+    {
+        return masterLength;
+    }
+    if (masterIdx >= length)
+    {
+        return src->endIdx;
+    }
+    return src->startIdx + ((masterLength - 1) % length) + 1;
+}
+
+/*
+ * Function: busAligned
+ * Input: pointer to the bus
+ *        master index
+ *        number of frames in the block
+ * Output: true if every track is at the index and level the bus was built with
+ * Description:
+ *   A track that is still fading, or that has drifted from the bus layout,
+ *   is mixed on its own until the next loop, as is one on the first pass
+ *   after it was recorded. Seams are rendered into the bus the same way
+ *   the mix does them, see trackSegments
+ *   Where a silent track is does not matter while it stays silent
+ *
+ */
+static bool busAligned(const struct GroupBus *bus, uint32_t masterIdx)
+{
+    uint32_t active = bus->sig.tracks;
+    const struct MixSource *src;
+    struct Track *track;
+    uint8_t t;
+
+    while (active)
+    {
+        t = nextTrack(&active);
+        track = &looper->tracks[t];
+        src = &bus->sig.sources[t];
+        if (!src->audible)
+        {
+            continue;
+        }
+        if ((track->state == TRACK_STATE_RECORDING) ||
+            (track->levelLeft != src->levelLeft) ||
+            (track->levelRight != src->levelRight))
+        {
+            return false;
+        }
+        if (((src->levelLeft != 0.0f) || (src->levelRight != 0.0f)) &&
+            ((track->currIdx != busTrackIdx(src, masterIdx)) ||
+             (track->cutIdx != busCutIdx(src, bus->sig.masterLength, masterIdx))))
+        {
+            return false;
+        }
+    }
+    return true;
+}
+
+/*
+ * Function: addSegment
+ * Input: pointer to the track and its number of channels
+ *        segment to mix
+ *        pointers to the left and right buffers to mix into
+ * Output: none
+ * Description:
+ *   Mix a track segment in along its gain ramp. A chunk the process thread
+ *   released meanwhile is skipped, the signature check throws the mix away
+ *
+ */
+static void addSegment(
+    struct Track *track,
+    uint8_t channels,
+    const struct MixSegment *seg,
+    jack_default_audio_sample_t *left,
+    jack_default_audio_sample_t *right)
+{
+    track_sample_t **chunksRight = (channels == 2) ? track->chunksRight : track->chunksLeft;
+    track_sample_t *chunk;
+    uint32_t idx = seg->srcIdx;
+    uint32_t count = seg->count;
+    float gainLeft = seg->gainLeft;
+    float gainRight = seg->gainRight;
+    jack_nframes_t run;
+
+    left += seg->dst;
+    right += seg->dst;
+    while (count > 0)
+    {
+        run = chunkRun(idx, count);
+        chunk = track->chunksLeft[idx >> CHUNK_FRAMES_SHIFT];
+        if (chunk)
+        {
+            dspTrackMix(left, chunk + (idx & CHUNK_FRAMES_MASK), run, gainLeft, seg->stepLeft);
+        }
+        chunk = chunksRight[idx >> CHUNK_FRAMES_SHIFT];
+        if (chunk)
+        {
+            dspTrackMix(right, chunk + (idx & CHUNK_FRAMES_MASK), run, gainRight, seg->stepRight);
+        }
+        gainLeft += seg->stepLeft * run;
+        gainRight += seg->stepRight * run;
+        left += run;
+        right += run;
+        idx += run;
+        count -= run;
+    }
+}
+
+/*
+ * Function: retireBus
+ * Input: group
+ *        bus to publish for it, NULL for none
+ * Output: none
+ * Description:
+ *   Swap the group's bus and return the old one to the free list once the
+ *   process thread is no longer reading it, that is at most one period
+ *
+ */
+static void retireBus(uint8_t group, struct GroupBus *bus)
+{
+    struct GroupBus *old = atomic_exchange(&published[group], bus);
+    if (old == NULL)
+    {
+        return;
+    }
+    while (atomic_load(&busInUse) == old)
+    {
+        usleep(GROUP_BUS_RETIRE_US);
+    }
+    freeBuses[numFree++] = old;
+}
+
+/*
+ * Function: refreshGroup
+ * Input: group
+ * Output: none
+ * Description:
+ *   Rebuild the group's bus if what it was built from has changed. A group
+ *   that is being recorded is left for a later pass, one too short, too long
+ *   or with too few tracks to be worth it loses its bus
+ *
+ */
+static void refreshGroup(uint8_t group)
+{
+    struct GroupBus *current = atomic_load_explicit(&published[group], memory_order_relaxed);
+    struct GroupBus *bus = freeBuses[numFree - 1];
+    struct GroupSignature after;
+
+    if ((looper->selectedGroup == group) &&
+        ((looper->state == SYSTEM_STATE_RECORDING) || (looper->state == SYSTEM_STATE_OVERDUBBING)))
+    {
+        return;
+    }
+    groupSignature(group, &bus->sig);
+    if ((current) && (memcmp(&current->sig, &bus->sig, sizeof(bus->sig)) == 0))
+    {
+        return;
+    }
+    if ((bus->sig.masterLength == 0) || (bus->sig.masterLength > busFrames) ||
+        (__builtin_popcount(bus->sig.tracks) < GROUP_BUS_MIN_TRACKS))
+    {
+        retireBus(group, NULL);
+        return;
+    }
+
+    groupRender(&bus->sig, 0, bus->sig.masterLength, bus->left, bus->right);
+    groupSignature(group, &after);
+    if (memcmp(&bus->sig, &after, sizeof(after)) != 0)
+    {
+        // changed while building, try again next pass
+        return;
+    }
+    numFree--;
+    retireBus(group, bus);
+}
+
+/*
+ * Function: busThread
+ * Input: none
+ * Output: none
+ * Description:
+ *   Low priority thread, periodically bring every group's bus up to date
+ *
+ */
+static void *busThread(void *arg)
+{
+    uint8_t group;
+
+    while (!looper->exitNow)
+    {
+        usleep(GROUP_BUS_PERIOD_US);
+        for (group = 0; group < NUM_GROUPS; group++)
+        {
+            refreshGroup(group);
+        }
+    }
+    pthread_exit(NULL);
+}
+
+/**************************************************************
+ * Public functions
+ *************************************************************/
+
+/*
+ * Function: groupBusInit
+ * Input: pointer to the master looper context, sampleRate set
+ * Output: pass/fail of init process
+ * Description:
+ *   Allocate the buses for loops up to GROUP_BUS_LENGTH_S and start the bus
+ *   thread at normal priority. A length of 0 turns the cache off
+ *
+ */
+bool groupBusInit(struct MasterLooper *mLooper)
+{
+    uint8_t idx;
+    int rc;
+
+    looper = mLooper;
+    if (GROUP_BUS_LENGTH_S == 0)
+    {
+        return true;
+    }
+    for (idx = 0; idx < GROUP_BUS_COUNT; idx++)
+    {
+        buses[idx].left = calloc((size_t)GROUP_BUS_LENGTH_S * looper->sampleRate, sizeof(jack_default_audio_sample_t));
+        buses[idx].right = calloc((size_t)GROUP_BUS_LENGTH_S * looper->sampleRate, sizeof(jack_default_audio_sample_t));
+        if ((buses[idx].left == NULL) || (buses[idx].right == NULL))
+        {
+            printf("Error: cannot allocate the group buses\n");
+            return false;
+        }
+        freeBuses[numFree++] = &buses[idx];
+    }
+    busFrames = GROUP_BUS_LENGTH_S * looper->sampleRate;
+    printf("Group bus cache %d s per group, %zu MB\n", GROUP_BUS_LENGTH_S,
+        ((size_t)GROUP_BUS_COUNT * 2 * busFrames * sizeof(jack_default_audio_sample_t)) >> 20);
+
+    if ((rc = pthread_create(&busTh, NULL, busThread, NULL)))
+    {
+        printf("Error: pthread_create, rc: %d\n", rc);
+        return false;
+    }
+    return true;
+}
+
+/*
+ * Function: groupBusJoin
+ * Input: none
+ * Output: none
+ * Description:
+ *   Wait for the bus thread to exit, exitNow must be set
+ *
+ */
+void groupBusJoin(void)
+{
+    if (busFrames > 0)
+    {
+        pthread_join(busTh, NULL);
+    }
+}
+
+/*
+ * Function: groupSignature
+ * Input: group
+ *        pointer to the signature to fill
+ * Output: none
+ * Description:
+ *   Snapshot what a mix of the group is built from, its active tracks at
+ *   their target levels. Any thread may call it, one other than the process
+ *   thread may read a torn snapshot and must check it again once its mix is
+ *   built, as the bus thread and the bounce do
+ *
+ */
+void groupSignature(uint8_t group, struct GroupSignature *sig)
+{
+    uint32_t active = looper->activeTracks[group];
+    struct Track *track;
+    struct MixSource *src;
+    uint8_t t;
+
+    memset(sig, 0, sizeof(*sig));
+    sig->masterLength = looper->masterLength[group];
+    sig->tracks = active;
+    while (active)
+    {
+        t = nextTrack(&active);
+        track = &looper->tracks[t];
+        src = &sig->sources[t];
+        src->takeId = atomic_load_explicit(&track->takeId, memory_order_acquire);
+        src->startIdx = track->startIdx;
+        src->endIdx = track->endIdx;
+        src->tailFrames = track->tailFrames;
+        src->channels = track->channels;
+        src->repeat = track->repeat;
+        src->audible = (track->state != TRACK_STATE_OFF);
+        trackTargetLevels(track, &src->levelLeft, &src->levelRight);
+    }
+}
+
+/*
+ * Function: groupRender
+ * Input: pointer to the signature
+ *        first master index
+ *        number of frames
+ *        pointers to the left and right buffers
+ * Output: none
+ * Description:
+ *   Overwrite the buffers with master frames masterIdx onwards of the mix the
+ *   signature describes. Tracks play from the top with the master, a repeating
+ *   track goes round from its startIdx, and each pass crossfades from the one
+ *   before as it does once the loop has gone round. Rendered GROUP_RENDER_FRAMES at a time
+ *   through trackSegments, so the seam crossfades are those of the mix
+ *
+ */
+void groupRender(
+    const struct GroupSignature *sig,
+    uint32_t masterIdx,
+    uint32_t count,
+    jack_default_audio_sample_t *left,
+    jack_default_audio_sample_t *right)
+{
+    uint32_t active = sig->tracks;
+    uint32_t last = masterIdx + count;
+    const struct MixSource *src;
+    struct MixSegment segs[MIX_TRACK_SEGMENTS];
+    struct TrackSpan span;
+    uint8_t numSegs;
+    uint8_t seg;
+    uint32_t m;
+    uint8_t t;
+
+    memset(left, 0, count * sizeof(jack_default_audio_sample_t));
+    memset(right, 0, count * sizeof(jack_default_audio_sample_t));
+    span.stepLeft = 0.0f;
+    span.stepRight = 0.0f;
+    while (active)
+    {
+        t = nextTrack(&active);
+        src = &sig->sources[t];
+        if ((!src->audible) || ((src->levelLeft == 0.0f) && (src->levelRight == 0.0f)))
+        {
+            continue;
+        }
+        span.startIdx = src->startIdx;
+        span.endIdx = src->endIdx;
+        span.tailFrames = src->tailFrames;
+        span.repeat = src->repeat;
+        span.levelLeft = src->levelLeft;
+        span.levelRight = src->levelRight;
+        for (m = masterIdx; m < last; m += span.count)
+        {
+            span.count = ((last - m) < GROUP_RENDER_FRAMES) ? last - m : GROUP_RENDER_FRAMES;
+            span.idx = busTrackIdx(src, m);
+            span.cutIdx = busCutIdx(src, sig->masterLength, m);
+            span.masterLeft = sig->masterLength - m;
+            numSegs = trackSegments(&span, segs);
+            for (seg = 0; seg < numSegs; seg++)
+            {
+                addSegment(&looper->tracks[t], src->channels, &segs[seg],
+                    left + (m - masterIdx), right + (m - masterIdx));
+            }
+        }
+    }
+}
+
+/*
+ * Function: groupBusMix
+ * Input: pointer to the master looper context
+ *        pointers to the left and right outputs, right may be NULL
+ *        number of frames in the block
+ * Output: true if the bus was mixed in place of the group's tracks
+ * Description:
+ *   Process thread only. In playback, add the selected group's bus at the
+ *   master index if it still matches the group and every track is where the
+ *   bus expects it. playRecord ends a block where the master wraps, the
+ *   check on masterLength only guards against a loop that has just been cut
+ *   short. False means the tracks must be mixed one by one
+ *
+ */
+bool groupBusMix(
+    struct MasterLooper *looper,
+    jack_default_audio_sample_t *mixLeft,
+    jack_default_audio_sample_t *mixRight,
+    jack_nframes_t nframes)
+{
+    uint8_t sg = looper->selectedGroup;
+    uint32_t masterIdx = looper->masterCurrIdx;
+    struct GroupSignature live;
+    struct GroupBus *bus;
+    bool usable;
+
+    if ((busFrames == 0) || (looper->state != SYSTEM_STATE_PLAYBACK) ||
+        (masterIdx + nframes > looper->masterLength[sg]))
+    {
+        return false;
+    }
+    bus = atomic_load_explicit(&published[sg], memory_order_acquire);
+    if (bus == NULL)
+    {
+        return false;
+    }
+    // announce the bus before checking it is still the published one
+    atomic_store(&busInUse, bus);
+    if (atomic_load(&published[sg]) != bus)
+    {
+        atomic_store_explicit(&busInUse, NULL, memory_order_release);
+        return false;
+    }
+
+    groupSignature(sg, &live);
+    usable = (memcmp(&live, &bus->sig, sizeof(live)) == 0) && busAligned(bus, masterIdx);
+    if (usable)
+    {
+        dspAccumulate(mixLeft, bus->left + masterIdx, nframes);
+        if (mixRight)
+        {
+            dspAccumulate(mixRight, bus->right + masterIdx, nframes);
+        }
+    }
+    atomic_store_explicit(&busInUse, NULL, memory_order_release);
+    return usable;
+}
@@ -10,6 +10,7 @@
  * Functionality:                                             *
  * - System initialization                                    *
  * _ Interface into Jack server and calls our handlers        *
+ * - One stereo port pair per two physical capture ports      *
  *                                                            *
  *                                                            *
  *************************************************************/
@@ -44,14 +45,207 @@ jack_client_t *client;
 static struct MasterLooper looper;
 static bool shuttingDown;
 
-// Mixdown buffers
-static jack_default_audio_sample_t mixdownLeft[128];
-static jack_default_audio_sample_t mixdownRight[128];
+// Largest period the mix worker buses are sized for, see allocateMixdown
+static jack_nframes_t mixdownFrames;
 
 /**************************************************************
  * Static functions
  *************************************************************/
 
+/*
+ * Function: allocateMixdown
+ * Input: number of frames per period
+ * Output: pass/fail of the allocation
+ * Description:
+ *   (Re)size the mix worker buses for the given period, never called from the
+ *   process thread. The mix itself goes straight into the Jack output buffers
+ *
+ */
+static bool allocateMixdown(jack_nframes_t nframes)
+{
+    if (!workersResize(nframes))
+    {
+        fprintf(stderr, "cannot allocate %d frame mix buses\n", nframes);
+        return false;
+    }
+    mixdownFrames = nframes;
+    looper.periodSize = nframes;
+    return true;
+}
+
+/*
+ * Function: countPorts
+ * Input: NULL terminated list from jack_get_ports, may be NULL
+ * Output: number of ports in the list
+ *
+ */
+static uint32_t countPorts(const char **ports)
+{
+    uint32_t count = 0;
+
+    while ((ports) && (ports[count]))
+    {
+        count++;
+    }
+    return count;
+}
+
+/*
+ * Function: registerPortPairs
+ * Input: none
+ * Output: pass/fail of the registration
+ * Description:
+ *   One stereo in/out pair per two physical capture ports, at least one and
+ *   at most MAX_PORT_PAIRS. The first pair keeps the names inputL, outputL and
+ *   so on, the next ones are input2L, output2L...
+ *
+ */
+static bool registerPortPairs(void)
+{
+    const char **ports = jack_get_ports(looper.client, NULL, NULL,
+        JackPortIsPhysical | JackPortIsOutput);
+    char name[16];
+    char number[4] = "";
+    uint32_t pairs = (countPorts(ports) + 1) / 2;
+    uint8_t pair;
+
+    free(ports);
+    looper.numPortPairs = (pairs == 0) ? 1 : (pairs > MAX_PORT_PAIRS) ? MAX_PORT_PAIRS : pairs;
+    for (pair = 0; pair < looper.numPortPairs; pair++)
+    {
+        if (pair > 0)
+        {
+            snprintf(number, sizeof(number), "%d", pair + 1);
+        }
+        snprintf(name, sizeof(name), "input%sL", number);
+        looper.input_portL[pair] = jack_port_register(looper.client, name, JACK_DEFAULT_AUDIO_TYPE, JackPortIsInput, 0);
+        snprintf(name, sizeof(name), "input%sR", number);
+        looper.input_portR[pair] = jack_port_register(looper.client, name, JACK_DEFAULT_AUDIO_TYPE, JackPortIsInput, 0);
+        snprintf(name, sizeof(name), "output%sL", number);
+        looper.output_portL[pair] = jack_port_register(looper.client, name, JACK_DEFAULT_AUDIO_TYPE, JackPortIsOutput, 0);
+        snprintf(name, sizeof(name), "output%sR", number);
+        looper.output_portR[pair] = jack_port_register(looper.client, name, JACK_DEFAULT_AUDIO_TYPE, JackPortIsOutput, 0);
+        if ((looper.input_portL[pair] == NULL) || (looper.output_portL[pair] == NULL) ||
+            (looper.input_portR[pair] == NULL) || (looper.output_portR[pair] == NULL))
+        {
+            fprintf(stderr, "no more JACK ports available\n");
+            return false;
+        }
+    }
+    printf("%d input/output port pairs\n", looper.numPortPairs);
+    return true;
+}
+
+/*
+ * Function: connectPortPairs
+ * Input: true to connect, false to disconnect
+ * Output: none
+ * Description:
+ *   Pair n goes to physical capture and playback ports 2n and 2n + 1. A right
+ *   port with no physical port to connect to is dropped, the pair is mono
+ *   A left port that cannot be connected stays registered for the user
+ *   Connecting without any physical ports is fatal
+ *
+ */
+static void connectPortPairs(bool connect)
+{
+    const char **capture = jack_get_ports(looper.client, NULL, NULL,
+        JackPortIsPhysical | JackPortIsOutput);
+    const char **playback = jack_get_ports(looper.client, NULL, NULL,
+        JackPortIsPhysical | JackPortIsInput);
+    uint32_t numCapture = countPorts(capture);
+    uint32_t numPlayback = countPorts(playback);
+    uint32_t port;
+    uint8_t pair;
+
+    if ((connect) && ((numCapture == 0) || (numPlayback == 0)))
+    {
+        fprintf(stderr, "no physical %s ports\n", (numCapture == 0) ? "capture" : "playback");
+        exit (1);
+    }
+    for (pair = 0; pair < looper.numPortPairs; pair++)
+    {
+        port = 2 * pair;
+        if ((port >= numCapture) ||
+            ((connect) ? jack_connect(looper.client, capture[port], jack_port_name(looper.input_portL[pair])) :
+                         jack_disconnect(looper.client, capture[port], jack_port_name(looper.input_portL[pair]))))
+        {
+            fprintf(stderr, "cannot connect input ports of pair %d\n", pair + 1);
+        }
+        if ((looper.input_portR[pair]) &&
+            ((port + 1 >= numCapture) ||
+             ((connect) ? jack_connect(looper.client, capture[port + 1], jack_port_name(looper.input_portR[pair])) :
+                          jack_disconnect(looper.client, capture[port + 1], jack_port_name(looper.input_portR[pair])))))
+        {
+            if (connect)
+            {
+                looper.input_portR[pair] = NULL;
+            }
+            fprintf(stderr, "cannot connect input ports of pair %d\n", pair + 1);
+        }
+        if ((port >= numPlayback) ||
+            ((connect) ? jack_connect(looper.client, jack_port_name(looper.output_portL[pair]), playback[port]) :
+                         jack_disconnect(looper.client, jack_port_name(looper.output_portL[pair]), playback[port])))
+        {
+            fprintf(stderr, "cannot connect output ports of pair %d\n", pair + 1);
+        }
+        if ((looper.output_portR[pair]) &&
+            ((port + 1 >= numPlayback) ||
+             ((connect) ? jack_connect(looper.client, jack_port_name(looper.output_portR[pair]), playback[port + 1]) :
+                          jack_disconnect(looper.client, jack_port_name(looper.output_portR[pair]), playback[port + 1]))))
+        {
+            if (connect)
+            {
+                looper.output_portR[pair] = NULL;
+            }
+            fprintf(stderr, "cannot connect output ports of pair %d\n", pair + 1);
+        }
+    }
+    free(capture);
+    free(playback);
+}
+
+/*
+ * Function: updateLatency
+ * Input: none
+ * Output: none
+ * Description:
+ *   Query the capture latency of our input ports and the playback latency of our
+ *   output ports. A sample we mix reaches the performer playbackLatency frames
+ *   later, what they play back reaches us captureLatency frames after that,
+ *   so recordings made against existing tracks are written the sum behind
+ *   Pairs can be on different devices, the largest latency over every pair
+ *   is used. Ports that are not connected report 0, fall back to one period
+ *
+ */
+static void updateLatency(void)
+{
+    jack_latency_range_t range;
+    jack_nframes_t period = jack_get_buffer_size(looper.client);
+    jack_nframes_t capture = 0;
+    jack_nframes_t playback = 0;
+    uint8_t pair;
+
+    for (pair = 0; pair < looper.numPortPairs; pair++)
+    {
+        if (looper.input_portL[pair])
+        {
+            jack_port_get_latency_range(looper.input_portL[pair], JackCaptureLatency, &range);
+            capture = (range.max > capture) ? range.max : capture;
+        }
+        if (looper.output_portL[pair])
+        {
+            jack_port_get_latency_range(looper.output_portL[pair], JackPlaybackLatency, &range);
+            playback = (range.max > playback) ? range.max : playback;
+        }
+    }
+    looper.captureLatency = (capture > 0) ? capture : period;
+    looper.playbackLatency = (playback > 0) ? playback : period;
+    looper.recordLatency = looper.captureLatency + looper.playbackLatency;
+    printf("latency capture %d, playback %d, record offset %d frames\n",
+        looper.captureLatency, looper.playbackLatency, looper.recordLatency);
+}
+
 /**************************************************************
  * Public functions
  *************************************************************/
@@ -69,14 +263,76 @@ static jack_default_audio_sample_t mixdownRight[128];
  *   port to its output port. It will exit when stopped by 
  *   the user (e.g. using Ctrl-C on a unix-ish operating system)
  *
- *   This is a wrapper, see play_record.c for implementation
+ *   This is a wrapper, see play_record.c for implementation, MIDI control is
+ *   queued before it and the MIDI clock written after it, see midi.c
  *
  */
 int process (jack_nframes_t nframes, void *arg)
 {
     stopTimer(TIMER_PROCESS_TO_PROCESS_TIME);
     startTimer(TIMER_PROCESS_TO_PROCESS_TIME);
-    return playRecord(&looper, mixdownLeft, mixdownRight, nframes);
+    // never overrun the mix worker buses, bufferSizeCallback runs before a bigger period
+    if (nframes > mixdownFrames)
+    {
+        return 0;
+    }
+    midiReadInput(nframes);
+    int rc = playRecord(&looper, nframes);
+    midiWriteClock(nframes);
+    statsRecordLoad(timerLastNs(TIMER_PLAY_RECORD_DELAY), nframes, looper.sampleRate);
+    return rc;
+}
+
+/*
+ * Function: xrunCallback
+ * Input: void args currently not used
+ * Output: 0, keep the client running
+ * Description:
+ *   JACK calls this whenever the server missed a period, count it for the status report
+ *
+ */
+int xrunCallback(void *arg)
+{
+    statsCountXrun();
+    return 0;
+}
+
+/*
+ * Function: bufferSizeCallback
+ * Input: new number of frames per period
+ *        void args currently not used
+ * Output: 0 on success, non-zero tells JACK to drop the client
+ * Description:
+ *   JACK calls this from a non realtime thread before process() is handed a
+ *   different period size, process() is not running while it does
+ *   Only grows the mix buses, a smaller period reuses what we have
+ *
+ */
+int bufferSizeCallback(jack_nframes_t nframes, void *arg)
+{
+    printf("period size %d frames\n", nframes);
+    if (nframes <= mixdownFrames)
+    {
+        looper.periodSize = nframes;
+        return 0;
+    }
+    return (allocateMixdown(nframes)) ? 0 : 1;
+}
+
+/*
+ * Function: latencyCallback
+ * Input: capture or playback latency being recomputed
+ *        void args currently not used
+ * Output: none
+ * Description:
+ *   JACK calls this, outside the process thread, whenever the latency of the
+ *   graph changes - new connections, period size change, another interface
+ *   Both directions are re-queried whichever one changed
+ *
+ */
+void latencyCallback(jack_latency_callback_mode_t mode, void *arg)
+{
+    updateLatency();
 }
 
 /*
@@ -92,51 +348,18 @@ void jack_shutdown (void *arg)
 {
     shuttingDown = true;
 
-	const char **ports;
-	ports = jack_get_ports (looper.client, NULL, NULL,
-				JackPortIsPhysical|JackPortIsOutput);
-	if (ports == NULL) {
-		fprintf(stderr, "no physical capture ports\n");
-		exit (1);
-	}
-
-    // Establish connection between ports
-	if (jack_disconnect (looper.client, ports[0], jack_port_name (looper.input_portL))) {
-		fprintf (stderr, "cannot connect input ports\n");
-	}
-    if ((looper.input_portR) &&
-        (jack_disconnect (looper.client, ports[1], jack_port_name (looper.input_portR)))) {
-		fprintf (stderr, "cannot connect input ports\n");
-	}
-
-	free (ports);
-	
-	ports = jack_get_ports (looper.client, NULL, NULL,
-				JackPortIsPhysical|JackPortIsInput);
-	if (ports == NULL) {
-		fprintf(stderr, "no physical playback ports\n");
-		exit (1);
-	}
-
-	if (jack_disconnect (looper.client, jack_port_name (looper.output_portL), ports[0])) {
-		fprintf (stderr, "cannot connect output ports\n");
-	}
-    if ((looper.output_portR) &&
-	    (jack_disconnect (looper.client, jack_port_name (looper.output_portR), ports[1]))) {
-		fprintf (stderr, "cannot connect output ports\n");
-	}
-
-	free (ports);
+    connectPortPairs(false);
 
 	exit (1);
 }
 
 /*
  * Function: main
- * Input: hardware device used as audio interface, example hw:1,0
+ * Input: optional session directory, SESSION_DIR if not given
  * Output: system return status
  * Description:
  *   Initialize Jack server - setup client, ports, callbacks
+ *   Reload the session and start saving new recordings to it
  *   Call control initialization process, starting the interface thread
  *   Sleep while exit is not set
  *   On exit, display the timer table data
@@ -144,12 +367,15 @@ void jack_shutdown (void *arg)
  */
 int main (int argc, char *argv[])
 {
-	const char **ports;
 	const char *client_name = "simple";
 	const char *server_name = NULL;
 	jack_options_t options = JackNullOption;
 	jack_status_t status;
 
+	/* keep our threads, and JACK's own, off the process thread's core */
+
+	rtInit (&looper);
+
 	/* open a client connection to the JACK server */
 
 	looper.client = jack_client_open (client_name, options, &status, server_name);
@@ -176,6 +402,15 @@ int main (int argc, char *argv[])
 
 	jack_set_process_callback (looper.client, process, 0);
 
+	/* size the mix buses for the period, and again whenever
+	   the server changes it
+	*/
+
+	if (!allocateMixdown (jack_get_buffer_size (looper.client))) {
+		exit (1);
+	}
+	jack_set_buffer_size_callback (looper.client, bufferSizeCallback, 0);
+
 	/* tell the JACK server to call `jack_shutdown()' if
 	   it ever shuts down, either entirely, or if it
 	   just decides to stop calling us.
@@ -183,94 +418,114 @@ int main (int argc, char *argv[])
 
 	jack_on_shutdown (looper.client, jack_shutdown, 0);
 
-	/* display the current sample rate. 
+	/* re-query port latencies whenever the graph changes them
+	*/
+
+	jack_set_latency_callback (looper.client, latencyCallback, 0);
+
+	/* count xruns, reported with the timer statistics
+	*/
+
+	jack_set_xrun_callback (looper.client, xrunCallback, 0);
+
+	/* display the current sample rate, track storage is sized from it
 	 */
 
-	printf ("engine sample rate: %" PRIu32 "\n",
-		jack_get_sample_rate (looper.client));
-
-	/* create four ports -- left in and out, right in and out */
-
-	looper.input_portL = jack_port_register (looper.client, "inputL",
-					 JACK_DEFAULT_AUDIO_TYPE,
-					 JackPortIsInput, 0);
-	looper.input_portR = jack_port_register (looper.client, "inputR",
-					 JACK_DEFAULT_AUDIO_TYPE,
-					 JackPortIsInput, 0);
-	looper.output_portL = jack_port_register (looper.client, "outputL",
-					  JACK_DEFAULT_AUDIO_TYPE,
-					  JackPortIsOutput, 0);
-	looper.output_portR = jack_port_register (looper.client, "outputR",
-					  JACK_DEFAULT_AUDIO_TYPE,
-					  JackPortIsOutput, 0);
-
-	if ((looper.input_portL == NULL) || (looper.output_portL == NULL)) {
-		fprintf(stderr, "no more JACK ports available\n");
+	looper.sampleRate = jack_get_sample_rate (looper.client);
+	printf ("engine sample rate: %" PRIu32 "\n", looper.sampleRate);
+
+	/* create the port pairs -- left in and out, right in and out */
+
+	if (!registerPortPairs()) {
 		exit (1);
 	}
-	if ((looper.input_portR == NULL) || (looper.output_portR == NULL)) {
-		fprintf(stderr, "no more JACK ports available\n");
+
+	/* MIDI control in and clock out, left for the user to connect */
+
+	if (!midiInit(&looper)) {
 		exit (1);
 	}
 
-	/* Tell the JACK server that we are ready to roll.  Our
-	 * process() callback will start running now. */
+	/* Start the log drain thread, the process callback only queues log records */
 
-	if (jack_activate (looper.client)) {
-		fprintf (stderr, "cannot activate client");
+	if (!logInit(&looper)) {
 		exit (1);
 	}
 
-	/* Connect the ports.  You can't do this before the client is
-	 * activated, because we can't make connections to clients
-	 * that aren't running.  Note the confusing (but necessary)
-	 * orientation of the driver backend ports: playback ports are
-	 * "input" to the backend, and capture ports are "output" from
-	 * it.
-	 */
+	/* Allocate track storage before any audio runs */
 
-	ports = jack_get_ports (looper.client, NULL, NULL,
-				JackPortIsPhysical|JackPortIsOutput);
-	if (ports == NULL) {
-		fprintf(stderr, "no physical capture ports\n");
+	if (!poolInit(&looper)) {
 		exit (1);
 	}
 
-    // Establish connection between ports
-	if (jack_connect (looper.client, ports[0], jack_port_name (looper.input_portL))) {
-        looper.input_portL = NULL;
-		fprintf (stderr, "cannot connect input ports\n");
+	/* Overdub undo history, copies come out of the pool */
+
+	if (!undoInit(&looper)) {
+		exit (1);
 	}
-    if (jack_connect (looper.client, ports[1], jack_port_name (looper.input_portR))) {
-        looper.input_portR = NULL;
-		fprintf (stderr, "cannot connect input ports\n");
+
+    // Set here for testing until passing group via commands, a session overrides it
+    looper.selectedGroup = 1;
+
+	/* Command queues and track levels, before a restored track or a MIDI
+	 * event from the process callback can use them */
+
+	if (!controlInit(&looper)) {
+		exit (1);
 	}
 
-	free (ports);
-	
-	ports = jack_get_ports (looper.client, NULL, NULL,
-				JackPortIsPhysical|JackPortIsInput);
-	if (ports == NULL) {
-		fprintf(stderr, "no physical playback ports\n");
+	/* Reload the last session and keep saving to it, before any audio runs */
+
+	if (!sessionInit(&looper, (argc > 1) ? argv[1] : SESSION_DIR)) {
 		exit (1);
 	}
 
-	if (jack_connect (looper.client, jack_port_name (looper.output_portL), ports[0])) {
-        looper.output_portL = NULL;
-		fprintf (stderr, "cannot connect output ports\n");
+	/* Mix workers on the spare cores, at the priority JACK gives our process thread */
+
+	if (!workersInit(&looper, jack_client_real_time_priority (looper.client))) {
+		exit (1);
 	}
-	if (jack_connect (looper.client, jack_port_name (looper.output_portR), ports[1])) {
-        looper.output_portR = NULL;
-		fprintf (stderr, "cannot connect output ports\n");
+
+	/* Pre-mixed group buses, rebuilt in the background as tracks change */
+
+	if (!groupBusInit(&looper)) {
+		exit (1);
 	}
 
-	free (ports);
+	/* Track bounces render on their own thread */
 
+	if (!bounceInit(&looper)) {
+		exit (1);
+	}
 
-    // Set here for testing until passing group via commands
-    looper.selectedGroup = 1;
+	/* Lock everything allocated so far, and all that follows, into
+	 * memory, the process thread pins itself when it starts */
+
+	rtPrepare ();
+
+	/* Tell the JACK server that we are ready to roll.  Our
+	 * process() callback will start running now. */
 
-    if (!controlInit(&looper))
+	if (jack_activate (looper.client)) {
+		fprintf (stderr, "cannot activate client");
+		exit (1);
+	}
+
+	/* Connect the ports.  You can't do this before the client is
+	 * activated, because we can't make connections to clients
+	 * that aren't running.  Note the confusing (but necessary)
+	 * orientation of the driver backend ports: playback ports are
+	 * "input" to the backend, and capture ports are "output" from
+	 * it.
+	 */
+
+    // Establish connection between ports
+    connectPortPairs(true);
+
+    // Latencies are only meaningful once the ports are connected
+    updateLatency();
+
+    if ((!serialInit(&looper)) || (!footswitchInit(&looper)) || (!netInit(&looper)))
     {
       return -1;
     }
@@ -285,18 +540,6 @@ int main (int argc, char *argv[])
     serialClose(looper.sfd);
     printTimers();
 
-    int i = 0;
-    for (i=0; i<looper.tracks[0].pulseIdx; i++)
-    {
-        printf("Trk %d, idx %d\n",0, looper.tracks[0].pulseIdxArr[i]);
-    }
-    for (i=0; i<looper.tracks[1].pulseIdx; i++)
-    {
-        printf("Trk %d, idx %d\n",1, looper.tracks[1].pulseIdxArr[i]);
-    }
-
-
-
     int z = 0;
     for (z = 0; z < NUM_TRACKS; z++)
     {
@@ -305,7 +548,12 @@ int main (int argc, char *argv[])
 
     printf("Joining thread\n");
     pthread_join(looper.controlTh, NULL);
+    sessionJoin();
+    groupBusJoin();
+    bounceJoin();
+    logJoin();
 
 	jack_client_close (looper.client);
+	workersJoin ();
 	exit (0);
 }
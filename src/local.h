@@ -21,19 +21,72 @@
 #include <limits.h>
 #include <float.h>
 #include <pthread.h>
+#include <stdatomic.h>
 
 #include <jack/jack.h>
 
 /**************************************************************
  * Macros and defines                                         *
  *************************************************************/
-#define MAX_SAMPLE_VALUE                (UINT16_MAX) // match to audio capture device, 220 is 16bit
-#define TRACK_MAX_LENGTH_S              (60)
 #define NUM_GROUPS                      (4)
-#define NUM_TRACKS                      (16)
-#define SAMPLE_LIMIT                    (44100 * TRACK_MAX_LENGTH_S)
-#define FRAME_COUNT                     (SAMPLE_LIMIT + 512)
-#define GPIO_ISR_DEBOUNCE_MS            (500)
+#define NUM_TRACKS                      (16)    // at most 32, groups keep uint32_t track bitmasks
+// Track storage - every track draws fixed size chunks from one shared pool
+#define CHUNK_FRAMES_SHIFT              (12)
+#define CHUNK_FRAMES                    (1 << CHUNK_FRAMES_SHIFT)
+#define CHUNK_FRAMES_MASK               (CHUNK_FRAMES - 1)
+#define POOL_LENGTH_S                   (8 * 60) // seconds of single channel audio shared by all tracks
+#define UNDO_LAYERS                     (8)     // overdub passes per track that can be undone
+#define POOL_RECLAIM_CHUNKS             (256)   // released chunks handed back to the pool per period
+#define MAX_PORT_PAIRS                  (4)     // stereo in/out pairs, one per performer, as many as the interface has
+#define GPIO_ISR_DEBOUNCE_MS            (500)   // edges this soon after a press are ignored
+// Footswitches to ground on wiringPi pins, pulled up, a press is the falling edge
+#define FOOTSWITCH_COUNT                (4)
+#define FOOTSWITCH_PIN_RECORD           (0)     // record the next empty track, press again to play
+#define FOOTSWITCH_PIN_OVERDUB          (2)     // overdub the selected track, press again to play
+#define FOOTSWITCH_PIN_UNDO             (3)     // undo the selected track's last overdub
+#define FOOTSWITCH_PIN_RESET            (4)     // back to passthrough
+// Jack MIDI control in, clock out so drum machines follow the loop, see midi.c
+#define MIDI_CLOCK_PPQN                 (24)
+#define MIDI_CLOCK_BEATS_PER_LOOP       (4)     // beats the master loop is clocked as, 0 for no clock
+// Network control and telemetry, UDP, see net.c
+#define NET_UDP_PORT                    (5005)
+// Address the UDP port is bound to, the control is unauthenticated so only the Pi
+// itself by default, make NET_ADDRESS=0.0.0.0 opens it to the network
+#ifndef NET_BIND_ADDRESS
+#define NET_BIND_ADDRESS                "127.0.0.1"
+#endif
+#define NET_TELEMETRY_HZ                (20)    // telemetry packets a second to each client, 0 for none
+#define NET_MAX_CLIENTS                 (4)
+#define NET_CLIENT_TIMEOUT_S            (10)    // a client that did not subscribe again for this long gets no more telemetry
+#define METER_STRIDE                    (4)     // track samples per peak meter reading
+#define METER_FULL_SCALE                (32768) // meter value of a full scale sample
+// Track storage format, pick at build time with make TRACK_FORMAT=1 after make clean
+// Float keeps the Jack samples as they are, int16 halves the pool and the memory
+// bandwidth of every mixed track, samples beyond full scale clip when stored
+#define TRACK_FORMAT_FLOAT              (0)
+#define TRACK_FORMAT_INT16              (1)
+#ifndef TRACK_FORMAT
+#define TRACK_FORMAT                    TRACK_FORMAT_FLOAT
+#endif
+#define TRACK_SAMPLE_SCALE              (32767.0f)  // int16 value of a full scale Jack sample
+#define QUANTIZE_DIVISIONS              (0)     // record start and stop grid, points per first loop, 0 off
+#define SESSION_DIR                     "session"  // default, main's first argument overrides it
+#define COMMAND_QUEUE_SLOTS             (32) // power of two, commands pending for the process callback
+// Track mix levels, gain and pan move towards their new value at one full scale per fade time
+#define TRACK_GAIN_UNITY_LEVEL          (50) // serial level for unity gain, 99 is about +6dB
+#define TRACK_PAN_CENTRE_LEVEL          (50) // serial pan level, 01 hard left, 99 hard right
+#define TRACK_FADE_MS                   (10)
+// Loop seams, where a track wraps or the master restarts, crossfade the end of the pass
+// into the new one. A take keeps recording this long past its end for it, see trackSegments
+#define LOOP_SEAM_FADE_FRAMES           (64)
+#define MIX_TRACK_SEGMENTS              (8)  // most stretches one track is mixed as per block, see trackSegments
+// Parallel mix, worker threads on the spare cores take a share of the tracks
+#define RT_PROCESS_CORE                 (0)  // the Jack process thread's core, every other thread keeps off it
+#define RT_STACK_PREFAULT_BYTES         (64 * 1024) // process thread stack faulted in before the first period
+#define MIX_WORKERS                     (3)  // at most, one per core after the first, 0 mixes on the Jack thread only
+#define MIX_PARALLEL_MIN_TRACKS         (8)  // fewer audible tracks are not worth the hand off
+// Group bus cache, each group's tracks pre-mixed in the background so a settled group is one stream
+#define GROUP_BUS_LENGTH_S              (20) // longest loop cached, 0 turns the cache off
 // Serial interface commands
 #define MIN_SERIAL_DATA_LENGTH          (6)
 #define SERIAL_CMD_OFFSET               (0)
@@ -65,14 +118,38 @@
 #define SERIAL_CMD_SYSTEM_RESET_UC      'S'
 #define SERIAL_CMD_QUIT_LC              'q'
 #define SERIAL_CMD_QUIT_UC              'Q'
+#define SERIAL_CMD_LOG_LEVEL_LC         'l'
+#define SERIAL_CMD_LOG_LEVEL_UC         'L'
+#define SERIAL_LOG_LEVEL_DIGIT          (1)
+#define SERIAL_CMD_STATUS_LC            'i'
+#define SERIAL_CMD_STATUS_UC            'I'
+#define SERIAL_STATUS_RESET_DIGIT       (1)
+#define SERIAL_CMD_GAIN_LC              'v'
+#define SERIAL_CMD_GAIN_UC              'V'
+#define SERIAL_CMD_PAN_LC               'b'
+#define SERIAL_CMD_PAN_UC               'B'
+#define SERIAL_CMD_BOUNCE_LC            'f'
+#define SERIAL_CMD_BOUNCE_UC            'F'
+#define SERIAL_CMD_UNDO_LC              'z'
+#define SERIAL_CMD_UNDO_UC              'Z'
+#define SERIAL_CMD_REDO_LC              'y'
+#define SERIAL_CMD_REDO_UC              'Y'
+#define SERIAL_CMD_QUANTIZE_LC          'n'
+#define SERIAL_CMD_QUANTIZE_UC          'N'
+#define SERIAL_CMD_INPUT_LC             'a'
+#define SERIAL_CMD_INPUT_UC             'A'
+#define NET_CMD_SUBSCRIBE_LC            'w'     // network only, w0000 and a carriage return
+#define NET_CMD_SUBSCRIBE_UC            'W'
+#define SERIAL_LEVEL_UPPER_DIGIT        (3)
+#define SERIAL_LEVEL_LOWER_DIGIT        (4)
 #define SERIAL_CMD_ACCEPTED             'p'
+#define SERIAL_FRAME_START              (0x02)  // STX, then length, commands and checksum
+#define SERIAL_FRAME_HEADER_LENGTH      (2)     // start and length bytes
+#define SERIAL_FRAME_MAX_COMMANDS       (8)
 #define SERIAL_CMD_REJECTED             'f'
 
-// Debug
-#define TRACK_TEST_PULSE_COUNT          8
-#define TRACK_DEBUG_FRAME_COUNT         88200
-
 // Timer defines
+#define STATS_TEXT_LENGTH (1024)
 #define TIMER_COUNT	(5)
 #define FOREACH_TIMER(TIMER) \
     TIMER(TIMER_RECORD_START_DELAY) \
@@ -84,6 +161,48 @@
 #define GENERATE_ENUM(ENUM) ENUM,
 #define GENERATE_STRING(STRING) #STRING,
 
+// Log messages - id, level, format with up to 3 integer arguments
+#define FOREACH_LOG_MESSAGE(MSG) \
+    MSG(LOG_MSG_RECORDING,      LOG_LEVEL_INFO,  "Recording track %d on group %d, record offset %d") \
+    MSG(LOG_MSG_OVERDUBBING,    LOG_LEVEL_INFO,  "Overdubbing track %d") \
+    MSG(LOG_MSG_PLAYING_LENGTH, LOG_LEVEL_INFO,  "Playing track %d, length %d") \
+    MSG(LOG_MSG_PLAYING,        LOG_LEVEL_INFO,  "Playing track %d") \
+    MSG(LOG_MSG_SYSTEM_RESET,   LOG_LEVEL_INFO,  "System reset") \
+    MSG(LOG_MSG_ADD_TRACK,      LOG_LEVEL_INFO,  "Add track %d to group %d") \
+    MSG(LOG_MSG_REMOVE_TRACK,   LOG_LEVEL_INFO,  "Remove track %d from group %d") \
+    MSG(LOG_MSG_SET_GROUP,      LOG_LEVEL_INFO,  "Setting group to %d") \
+    MSG(LOG_MSG_REPEAT_ON,      LOG_LEVEL_INFO,  "Repeat enabled for track %d") \
+    MSG(LOG_MSG_REPEAT_OFF,     LOG_LEVEL_INFO,  "Repeat disabled for track %d") \
+    MSG(LOG_MSG_SET_GAIN,       LOG_LEVEL_INFO,  "Track %d gain level %d") \
+    MSG(LOG_MSG_SET_PAN,        LOG_LEVEL_INFO,  "Track %d pan level %d") \
+    MSG(LOG_MSG_SET_INPUT,      LOG_LEVEL_INFO,  "Track %d records from input pair %d") \
+    MSG(LOG_MSG_SET_QUANTIZE,   LOG_LEVEL_INFO,  "Quantize to %d divisions of the first loop") \
+    MSG(LOG_MSG_QUANTIZE,       LOG_LEVEL_INFO,  "Event %d waits %d frames for the grid") \
+    MSG(LOG_MSG_QUANTIZE_DROP,  LOG_LEVEL_INFO,  "Event %d dropped, the state changed before its grid point") \
+    MSG(LOG_MSG_QUANTIZE_CANCEL, LOG_LEVEL_INFO, "Event %d taken back by the footswitch before its grid point") \
+    MSG(LOG_MSG_NO_EMPTY_TRACK, LOG_LEVEL_WARN,  "!! No empty track to record on group %d") \
+    MSG(LOG_MSG_BOUNCE_START,   LOG_LEVEL_INFO,  "Bouncing group %d into track %d, %d tracks") \
+    MSG(LOG_MSG_BOUNCE_DONE,    LOG_LEVEL_INFO,  "Bounced group %d into track %d") \
+    MSG(LOG_MSG_BOUNCE_BUSY,    LOG_LEVEL_WARN,  "!! Bounce of group %d refused, one is under way") \
+    MSG(LOG_MSG_BOUNCE_INVALID, LOG_LEVEL_WARN,  "!! Cannot bounce group %d into track %d") \
+    MSG(LOG_MSG_BOUNCE_NO_MEMORY, LOG_LEVEL_WARN, "!! Bounce of group %d needs more than the %d free chunks") \
+    MSG(LOG_MSG_BOUNCE_STALE,   LOG_LEVEL_WARN,  "!! Group %d changed while bouncing, bounce dropped") \
+    MSG(LOG_MSG_UNDO,           LOG_LEVEL_INFO,  "Undo overdub on track %d, %d chunks, %d passes left") \
+    MSG(LOG_MSG_REDO,           LOG_LEVEL_INFO,  "Redo overdub on track %d, %d chunks, %d passes left") \
+    MSG(LOG_MSG_UNDO_EMPTY,     LOG_LEVEL_WARN,  "!! Nothing to undo on track %d") \
+    MSG(LOG_MSG_REDO_EMPTY,     LOG_LEVEL_WARN,  "!! Nothing to redo on track %d") \
+    MSG(LOG_MSG_MIDI_QUEUE_FULL, LOG_LEVEL_WARN, "!! Command queue full, MIDI %d %d dropped") \
+    MSG(LOG_MSG_POOL_FULL,      LOG_LEVEL_ERROR, "** TRACK POOL FULL - Switch to Playback") \
+    MSG(LOG_MSG_BUFFER_FULL,    LOG_LEVEL_ERROR, "** BUFFER FULL - Switch to Playback") \
+    MSG(LOG_MSG_TIMER_INVALID,  LOG_LEVEL_WARN,  "!! Invalid Timer %d") \
+    MSG(LOG_MSG_TIMER_STARTED,  LOG_LEVEL_WARN,  "!! Timer %d already started") \
+    MSG(LOG_MSG_REC_DATA_COPY,  LOG_LEVEL_DEBUG, "RecDataCopy masterIDX %d, callCounter %d") \
+    MSG(LOG_MSG_PLAY_DATA,      LOG_LEVEL_DEBUG, "Play masterIDX %d, callCounter %d") \
+    MSG(LOG_MSG_CALIBRATION,    LOG_LEVEL_DEBUG, "PRCal t1idx %d") \
+    MSG(LOG_MSG_FIRST_DATA,     LOG_LEVEL_DEBUG, "T%d idx %d, CC %d") \
+
+#define GENERATE_LOG_ENUM(ENUM, LEVEL, FORMAT) ENUM,
+
 /**************************************************************
  * Data types                                                 *
  *************************************************************/
@@ -101,6 +220,19 @@ enum TIMER_ENUM {
 };
 */
 
+enum LogLevel
+{
+    LOG_LEVEL_ERROR,
+    LOG_LEVEL_WARN,
+    LOG_LEVEL_INFO,
+    LOG_LEVEL_DEBUG
+};
+
+enum LogMessage
+{
+    FOREACH_LOG_MESSAGE(GENERATE_LOG_ENUM)
+};
+
 enum TrackState
 {
     TRACK_STATE_OFF,                // Empty track or available for recording
@@ -120,6 +252,33 @@ enum SystemEvents
     SYSTEM_EVENT_ADD_TRACK_TO_GROUP,        // Adds a track to a group - nothing more - track # & group # required
     SYSTEM_EVENT_REMOVE_TRACK_FROM_GROUP,   // Removes track from a group - track # & group # required
     SYSTEM_EVENT_SET_ACTIVE_GROUP,          // Sets the currently active group - group # required
+    SYSTEM_EVENT_SET_GAIN,                  // Set a track's gain, any state - track # and value required
+    SYSTEM_EVENT_SET_PAN,                   // Set a track's pan, any state - track # and value required
+    SYSTEM_EVENT_BOUNCE_GROUP,              // Merge a group's playing tracks into one - track # & group # required
+    SYSTEM_EVENT_UNDO_TRACK,                // Take back the track's last overdub pass - track # required
+    SYSTEM_EVENT_REDO_TRACK,                // Put back the last overdub pass undone - track # required
+    SYSTEM_EVENT_SET_QUANTIZE,              // Set the record start and stop grid, any state - value required
+    SYSTEM_EVENT_SET_INPUT,                 // Set the input pair a track records from, any state - track # and value required
+    SYSTEM_EVENT_FOOTSWITCH,                // A footswitch was pressed, mapped to a command in the state it lands in - value is its enum FootswitchAction
+};
+
+// What each footswitch does, the process callback picks the command for it, see mapFootswitch
+enum FootswitchAction
+{
+    FOOTSWITCH_ACTION_RECORD,
+    FOOTSWITCH_ACTION_OVERDUB,
+    FOOTSWITCH_ACTION_UNDO,
+    FOOTSWITCH_ACTION_RESET
+};
+
+// Interfaces that queue commands, each queues from one thread
+enum CommandSource
+{
+    COMMAND_SOURCE_SERIAL,
+    COMMAND_SOURCE_MIDI,            // queued and applied by the process callback itself
+    COMMAND_SOURCE_NETWORK,
+    COMMAND_SOURCE_FOOTSWITCH,      // first of FOOTSWITCH_COUNT, wiringPi runs each ISR on its own thread
+    COMMAND_SOURCE_COUNT = COMMAND_SOURCE_FOOTSWITCH + FOOTSWITCH_COUNT
 };
 
 enum SystemStates
@@ -131,16 +290,137 @@ enum SystemStates
     SYSTEM_STATE_CALIBRATION        // For sychronization configuration
 };
 
+// Wait-free single producer/single consumer ring of fixed size records
+struct SpscQueue
+{
+    _Atomic uint32_t head;          // Next slot to write, only the producer stores it
+    _Atomic uint32_t tail;          // Next slot to read, only the consumer stores it
+    uint32_t mask;                  // Number of slots - 1
+    size_t recordSize;
+    uint8_t *records;
+};
+
+// One contiguous stretch of a track to mix, with a linear gain ramp
+struct MixSegment
+{
+    struct Track *track;
+    uint32_t srcIdx;                // first track index
+    jack_nframes_t dst;             // offset into the output of the first frame
+    jack_nframes_t count;
+    float gainLeft;                 // gain of the first frame and the change per frame
+    float stepLeft;
+    float gainRight;
+    float stepRight;
+};
+
+// Where a track is over a stretch of frames, and the levels it moves through, see trackSegments
+struct TrackSpan
+{
+    uint32_t startIdx;
+    uint32_t endIdx;
+    uint32_t idx;                   // track index of the first frame
+    uint32_t masterLeft;            // frames to the master seam, 0 if the master does not wrap
+    uint32_t cutIdx;                // where the pass before the one at idx was cut, 0 if it did not follow a wrap
+    uint32_t tailFrames;            // recorded past endIdx
+    jack_nframes_t count;
+    float levelLeft;                // level of the frame before the first, and the change per frame
+    float stepLeft;
+    float levelRight;
+    float stepRight;
+    bool repeat;
+};
+
+// What one track contributes to a group mix, see groupSignature
+struct MixSource
+{
+    uint32_t takeId;
+    uint32_t startIdx;
+    uint32_t endIdx;
+    uint32_t tailFrames;
+    float levelLeft;                // target levels, 0 when muted
+    float levelRight;
+    uint8_t channels;
+    bool repeat;
+    bool audible;                   // false for a track that is OFF
+};
+
+// Everything a group mix is built from, compared whole so it is always cleared first
+struct GroupSignature
+{
+    uint32_t masterLength;
+    uint32_t tracks;                        // tracks the mix is built from
+    struct MixSource sources[NUM_TRACKS];
+};
+
+// The Jack buffers of every port pair for one block, right sides NULL for a mono pair
+struct PortBuffers
+{
+    jack_default_audio_sample_t *inL[MAX_PORT_PAIRS];
+    jack_default_audio_sample_t *inR[MAX_PORT_PAIRS];
+    jack_default_audio_sample_t *outL[MAX_PORT_PAIRS];
+    jack_default_audio_sample_t *outR[MAX_PORT_PAIRS];
+};
+
+// A sample as a track stores it, see TRACK_FORMAT
+#if TRACK_FORMAT == TRACK_FORMAT_INT16
+typedef int16_t track_sample_t;
+#else
+typedef jack_default_audio_sample_t track_sample_t;
+#endif
+
+// A user command on its way from the interface thread to the process callback
+struct ControlCommand
+{
+    jack_nframes_t frameTime;       // Absolute frame the command was received on
+    uint8_t track;
+    uint8_t group;
+    uint8_t event;
+    uint8_t value;                  // Gain or pan level, 0 to 99
+    bool repeat;
+};
+
+// A text interface taking the serial commands, each interface thread has its own
+struct CommandParser
+{
+    struct ControlCommand cmd;      // Command being assembled, a field the command leaves out keeps its last value
+    uint8_t source;                 // enum CommandSource the commands are queued on
+    void (*reply)(const char *text, size_t length);    // Answer back to where the command came from
+};
+
+// Overdub passes that can be undone, each is the list of chunks it replaced, see undo.c
+struct TrackHistory
+{
+    struct UndoEntry *layers[UNDO_LAYERS];  // oldest pass first
+    uint8_t numLayers;                      // passes kept
+    uint8_t applied;                        // passes in the track's audio, the rest can be redone
+};
+
 struct Track
 {
-    // data buffer - should be an array of samples to allow easier access
-    jack_default_audio_sample_t channelLeft[FRAME_COUNT];
-    jack_default_audio_sample_t channelRight[FRAME_COUNT];
+    // data buffer - chunk c holds samples c * CHUNK_FRAMES onwards, NULL until recorded
+    // one track may borrow the whole pool, so each table has looper->trackMaxChunks entries
+    track_sample_t **chunksLeft;
+    track_sample_t **chunksRight;
+    uint32_t numChunks;             // Chunk table entries in use, per channel
+    uint8_t  channels;              // 1 - mono, only chunksLeft is used, 2 - stereo, set at record time
+    uint8_t  inputPair;             // Port pair recorded and overdubbed from, the track's record-arm routing
     uint32_t currIdx;               // Current index into samples, range is 0 to sampleIndexEnd
     uint32_t startIdx;              // Start location - assigned to master's current location
     uint32_t endIdx;                // Number of samples for this track - ie track length
-    uint32_t pulseIdxArr[TRACK_TEST_PULSE_COUNT];
-    uint8_t  pulseIdx;
+    uint32_t recordOffset;          // Frames input is written behind currIdx while recording/overdubbing
+    uint32_t wrapDelta;             // How far currIdx went back at the last wrap, input still due from before it lands there
+    uint32_t cutIdx;                // Where the pass before this one was cut at the last wrap, 0 if this pass did not follow a wrap
+    uint32_t tailFrames;            // Frames recorded past endIdx, faded out under the start of the next pass
+    uint32_t tailDue;               // Frames of the tail still to record, from the input after the take stopped
+    _Atomic uint32_t savedEnd;      // endIdx and the tail as published to the session writer
+    _Atomic uint32_t takeId;        // Changes whenever audio below savedEnd was replaced or released
+    float    gain;                  // Mix level, 1.0 is unity
+    float    pan;                   // -1.0 hard left to 1.0 hard right
+    float    levelLeft;             // Gains the mix reached at the end of the last block,
+    float    levelRight;            //      they ramp towards gain and pan, or 0 when muted
+    _Atomic uint32_t meterLeft;     // Peak heard since telemetry last took it, METER_FULL_SCALE is full scale
+    _Atomic uint32_t meterRight;
+    struct TrackHistory history;    // Overdub undo and redo, only touched from the process thread
     enum TrackState state;
     bool repeat;                    // If track isn't the longest track, we can repeat it:
                                     //      if we get to the end of this track but not master track
@@ -152,54 +432,267 @@ struct MasterLooper
     // pointers to the tracks
     struct Track tracks[NUM_TRACKS];
     struct Track *groupedTracks[NUM_GROUPS][NUM_TRACKS];
-    jack_port_t *input_portL;
-    jack_port_t *output_portL;
-    jack_port_t *input_portR;
-    jack_port_t *output_portR;
+    uint32_t    groupMembers[NUM_GROUPS];   // Bit per track, set when groupedTracks[group][track] is assigned
+    uint32_t    activeTracks[NUM_GROUPS];   // Members with recorded audio, endIdx > 0
+    uint8_t     numActiveTracks[NUM_GROUPS];
+    jack_port_t *input_portL[MAX_PORT_PAIRS];
+    jack_port_t *output_portL[MAX_PORT_PAIRS];
+    jack_port_t *input_portR[MAX_PORT_PAIRS];   // NULL for a mono pair
+    jack_port_t *output_portR[MAX_PORT_PAIRS];
+    uint8_t     numPortPairs;               // Pairs registered, from the physical capture ports at startup
+    jack_port_t *midi_in_port;              // Control from any MIDI controller connected to it
+    jack_port_t *midi_out_port;             // MIDI clock and transport following the master loop
     jack_client_t *client;
     pthread_t controlTh;                    // Thread to monitor the UART/Interfaces
+    pthread_t netTh;                        // Network control and telemetry thread
+    bool        meteringOn;                 // Telemetry has a client, the mix keeps the track meters
+    // Engine sizing, taken from the JACK server at startup
+    jack_nframes_t sampleRate;
+    jack_nframes_t periodSize;              // Frames per process call, updated by the buffer size callback
+    uint32_t    trackMaxChunks;             // Chunk table entries per track channel
+    uint32_t    sampleLimit;                // Longest a track can be, in frames
     uint32_t    masterLength[NUM_GROUPS];   // Longest track, some tracks may be on repeat, others silent
+    uint32_t    barLength[NUM_GROUPS];      // Length of the group's first loop, the quantize grid
+    uint8_t     quantizeDivisions;          // Grid points per bar for record start and stop, 0 off
     uint32_t    masterCurrIdx;              // Current index of master track
     uint32_t    callCounter;
     // Frame counters for synchronization
-    jack_nframes_t ui_frames_cmd_rx;        // Frame count when command received
-    jack_nframes_t process_frames;          // Frame count when Process called
-    jack_nframes_t rec_frame_delay;         // Frames between rec and actual update
-    jack_nframes_t play_frame_delay;        // Frames between play and actual update
+    jack_nframes_t captureLatency;          // Frames from the capture device to our input port
+    jack_nframes_t playbackLatency;         // Frames from our output port to the playback device
+    jack_nframes_t recordLatency;           // Frames between mixing a sample and its overdub arriving
     int         sfd;                        // Serial port file description
     uint8_t     selectedTrack;              // Track number we're recording to, 0xFF if playback only
     uint8_t     selectedGroup;              // 0 for no groups - mute - 1+ if recording
     uint8_t     min_serial_data_length;     // minimum UART data received before command processed
     enum        SystemStates state;         // Current state of the system
     bool        monitoringOff;              // Allow system input to be output, turn off when tuning or not wanting any noise going through
-    bool        controlLocked;              // Prevent updates to states while Jack is processing
     bool        exitNow;                    // Enables program to exit via UART cmd
 };
 
 
+/**************************************************************
+ * Inline helpers
+ *************************************************************/
+
+// Address of sample idx in a channel's chunk table, the chunk must be allocated
+static inline track_sample_t *chunkSample(
+    track_sample_t * const *chunks,
+    uint32_t idx)
+{
+    return chunks[idx >> CHUNK_FRAMES_SHIFT] + (idx & CHUNK_FRAMES_MASK);
+}
+
+// Take the lowest track off a track bitmask, the mask must not be empty
+static inline uint8_t nextTrack(uint32_t *mask)
+{
+    uint8_t track = __builtin_ctz(*mask);
+    *mask &= *mask - 1;
+    return track;
+}
+
+// Refresh a track's bit in every group's active mask after its endIdx or membership changed
+static inline void trackUpdateActive(struct MasterLooper *looper, uint8_t track)
+{
+    uint32_t bit = 1u << track;
+    uint8_t group;
+    for (group = 0; group < NUM_GROUPS; group++)
+    {
+        if ((looper->groupMembers[group] & bit) && (looper->tracks[track].endIdx > 0))
+        {
+            looper->activeTracks[group] |= bit;
+        }
+        else
+        {
+            looper->activeTracks[group] &= ~bit;
+        }
+        looper->numActiveTracks[group] = __builtin_popcount(looper->activeTracks[group]);
+    }
+}
+
+// Publish a track's recorded length to the session writer, audio below it is written
+static inline void trackPublish(struct Track *track)
+{
+    atomic_store_explicit(&track->savedEnd, track->endIdx + track->tailFrames, memory_order_release);
+}
+
+// The track's audio was released or changed in place, the session writer starts it over
+static inline void trackNewTake(struct Track *track)
+{
+    atomic_store_explicit(&track->takeId,
+        atomic_load_explicit(&track->takeId, memory_order_relaxed) + 1, memory_order_relaxed);
+    atomic_thread_fence(memory_order_release);
+    trackPublish(track);
+}
+
+// The mix levels a track is heading for, 0 when muted. Pan is a balance control,
+// the centre leaves both sides at the track's gain
+static inline void trackTargetLevels(const struct Track *track, float *left, float *right)
+{
+    float gain = (track->state == TRACK_STATE_MUTE) ? 0.0f : track->gain;
+    *left = gain * ((track->pan > 0.0f) ? 1.0f - track->pan : 1.0f);
+    *right = gain * ((track->pan < 0.0f) ? 1.0f + track->pan : 1.0f);
+}
+
+// The master loop goes round in playback and while overdubbing, recording a new track grows it
+static inline bool masterWraps(const struct MasterLooper *looper)
+{
+    return (looper->state == SYSTEM_STATE_PLAYBACK) || (looper->state == SYSTEM_STATE_OVERDUBBING);
+}
+
+// Where a repeating track is once idx has run to or past its endIdx, it goes round from startIdx
+static inline uint32_t trackWrap(uint32_t startIdx, uint32_t endIdx, uint32_t idx)
+{
+    return startIdx + ((idx - endIdx) % (endIdx - startIdx));
+}
+
+// Frames from idx that can be accessed contiguously, at most count
+static inline jack_nframes_t chunkRun(uint32_t idx, jack_nframes_t count)
+{
+    jack_nframes_t room = CHUNK_FRAMES - (idx & CHUNK_FRAMES_MASK);
+    return (room < count) ? room : count;
+}
+
 /**************************************************************
  * Public function prototypes
  *************************************************************/
 
 void overdub(
     jack_default_audio_sample_t *in, 
-    jack_default_audio_sample_t *track,
+    track_sample_t **chunks,
+    uint32_t idx,
     jack_nframes_t nframes);
 
-void updateIndices(struct MasterLooper *looper, jack_nframes_t nframes); 
-int playRecord (
+float seamEnvelope(uint32_t since);
+uint8_t trackSegments(const struct TrackSpan *span, struct MixSegment *segs);
+void doMixDown(
     struct MasterLooper *looper,
-    jack_default_audio_sample_t *mixdownLeft,
-    jack_default_audio_sample_t *mixdownRight,
+    const struct PortBuffers *io,
     jack_nframes_t nframes);
 
-void controlStateCheck(void);
+void dspAccumulate(
+    jack_default_audio_sample_t *dst,
+    const jack_default_audio_sample_t *src,
+    jack_nframes_t count);
+void dspSoftClip(jack_default_audio_sample_t *buf, jack_nframes_t count);
+void dspTrackAccumulate(
+    jack_default_audio_sample_t *dst,
+    const track_sample_t *src,
+    jack_nframes_t count);
+void dspTrackMix(
+    jack_default_audio_sample_t *dst,
+    const track_sample_t *src,
+    jack_nframes_t count,
+    float gain,
+    float step);
+void dspTrackMixMono(
+    jack_default_audio_sample_t *dstL,
+    jack_default_audio_sample_t *dstR,
+    const track_sample_t *src,
+    jack_nframes_t count,
+    float gainL,
+    float stepL,
+    float gainR,
+    float stepR);
+void dspTrackStore(
+    track_sample_t *dst,
+    const jack_default_audio_sample_t *src,
+    jack_nframes_t count);
+
+void updateIndices(struct MasterLooper *looper, jack_nframes_t nframes); 
+int playRecord (struct MasterLooper *looper, jack_nframes_t nframes);
+
+bool controlPeekCommand(jack_nframes_t *frameTime);
+void controlApplyCommand(jack_nframes_t frameTime);
 bool controlInit(struct MasterLooper *mLooper);
+jack_nframes_t controlFrameTime(void);
+bool controlQueueCommand(uint8_t source, const struct ControlCommand *cmd);
+
+bool serialInit(struct MasterLooper *mLooper);
+void serialDispatchCommand(struct CommandParser *parser, char buf[], jack_nframes_t frameTime);
+
+bool netInit(struct MasterLooper *mLooper);
+
+bool footswitchInit(struct MasterLooper *mLooper);
+
+void rtInit(struct MasterLooper *mLooper);
+void rtPrepare(void);
+
+bool midiInit(struct MasterLooper *mLooper);
+void midiReadInput(jack_nframes_t nframes);
+void midiWriteClock(jack_nframes_t nframes);
+
+bool sessionInit(struct MasterLooper *mLooper, const char *dir);
+void sessionJoin(void);
 
 int getNumActiveTracks(void);
 
+bool poolInit(struct MasterLooper *looper);
+uint32_t poolFreeChunks(void);
+track_sample_t *poolTakeChunk(void);
+void poolReclaim(uint32_t budget);
+void poolGiveChunk(track_sample_t *chunk);
+bool trackReserve(struct Track *track, uint32_t idx, jack_nframes_t count);
+void trackRelease(struct Track *track);
+void trackWrite(
+    track_sample_t **chunks,
+    uint32_t idx,
+    const jack_default_audio_sample_t *src,
+    jack_nframes_t count);
+
+bool undoInit(struct MasterLooper *mLooper);
+void undoBegin(struct Track *track);
+void undoEnd(struct Track *track);
+bool undoTouch(struct Track *track, uint32_t idx, jack_nframes_t count);
+void undoClear(struct Track *track);
+void undoReclaim(uint32_t budget);
+uint32_t undoStep(struct Track *track, bool redo);
+
+void queueInit(struct SpscQueue *q, void *storage, uint32_t slots, size_t recordSize);
+bool queuePush(struct SpscQueue *q, const void *record);
+bool queuePop(struct SpscQueue *q, void *record);
+
+bool workersInit(struct MasterLooper *mLooper, int priority);
+bool workersResize(jack_nframes_t nframes);
+void workersJoin(void);
+uint8_t workersCount(void);
+jack_default_audio_sample_t *workersBus(uint8_t part, uint8_t channel);
+void workersRun(void (*function)(uint8_t part, void *arg), void *arg, uint8_t parts);
+
+bool groupBusInit(struct MasterLooper *mLooper);
+void groupBusJoin(void);
+bool bounceInit(struct MasterLooper *mLooper);
+void bounceJoin(void);
+void bounceStart(uint8_t group, uint8_t track);
+void bounceApply(void);
+
+void groupSignature(uint8_t group, struct GroupSignature *sig);
+void groupRender(
+    const struct GroupSignature *sig,
+    uint32_t masterIdx,
+    uint32_t count,
+    jack_default_audio_sample_t *left,
+    jack_default_audio_sample_t *right);
+bool groupBusMix(
+    struct MasterLooper *looper,
+    jack_default_audio_sample_t *mixLeft,
+    jack_default_audio_sample_t *mixRight,
+    jack_nframes_t nframes);
+
+bool logInit(struct MasterLooper *mLooper);
+void logJoin(void);
+void logSetProcessThread(pthread_t thread);
+bool logSetLevel(uint8_t level);
+void logEvent(enum LogMessage id, int32_t a0, int32_t a1, int32_t a2);
+
 void startTimer(uint8_t index);
 void stopTimer(uint8_t index);
+uint64_t timerLastNs(uint8_t index);
+void statsRecordLoad(uint64_t busyNs, jack_nframes_t nframes, jack_nframes_t sampleRate);
+void statsCountXrun(void);
+uint32_t statsXruns(void);
+void statsLoad(float *last, float *max);
+size_t statsFormat(char *buf, size_t len);
+void statsReset(void);
 void printTimers(void);
 
 #endif // local.h
@@ -0,0 +1,229 @@
+/**************************************************************
+ * Copyright (C) 2017 by Chan Russell, Robert                 *
+ *                                                            *
+ * Project: Audio Looper                                      *
+ *                                                            *
+ * This file contains logging that is safe to call from the   *
+ * Jack process thread                                        *
+ *                                                            *
+ * Functionality:                                             *
+ * - Process thread queues fixed size binary log records      *
+ * - Low priority drain thread formats and prints them        *
+ * - Any other thread prints straight away                    *
+ * - Log level selectable at runtime                          *
+ *                                                            *
+ *************************************************************/
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdbool.h>
+#include <unistd.h>
+
+#include "local.h"
+
+/**************************************************************
+ * Macros and defines                                         *
+ *************************************************************/
+#define LOG_QUEUE_SLOTS     (256)   // power of two
+#define LOG_DRAIN_PERIOD_US (20 * 1000)
+#define LOG_ARGS            (3)
+
+#define GENERATE_LOG_LEVEL(ENUM, LEVEL, FORMAT) LEVEL,
+#define GENERATE_LOG_FORMAT(ENUM, LEVEL, FORMAT) FORMAT,
+
+/**************************************************************
+ * Data types                                                 *
+ *************************************************************/
+struct LogRecord
+{
+    int32_t args[LOG_ARGS];
+    uint16_t id;
+};
+
+static struct MasterLooper *looper;
+static const uint8_t LOG_LEVEL[] = {
+    FOREACH_LOG_MESSAGE(GENERATE_LOG_LEVEL)
+};
+static const char *LOG_FORMAT[] = {
+    FOREACH_LOG_MESSAGE(GENERATE_LOG_FORMAT)
+};
+static const char *LOG_LEVEL_STRING[] = { "ERROR", "WARN", "INFO", "DEBUG" };
+
+static _Atomic uint8_t logLevel = LOG_LEVEL_INFO;
+static _Atomic uint32_t logDropped;     // records lost to a full queue
+static pthread_t processThread;         // the only producer allowed into the queue
+static _Atomic bool processThreadSet;
+static pthread_t logTh;
+
+static struct LogRecord logRecords[LOG_QUEUE_SLOTS];
+static struct SpscQueue logQueue;
+
+/**************************************************************
+ * Static functions
+ *************************************************************/
+
+/*
+ * Function: logPrint
+ * Input: pointer to the record to print
+ * Output: none
+ * Description:
+ *   Format one record, unused arguments are ignored by the format
+ *
+ */
+static void logPrint(const struct LogRecord *rec)
+{
+    printf(LOG_FORMAT[rec->id], rec->args[0], rec->args[1], rec->args[2]);
+    printf("\n");
+}
+
+/*
+ * Function: logDrain
+ * Input: none
+ * Output: none
+ * Description:
+ *   Print everything queued so far and report any records that were dropped
+ *
+ */
+static void logDrain(void)
+{
+    struct LogRecord rec;
+    uint32_t dropped;
+
+    while (queuePop(&logQueue, &rec))
+    {
+        logPrint(&rec);
+    }
+    dropped = atomic_exchange_explicit(&logDropped, 0, memory_order_relaxed);
+    if (dropped)
+    {
+        printf("** log queue full, %d messages dropped\n", dropped);
+    }
+    fflush(stdout);
+}
+
+/*
+ * Function: logThread
+ * Input: none
+ * Output: none
+ * Description:
+ *   Low priority thread, wake up periodically and drain the log queue
+ *
+ */
+static void *logThread(void *arg)
+{
+    while (!looper->exitNow)
+    {
+        usleep(LOG_DRAIN_PERIOD_US);
+        logDrain();
+    }
+    logDrain();
+    pthread_exit(NULL);
+}
+
+/**************************************************************
+ * Public functions
+ *************************************************************/
+
+/*
+ * Function: logInit
+ * Input: pointer to the master looper context
+ * Output: pass/fail of init process
+ * Description:
+ *   Set up the log queue and start the drain thread at normal priority
+ *
+ */
+bool logInit(struct MasterLooper *mLooper)
+{
+    int rc;
+
+    looper = mLooper;
+    queueInit(&logQueue, logRecords, LOG_QUEUE_SLOTS, sizeof(struct LogRecord));
+    if ((rc = pthread_create(&logTh, NULL, logThread, NULL)))
+    {
+        printf("Error: pthread_create, rc: %d\n", rc);
+        return false;
+    }
+    return true;
+}
+
+/*
+ * Function: logJoin
+ * Input: none
+ * Output: none
+ * Description:
+ *   Wait for the drain thread to print the last records and exit, exitNow must be set
+ *
+ */
+void logJoin(void)
+{
+    pthread_join(logTh, NULL);
+}
+
+/*
+ * Function: logSetProcessThread
+ * Input: thread that runs the Jack process callback
+ * Output: none
+ * Description:
+ *   Only this thread queues records, until this is called every thread prints
+ *   directly. Called from the process thread itself before its first period
+ *
+ */
+void logSetProcessThread(pthread_t thread)
+{
+    processThread = thread;
+    atomic_store_explicit(&processThreadSet, true, memory_order_release);
+}
+
+/*
+ * Function: logSetLevel
+ * Input: most verbose level to keep, LOG_LEVEL_ERROR to LOG_LEVEL_DEBUG
+ * Output: true if the level is valid
+ * Description:
+ *   Change the log level, takes effect on the next message
+ *
+ */
+bool logSetLevel(uint8_t level)
+{
+    if (level > LOG_LEVEL_DEBUG)
+    {
+        return false;
+    }
+    atomic_store_explicit(&logLevel, level, memory_order_relaxed);
+    printf("Log level %s\n", LOG_LEVEL_STRING[level]);
+    return true;
+}
+
+/*
+ * Function: logEvent
+ * Input: message id
+ *        up to three integer arguments for the message format, pass 0 if unused
+ * Output: none
+ * Description:
+ *   On the process thread: queue a binary record, never blocks, drops if full
+ *   On any other thread: print it now
+ *   Messages above the current log level are discarded
+ *
+ */
+void logEvent(enum LogMessage id, int32_t a0, int32_t a1, int32_t a2)
+{
+    struct LogRecord rec = { { a0, a1, a2 }, id };
+
+    if (LOG_LEVEL[id] > atomic_load_explicit(&logLevel, memory_order_relaxed))
+    {
+        return;
+    }
+
+    if ((atomic_load_explicit(&processThreadSet, memory_order_acquire)) &&
+        (pthread_equal(pthread_self(), processThread)))
+    {
+        if (!queuePush(&logQueue, &rec))
+        {
+            atomic_fetch_add_explicit(&logDropped, 1, memory_order_relaxed);
+        }
+    }
+    else
+    {
+        logPrint(&rec);
+    }
+}
@@ -0,0 +1,329 @@
+/**************************************************************
+ * Copyright (C) 2017 by Chan Russell, Robert                 *
+ *                                                            *
+ * Project: Audio Looper                                      *
+ *                                                            *
+ * This file contains the MIDI user interface, a Jack MIDI    *
+ * input for control and a MIDI output for clock              *
+ *                                                            *
+ * Functionality: (note numbers are the first of the range)   *
+ * - Record: note 36 + track, on the active group             *
+ * - Overdub: note 52 + track                                 *
+ * - Mute: note 68 + track                                    *
+ * - Unmute: note 84 + track                                  *
+ * - Group: note 100 + group, set active group                *
+ * - Play: note 104, stop recording or overdubbing            *
+ * - Stop: note 105, reset and return to passthrough state    *
+ * - Undo and redo: notes 106 and 107, on the selected track  *
+ * - Volume and balance: CC 7 and CC 10, the MIDI channel is  *
+ *   the track, 0 to 127 scaled to the serial levels          *
+ * - Events are read in the process callback and land on the  *
+ *   frame of the period they were stamped with               *
+ * - Clock: 24 per beat, MIDI_CLOCK_BEATS_PER_LOOP beats to   *
+ *   the master loop, start on the top of a loop, stop when   *
+ *   the loop stops                                           *
+ *                                                            *
+ *************************************************************/
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdbool.h>
+
+#include <jack/jack.h>
+#include <jack/midiport.h>
+
+#include "local.h"
+
+/**************************************************************
+ * Macros and defines                                         *
+ *************************************************************/
+#define MIDI_STATUS_NOTE_ON         (0x90)
+#define MIDI_STATUS_CC              (0xB0)
+#define MIDI_STATUS_MASK            (0xF0)
+#define MIDI_CHANNEL_MASK           (0x0F)
+#define MIDI_DATA_MAX               (127)
+#define MIDI_CLOCK                  (0xF8)
+#define MIDI_START                  (0xFA)
+#define MIDI_STOP                   (0xFC)
+#define MIDI_TRACK_FROM_NUMBER      (0xFF)  // mapping's track is the note's offset in its range
+#define MIDI_TRACK_FROM_CHANNEL     (0xFE)  // mapping's track is the MIDI channel
+#define MIDI_TRACK_SELECTED         (0xFD)  // mapping's track is the selected track
+#define MIDI_CLOCK_TICKS            (MIDI_CLOCK_PPQN * MIDI_CLOCK_BEATS_PER_LOOP)
+
+/**************************************************************
+ * Data types                                                 *
+ *************************************************************/
+// A range of notes or controllers and the command they queue
+struct MidiMapping
+{
+    uint8_t status;                 // note on or CC, any channel
+    uint8_t first;                  // first note or controller number
+    uint8_t count;
+    uint8_t event;                  // enum SystemEvents
+    uint8_t track;                  // a track or one of the MIDI_TRACK_ values
+    bool level;                     // the CC value is the gain or pan level
+};
+
+static const struct MidiMapping midiMap[] = {
+    {MIDI_STATUS_NOTE_ON, 36,  NUM_TRACKS, SYSTEM_EVENT_RECORD_TRACK,     MIDI_TRACK_FROM_NUMBER,  false},
+    {MIDI_STATUS_NOTE_ON, 52,  NUM_TRACKS, SYSTEM_EVENT_OVERDUB_TRACK,    MIDI_TRACK_FROM_NUMBER,  false},
+    {MIDI_STATUS_NOTE_ON, 68,  NUM_TRACKS, SYSTEM_EVENT_MUTE_TRACK,       MIDI_TRACK_FROM_NUMBER,  false},
+    {MIDI_STATUS_NOTE_ON, 84,  NUM_TRACKS, SYSTEM_EVENT_UNMUTE_TRACK,     MIDI_TRACK_FROM_NUMBER,  false},
+    {MIDI_STATUS_NOTE_ON, 100, NUM_GROUPS, SYSTEM_EVENT_SET_ACTIVE_GROUP, 0,                       false},
+    {MIDI_STATUS_NOTE_ON, 104, 1,          SYSTEM_EVENT_PLAY_TRACK,       MIDI_TRACK_SELECTED,     false},
+    {MIDI_STATUS_NOTE_ON, 105, 1,          SYSTEM_EVENT_PASSTHROUGH,      0,                       false},
+    {MIDI_STATUS_NOTE_ON, 106, 1,          SYSTEM_EVENT_UNDO_TRACK,       MIDI_TRACK_SELECTED,     false},
+    {MIDI_STATUS_NOTE_ON, 107, 1,          SYSTEM_EVENT_REDO_TRACK,       MIDI_TRACK_SELECTED,     false},
+    {MIDI_STATUS_CC,      7,   1,          SYSTEM_EVENT_SET_GAIN,         MIDI_TRACK_FROM_CHANNEL, true},
+    {MIDI_STATUS_CC,      10,  1,          SYSTEM_EVENT_SET_PAN,          MIDI_TRACK_FROM_CHANNEL, true},
+};
+
+static struct MasterLooper *looper;
+
+// Clock state, only used by the process callback
+static bool clockRunning;           // start has been sent, stop has not
+
+/**************************************************************
+ * Static functions
+ *************************************************************/
+
+/*
+ * Function: mapEvent
+ * Input: pointer to the MIDI event
+ *        pointer to the command to fill
+ * Output: true if the event maps to a command
+ * Description:
+ *   Look the event up in midiMap, a note on with velocity 0 is a note off
+ *   and does nothing
+ *
+ */
+static bool mapEvent(const jack_midi_event_t *event, struct ControlCommand *cmd)
+{
+    const struct MidiMapping *map;
+    uint8_t status;
+    uint8_t channel;
+    uint8_t number;
+    uint8_t value;
+    uint32_t m;
+
+    if (event->size < 3)
+    {
+        return false;
+    }
+    status = event->buffer[0] & MIDI_STATUS_MASK;
+    channel = event->buffer[0] & MIDI_CHANNEL_MASK;
+    number = event->buffer[1];
+    value = event->buffer[2];
+    if ((status == MIDI_STATUS_NOTE_ON) && (value == 0))
+    {
+        return false;
+    }
+
+    for (m = 0; m < sizeof(midiMap) / sizeof(midiMap[0]); m++)
+    {
+        map = &midiMap[m];
+        if ((map->status != status) || (number < map->first) || (number >= map->first + map->count))
+        {
+            continue;
+        }
+        cmd->event = map->event;
+        cmd->group = looper->selectedGroup;
+        switch (map->track)
+        {
+            case MIDI_TRACK_FROM_NUMBER:
+                cmd->track = number - map->first;
+                break;
+            case MIDI_TRACK_FROM_CHANNEL:
+                cmd->track = channel;
+                break;
+            case MIDI_TRACK_SELECTED:
+                cmd->track = looper->selectedTrack;
+                break;
+            default:
+                cmd->track = map->track;
+                break;
+        }
+        if (map->event == SYSTEM_EVENT_SET_ACTIVE_GROUP)
+        {
+            cmd->group = number - map->first;
+        }
+        if (map->event == SYSTEM_EVENT_PASSTHROUGH)
+        {
+            cmd->group = 0;
+        }
+        if (cmd->track >= NUM_TRACKS)
+        {
+            return false;
+        }
+        // play in playback sets the track's repeat, leave it as it is
+        cmd->repeat = looper->tracks[cmd->track].repeat;
+        cmd->value = (map->level) ? ((value * 99) + (MIDI_DATA_MAX / 2)) / MIDI_DATA_MAX : 0;
+        return true;
+    }
+    return false;
+}
+
+/*
+ * Function: writeByte
+ * Input: MIDI output buffer
+ *        frame offset in the period
+ *        the message, one byte
+ * Output: none
+ *
+ */
+static void writeByte(void *buf, jack_nframes_t offset, jack_midi_data_t byte)
+{
+    jack_midi_event_write(buf, offset, &byte, 1);
+}
+
+/*
+ * Function: writeTicks
+ * Input: MIDI output buffer
+ *        frame offset the master is at idx
+ *        master index
+ *        number of frames in the period
+ *        master length
+ * Output: none
+ * Description:
+ *   Write a clock on every frame of the period a tick of the master loop
+ *   falls on, tick k is on master frame k * length / MIDI_CLOCK_TICKS so the
+ *   ticks of every loop add up to its exact length
+ *
+ */
+static void writeTicks(void *buf, jack_nframes_t offset, uint32_t idx,
+    jack_nframes_t nframes, uint32_t length)
+{
+    uint64_t tick;
+    uint32_t frame;
+
+    while (offset < nframes)
+    {
+        tick = (((uint64_t)idx * MIDI_CLOCK_TICKS) + length - 1) / length;
+        if (tick >= MIDI_CLOCK_TICKS)
+        {
+            // the next tick is the first of the next loop
+            offset += length - idx;
+            idx = 0;
+            continue;
+        }
+        frame = (tick * length) / MIDI_CLOCK_TICKS;
+        offset += frame - idx;
+        if (offset >= nframes)
+        {
+            break;
+        }
+        writeByte(buf, offset, MIDI_CLOCK);
+        idx = frame + 1;
+        offset++;
+    }
+}
+
+/**************************************************************
+ * Public functions
+ *************************************************************/
+
+/*
+ * Function: midiInit
+ * Input: pointer to the master looper context
+ * Output: pass/fail of the port registration
+ * Description:
+ *   Register the MIDI ports before the client is activated, they are left
+ *   for the user to connect
+ *
+ */
+bool midiInit(struct MasterLooper *mLooper)
+{
+    looper = mLooper;
+    looper->midi_in_port = jack_port_register(looper->client, "midi_in",
+        JACK_DEFAULT_MIDI_TYPE, JackPortIsInput, 0);
+    looper->midi_out_port = jack_port_register(looper->client, "midi_out",
+        JACK_DEFAULT_MIDI_TYPE, JackPortIsOutput, 0);
+    if ((looper->midi_in_port == NULL) || (looper->midi_out_port == NULL))
+    {
+        printf("Error registering MIDI ports\n");
+        return false;
+    }
+    return true;
+}
+
+/*
+ * Function: midiReadInput
+ * Input: number of frames in the period
+ * Output: none
+ * Description:
+ *   Process callback, before playRecord. Queue the command of every mapped
+ *   event, stamped the way playRecord places commands, so an event at frame
+ *   offset N of the period lands on input sample N
+ *
+ */
+void midiReadInput(jack_nframes_t nframes)
+{
+    void *buf = jack_port_get_buffer(looper->midi_in_port, nframes);
+    jack_nframes_t windowStart = jack_last_frame_time(looper->client) - looper->captureLatency;
+    jack_midi_event_t event;
+    struct ControlCommand cmd;
+    uint32_t count = jack_midi_get_event_count(buf);
+    uint32_t e;
+
+    for (e = 0; e < count; e++)
+    {
+        if ((jack_midi_event_get(&event, buf, e) == 0) && (mapEvent(&event, &cmd)))
+        {
+            cmd.frameTime = windowStart + event.time;
+            if (!controlQueueCommand(COMMAND_SOURCE_MIDI, &cmd))
+            {
+                logEvent(LOG_MSG_MIDI_QUEUE_FULL, event.buffer[0], event.buffer[1], 0);
+            }
+        }
+    }
+}
+
+/*
+ * Function: midiWriteClock
+ * Input: number of frames in the period
+ * Output: none
+ * Description:
+ *   Process callback, after playRecord. The master index at the end of the
+ *   period is worked back to each frame of it. The clock runs while the
+ *   master loop does, it is started on the first frame of a loop so the
+ *   receiver's bar lines up with the loop's
+ *
+ */
+void midiWriteClock(jack_nframes_t nframes)
+{
+    void *buf = jack_port_get_buffer(looper->midi_out_port, nframes);
+    uint32_t length = looper->masterLength[looper->selectedGroup];
+    uint32_t idx = looper->masterCurrIdx;
+    jack_nframes_t offset = 0;
+
+    jack_midi_clear_buffer(buf);
+    if ((MIDI_CLOCK_BEATS_PER_LOOP == 0) || (!masterWraps(looper)) || (length < MIDI_CLOCK_TICKS))
+    {
+        if (clockRunning)
+        {
+            writeByte(buf, 0, MIDI_STOP);
+            clockRunning = false;
+        }
+        return;
+    }
+
+    // idx is where the master is at the end of the period
+    if (!clockRunning)
+    {
+        if (idx >= nframes)
+        {
+            // no loop started in this period, wait for the next one
+            return;
+        }
+        offset = nframes - idx;
+        idx = 0;
+        writeByte(buf, offset, MIDI_START);
+        clockRunning = true;
+    }
+    else
+    {
+        idx = (idx >= nframes) ? idx - nframes : idx + length - nframes;
+    }
+    writeTicks(buf, offset, idx, nframes, length);
+}
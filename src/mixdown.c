@@ -8,7 +8,10 @@
  * Functionality:                                             *
  * - Overdub track with input buffer                          *
  * - Mixdown all tracks on the active group                   *
- *                                                            *
+ * - Per track gain and pan, ramped across each block so      *
+ *   level changes and mutes fade rather than step            *
+ * - Settled groups play from their cached group bus          *
+ * - Track peak meters for telemetry, from the mixed segments *
  *                                                            *
  *************************************************************/
 
@@ -26,153 +29,724 @@
 /**************************************************************
  * Macros and defines                                         *
  *************************************************************/
+#define OVERDUB_BLOCK_FRAMES    (256)   // float scratch for overdubbing packed tracks
 
 /**************************************************************
  * Data types                                                 *
  *************************************************************/
 
+// A block's mix split over the worker pool, part p mixes segments p, p + parts, ...
+struct MixJob
+{
+    const struct MixSegment *list;
+    uint16_t numSegments;
+    uint8_t parts;
+    jack_nframes_t nframes;
+    jack_default_audio_sample_t *mixLeft;   // part 0 mixes straight into the outputs
+    jack_default_audio_sample_t *mixRight;  // NULL without a right output
+};
+
 /**************************************************************
  * Static functions
  *************************************************************/
 
+/*
+ * Function: rampTowards
+ * Input: current level
+ *        target level
+ *        largest change allowed
+ * Output: the level to reach by the end of the block
+ *
+ */
+static float rampTowards(float level, float target, float maxStep)
+{
+    if (target > level + maxStep)
+    {
+        return level + maxStep;
+    }
+    if (target < level - maxStep)
+    {
+        return level - maxStep;
+    }
+    return target;
+}
+
+/*
+ * Function: addPiece
+ * Input: pointer to the span
+ *        pointer to the segment to fill
+ *        track index and output offset of the first frame
+ *        number of frames
+ *        seam fade gain of the first and the last frame
+ * Output: none
+ * Description:
+ *   The seam fade is linear across a piece, so is the gain. Away from the
+ *   seams it is the level ramp itself
+ *
+ */
+static void addPiece(
+    const struct TrackSpan *span,
+    struct MixSegment *seg,
+    uint32_t idx,
+    jack_nframes_t dst,
+    jack_nframes_t count,
+    float envFirst,
+    float envLast)
+{
+    float left = span->levelLeft + span->stepLeft * (dst + 1);
+    float right = span->levelRight + span->stepRight * (dst + 1);
+
+    seg->srcIdx = idx;
+    seg->dst = dst;
+    seg->count = count;
+    seg->gainLeft = left * envFirst;
+    seg->gainRight = right * envFirst;
+    seg->stepLeft = span->stepLeft;
+    seg->stepRight = span->stepRight;
+    if ((envFirst != 1.0f) || (envLast != 1.0f))
+    {
+        seg->stepLeft = (count > 1) ?
+            (((left + span->stepLeft * (count - 1)) * envLast) - seg->gainLeft) / (count - 1) : 0.0f;
+        seg->stepRight = (count > 1) ?
+            (((right + span->stepRight * (count - 1)) * envLast) - seg->gainRight) / (count - 1) : 0.0f;
+    }
+}
+
+/*
+ * Function: seamCrossfades
+ * Input: pointer to the span
+ *        where the pass before was cut
+ * Output: true if the pass before plays on under the start of this one
+ * Description:
+ *   Only a pass cut while it was being heard is, and only if the audio
+ *   after the cut was recorded, up to endIdx plus the tail
+ *
+ */
+static bool seamCrossfades(const struct TrackSpan *span, uint32_t cut)
+{
+    return (cut > span->startIdx) && (cut <= span->endIdx) &&
+           (span->endIdx - span->startIdx >= LOOP_SEAM_FADE_FRAMES) &&
+           (cut + LOOP_SEAM_FADE_FRAMES <= span->endIdx + span->tailFrames);
+}
+
+/*
+ * Function: buildActiveList
+ * Input: pointer to the master looper context
+ *        number of frames in this block
+ *        pointer to the segment list to fill, NUM_TRACKS * MIX_TRACK_SEGMENTS entries
+ * Output: number of audible segments
+ * Description:
+ *   Work out once per block which tracks of the selected group are audible
+ *   and over which frames, so the mix loop does no per-sample state checks
+ *   A track stops contributing once its currIdx reaches endIdx, a repeating
+ *   one goes round from startIdx on the frame it gets there
+ *   The segments carry a gain ramp from the track's last level towards its
+ *   target, a muted track stays in the list until it has faded out
+ *   In playback and overdub the master wraps on the frame after this block at the most,
+ *   playRecord splits the period there
+ *
+ */
+static uint16_t buildActiveList(
+    struct MasterLooper *looper,
+    jack_nframes_t nframes,
+    struct MixSegment *list)
+{
+    uint8_t sg = looper->selectedGroup;
+    uint32_t active = looper->activeTracks[sg];
+    uint32_t masterLength = looper->masterLength[sg];
+    uint8_t idx = 0;
+    uint16_t numSegments = 0;
+    uint8_t count;
+    uint8_t seg;
+    struct Track *track;
+    struct TrackSpan span;
+    float maxStep = ((float)nframes * 1000.0f) / (TRACK_FADE_MS * looper->sampleRate);
+    float targetLeft;
+    float targetRight;
+    float nextLeft;
+    float nextRight;
+
+    span.count = nframes;
+    span.masterLeft = ((masterWraps(looper)) && (masterLength > looper->masterCurrIdx)) ?
+        masterLength - looper->masterCurrIdx : 0;
+
+    // some groups may contain same tracks (ie same drum track for group 1 and 2
+    // only members with recorded audio are in the active mask, check states as
+    // some tracks may be muted
+    while (active)
+    {
+        idx = nextTrack(&active);
+        track = &looper->tracks[idx];
+        trackTargetLevels(track, &targetLeft, &targetRight);
+        count = 0;
+        if ((track->state != TRACK_STATE_OFF) &&
+           ((targetLeft != 0.0f) || (targetRight != 0.0f) ||
+            (track->levelLeft != 0.0f) || (track->levelRight != 0.0f)))
+        {
+            nextLeft = rampTowards(track->levelLeft, targetLeft, maxStep);
+            nextRight = rampTowards(track->levelRight, targetRight, maxStep);
+            span.startIdx = track->startIdx;
+            span.endIdx = track->endIdx;
+            span.idx = track->currIdx;
+            span.cutIdx = track->cutIdx;
+            span.tailFrames = track->tailFrames;
+            span.repeat = track->repeat;
+            span.levelLeft = track->levelLeft;
+            span.levelRight = track->levelRight;
+            span.stepLeft = (nextLeft - track->levelLeft) / nframes;
+            span.stepRight = (nextRight - track->levelRight) / nframes;
+            count = trackSegments(&span, &list[numSegments]);
+        }
+        if (count == 0)
+        {
+            // nothing audible to fade, the track starts at its new levels
+            track->levelLeft = targetLeft;
+            track->levelRight = targetRight;
+            continue;
+        }
+        track->levelLeft = nextLeft;
+        track->levelRight = nextRight;
+
+        for (seg = 0; seg < count; seg++)
+        {
+            list[numSegments + seg].track = track;
+        }
+        numSegments += count;
+    }
+    return numSegments;
+}
+
+/*
+ * Function: mixChannel
+ * Input: pointer to the mixdown buffer
+ *        pointer to the channel's chunk table
+ *        first track index to mix
+ *        number of frames to mix
+ *        gain of the first frame and the change per frame
+ * Output: none
+ * Description:
+ *   Mix a track range into the mixdown, one contiguous run per chunk
+ *
+ */
+static void mixChannel(
+    jack_default_audio_sample_t *mix,
+    track_sample_t **chunks,
+    uint32_t idx,
+    jack_nframes_t count,
+    float gain,
+    float step)
+{
+    jack_nframes_t run;
+    while (count > 0)
+    {
+        run = chunkRun(idx, count);
+        dspTrackMix(mix, chunkSample(chunks, idx), run, gain, step);
+        gain += step * run;
+        mix += run;
+        idx += run;
+        count -= run;
+    }
+}
+
+/*
+ * Function: mixMono
+ * Input: pointers to the left and right mixdown buffers
+ *        pointer to the mono track's chunk table
+ *        segment to mix, gives the range and the gain ramps
+ * Output: none
+ * Description:
+ *   Mix a mono track range into both sides of the mixdown, read once
+ *
+ */
+static void mixMono(
+    jack_default_audio_sample_t *mixL,
+    jack_default_audio_sample_t *mixR,
+    const struct MixSegment *seg)
+{
+    track_sample_t **chunks = seg->track->chunksLeft;
+    uint32_t idx = seg->srcIdx;
+    jack_nframes_t count = seg->count;
+    float gainL = seg->gainLeft;
+    float gainR = seg->gainRight;
+    jack_nframes_t run;
+    while (count > 0)
+    {
+        run = chunkRun(idx, count);
+        dspTrackMixMono(mixL, mixR, chunkSample(chunks, idx), run,
+            gainL, seg->stepLeft, gainR, seg->stepRight);
+        gainL += seg->stepLeft * run;
+        gainR += seg->stepRight * run;
+        mixL += run;
+        mixR += run;
+        idx += run;
+        count -= run;
+    }
+}
+
+/*
+ * Function: mixSegment
+ * Input: pointers to the left and right buses, right NULL for the left side only
+ *        segment to mix
+ * Output: none
+ *
+ */
+static void mixSegment(
+    jack_default_audio_sample_t *busL,
+    jack_default_audio_sample_t *busR,
+    const struct MixSegment *seg)
+{
+    if (busR == NULL)
+    {
+        mixChannel(busL + seg->dst, seg->track->chunksLeft, seg->srcIdx, seg->count, seg->gainLeft, seg->stepLeft);
+    }
+    else if (seg->track->channels == 2)
+    {
+        mixChannel(busL + seg->dst, seg->track->chunksLeft, seg->srcIdx, seg->count, seg->gainLeft, seg->stepLeft);
+        mixChannel(busR + seg->dst, seg->track->chunksRight, seg->srcIdx, seg->count, seg->gainRight, seg->stepRight);
+    }
+    else
+    {
+        mixMono(busL + seg->dst, busR + seg->dst, seg);
+    }
+}
+
+/*
+ * Function: mixPart
+ * Input: job part
+ *        pointer to the MixJob
+ * Output: none
+ * Description:
+ *   Runs on the process thread for part 0 and on a mix worker for the rest
+ *   Workers clear and fill their own partial bus, only track memory is read
+ *
+ */
+static void mixPart(uint8_t part, void *arg)
+{
+    const struct MixJob *job = arg;
+    jack_default_audio_sample_t *busL = job->mixLeft;
+    jack_default_audio_sample_t *busR = job->mixRight;
+    uint16_t idx;
+
+    if (part > 0)
+    {
+        busL = workersBus(part, 0);
+        memset(busL, 0, job->nframes * sizeof(jack_default_audio_sample_t));
+        if (busR)
+        {
+            busR = workersBus(part, 1);
+            memset(busR, 0, job->nframes * sizeof(jack_default_audio_sample_t));
+        }
+    }
+    for (idx = part; idx < job->numSegments; idx += job->parts)
+    {
+        mixSegment(busL, busR, &job->list[idx]);
+    }
+}
+
+/*
+ * Function: segmentPeak
+ * Input: pointer to the channel's chunk table
+ *        first track index
+ *        number of frames
+ * Output: largest absolute value of every METER_STRIDE'th frame, 1 is full scale
+ *
+ */
+static float segmentPeak(track_sample_t * const *chunks, uint32_t idx, jack_nframes_t count)
+{
+    uint32_t end = idx + count;
+    float peak = 0.0f;
+    float a;
+
+    for (; idx < end; idx += METER_STRIDE)
+    {
+        a = *chunkSample(chunks, idx);
+        a = (a < 0.0f) ? -a : a;
+        peak = (a > peak) ? a : peak;
+    }
+#if TRACK_FORMAT != TRACK_FORMAT_FLOAT
+    peak /= TRACK_SAMPLE_SCALE;
+#endif
+    return peak;
+}
+
+/*
+ * Function: meterHold
+ * Input: pointer to a track meter
+ *        peak heard, 1 is full scale
+ * Output: none
+ * Description:
+ *   Raise the meter to the peak, the telemetry thread takes it and sets it
+ *   back to 0. A reset lost between the load and the store only holds a peak
+ *   one packet longer
+ *
+ */
+static void meterHold(_Atomic uint32_t *meter, float peak)
+{
+    uint32_t value = (peak < (float)UINT16_MAX / METER_FULL_SCALE) ?
+        (uint32_t)(peak * METER_FULL_SCALE) : UINT16_MAX;
+
+    if (value > atomic_load_explicit(meter, memory_order_relaxed))
+    {
+        atomic_store_explicit(meter, value, memory_order_relaxed);
+    }
+}
+
+/*
+ * Function: meterTracks
+ * Input: pointer to the segment list of the block
+ *        number of segments
+ * Output: none
+ * Description:
+ *   Process thread, after the mix. Each track's meters take the peak of what
+ *   it contributed, its samples at the higher end of the segment's gain ramp
+ *   The segments were just read by the mix so they are still in cache
+ *
+ */
+static void meterTracks(const struct MixSegment *list, uint16_t numSegments)
+{
+    const struct MixSegment *seg;
+    float peakLeft;
+    float peakRight;
+    float gainLeft;
+    float gainRight;
+    uint16_t idx;
+
+    for (idx = 0; idx < numSegments; idx++)
+    {
+        seg = &list[idx];
+        gainLeft = seg->gainLeft + seg->stepLeft * (seg->count - 1);
+        gainLeft = (gainLeft > seg->gainLeft) ? gainLeft : seg->gainLeft;
+        gainRight = seg->gainRight + seg->stepRight * (seg->count - 1);
+        gainRight = (gainRight > seg->gainRight) ? gainRight : seg->gainRight;
+        peakLeft = segmentPeak(seg->track->chunksLeft, seg->srcIdx, seg->count);
+        peakRight = (seg->track->channels == 2) ?
+            segmentPeak(seg->track->chunksRight, seg->srcIdx, seg->count) : peakLeft;
+        meterHold(&seg->track->meterLeft, peakLeft * gainLeft);
+        meterHold(&seg->track->meterRight, peakRight * gainRight);
+    }
+}
+
 /**************************************************************
  * Public functions
  *************************************************************/
 
+/*
+ * Function: seamEnvelope
+ * Input: frames since the pass began after a seam, 0 on its first frame
+ * Output: gain of the pass coming in, 1 once the crossfade is over, the
+ *         pass going out has the rest
+ *
+ */
+float seamEnvelope(uint32_t since)
+{
+    if (since + 1 < LOOP_SEAM_FADE_FRAMES)
+    {
+        return (float)(since + 1) / LOOP_SEAM_FADE_FRAMES;
+    }
+    return 1.0f;
+}
+
+/*
+ * Function: trackSegments
+ * Input: pointer to the span, where the track is and its levels
+ *        pointer to the segments to fill, MIX_TRACK_SEGMENTS entries
+ * Output: number of segments, 0 if nothing of the track is heard
+ * Description:
+ *   Split a stretch of a track into the contiguous runs to mix. A repeating
+ *   track wraps from endIdx to startIdx on the exact frame, any other track
+ *   is silent outside startIdx to endIdx, and the master seam starts every
+ *   track over. Where a pass that was being heard is cut like this, the
+ *   audio recorded after the cut fades out over the first
+ *   LOOP_SEAM_FADE_FRAMES of the new pass as the new pass fades in, so the
+ *   two always add up to full level. A take's first pass, and every frame
+ *   away from a seam, plays exactly as recorded
+ *   A repeat too short to fit MIX_TRACK_SEGMENTS runs is cut off early
+ *   Shared by the mix, the group bus and the bounce so they agree exactly
+ *
+ */
+uint8_t trackSegments(const struct TrackSpan *span, struct MixSegment *segs)
+{
+    uint32_t idx = span->idx;
+    uint32_t cut = span->cutIdx;
+    uint32_t passStart = (span->repeat) ? span->startIdx : 0;
+    jack_nframes_t dst = 0;
+    jack_nframes_t run;
+    jack_nframes_t fade;
+    uint32_t since;
+    uint32_t until;
+    uint8_t count = 0;
+
+    if (span->endIdx <= span->startIdx)
+    {
+        return 0;
+    }
+    while ((dst < span->count) && (count + 3 <= MIX_TRACK_SEGMENTS))
+    {
+        if (idx >= span->endIdx)
+        {
+            if (!span->repeat)
+            {
+                break;
+            }
+            if (dst > 0)
+            {
+                // played up to its end in this span
+                cut = span->endIdx;
+            }
+            idx = trackWrap(span->startIdx, span->endIdx, idx);
+        }
+
+        if (idx < span->startIdx)
+        {
+            // not started yet
+            run = span->startIdx - idx;
+        }
+        else
+        {
+            // up to the end of the track or the master seam
+            until = span->endIdx - idx;
+            if ((span->masterLeft > 0) && (span->masterLeft - dst < until))
+            {
+                until = span->masterLeft - dst;
+            }
+            if (until == 0)
+            {
+                // master seam reached, the span should have stopped before it
+                break;
+            }
+            run = until;
+        }
+        run = (run < span->count - dst) ? run : span->count - dst;
+
+        // the pass before fades out under the start of this one
+        since = (idx >= passStart) ? idx - passStart : LOOP_SEAM_FADE_FRAMES;
+        fade = 0;
+        if ((since < LOOP_SEAM_FADE_FRAMES) && (seamCrossfades(span, cut)))
+        {
+            fade = LOOP_SEAM_FADE_FRAMES - since;
+            fade = (fade < run) ? fade : run;
+            addPiece(span, &segs[count++], cut + since, dst, fade,
+                1.0f - seamEnvelope(since), 1.0f - seamEnvelope(since + fade - 1));
+        }
+        if (idx >= span->startIdx)
+        {
+            if (fade > 0)
+            {
+                addPiece(span, &segs[count++], idx, dst, fade,
+                    seamEnvelope(since), seamEnvelope(since + fade - 1));
+            }
+            if (run > fade)
+            {
+                addPiece(span, &segs[count++], idx + fade, dst + fade, run - fade, 1.0f, 1.0f);
+            }
+        }
+        idx += run;
+        dst += run;
+    }
+    return count;
+}
+
 /*
  * Function: overdub
  * Input: pointer to the Jack supplied input data buffer
- *        pointer to the track buffer to overdub
+ *        pointer to the channel's chunk table to overdub
+ *        first track index to overdub
  *        number of frames to overdub
  * Output: none
  * Description:
- *   Overdub the supplied buffer and track, limiting if necessary
+ *   Add the supplied buffer to the track, no limiting, the master bus soft
+ *   clip takes care of the output. int16 tracks saturate when stored
  *   This function is applied to one channel, left or right, only
  *
  */
 void overdub(
     jack_default_audio_sample_t *in, 
-    jack_default_audio_sample_t *track,
+    track_sample_t **chunks,
+    uint32_t idx,
     jack_nframes_t nframes)
 {
-    jack_default_audio_sample_t *p = in;
-    jack_default_audio_sample_t sum = 0;
-    uint8_t sample;
+    track_sample_t *track;
+    jack_nframes_t run;
+#if TRACK_FORMAT != TRACK_FORMAT_FLOAT
+    jack_default_audio_sample_t block[OVERDUB_BLOCK_FRAMES];
+#endif
+    while (nframes > 0)
+    {
+        run = chunkRun(idx, nframes);
+        track = chunkSample(chunks, idx);
+#if TRACK_FORMAT == TRACK_FORMAT_FLOAT
+        dspAccumulate(track, in, run);
+#else
+        // sum in float, then store back in the track format
+        run = (run < OVERDUB_BLOCK_FRAMES) ? run : OVERDUB_BLOCK_FRAMES;
+        memcpy(block, in, run * sizeof(jack_default_audio_sample_t));
+        dspTrackAccumulate(block, track, run);
+        dspTrackStore(track, block, run);
+#endif
+        in += run;
+        idx += run;
+        nframes -= run;
+    }
+}
 
-    for (sample = 0; sample < nframes; sample++)
+/*
+ * Function: startChannel
+ * Input: pointer to the output buffer
+ *        pointer to the input to monitor on it, NULL for none
+ *        number of frames
+ * Output: none
+ * Description:
+ *   The mix starts from the monitored input, tracks are added on top
+ *
+ */
+static void startChannel(
+    jack_default_audio_sample_t *out,
+    const jack_default_audio_sample_t *in,
+    jack_nframes_t nframes)
+{
+    if (in)
     {
-        sum = *p + track[sample];
-        if (sum > 0.9 * MAX_SAMPLE_VALUE)
-        {
-            sum *= 0.9;
-        }
-        track[sample] = sum;
-        p++;
+        memcpy(out, in, nframes * sizeof(jack_default_audio_sample_t));
+    }
+    else
+    {
+        memset(out, 0, nframes * sizeof(jack_default_audio_sample_t));
     }
 }
 
+/*
+ * Function: monitorPair
+ * Input: pointer to one of the other pairs' output buffer
+ *        pointer to that pair's input buffer, NULL for none
+ *        pointer to the mix of the tracks
+ *        number of frames
+ * Output: none
+ * Description:
+ *   A performer on another pair hears the shared mix and their own input
+ *
+ */
+static void monitorPair(
+    jack_default_audio_sample_t *out,
+    jack_default_audio_sample_t *in,
+    const jack_default_audio_sample_t *mix,
+    jack_nframes_t nframes)
+{
+    startChannel(out, in, nframes);
+    dspAccumulate(out, mix, nframes);
+    dspSoftClip(out, nframes);
+}
+
 /*
  * Function: doMixDown
- * Input: pointer to the Jack supplied input data buffer for left channel
- *        pointer to the Jack supplied input data buffer for the right channel
- *        pointer to the mixdown output data buffer for the left channel
- *        pointer to the mixdown output data buffer for the right channel
- *        number of frames to overdub
+ * Input: pointer to the master looper context
+ *        pointer to the Jack buffers of every port pair, right sides NULL if mono
+ *        number of frames to mix
  * Output: none
  * Description:
- *   Mixdown the tracks associated with the active group, limiting if necessary
+ *   Mixdown the tracks associated with the active group
  *   Do not blindly mixdown based upon activeTracks because this destroys grouping ability
  *   Focus on track state of Play or Mute
  *   - GroupNumber updates via control handling will update the individual track's P or M status
+ *   The outputs start as the monitored input, a mono input is heard on both
+ *   sides, and the tracks are summed straight into them. The audible tracks
+ *   are found once per block, each one is summed as a contiguous range and
+ *   the master soft clip is applied in a single pass at the end
+ *   From MIX_PARALLEL_MIN_TRACKS audible tracks the segments are shared out
+ *   over the mix workers and their partial buses summed here afterwards
+ *   A settled group in playback is read from its cached group bus instead
+ *   Without a right output only the left side of the mix is worked out
+ *   With more than one port pair the tracks are mixed once, into the first
+ *   pair's outputs from silence, each pair then gets that mix and its own input
+ *   While telemetry has a client the track meters are kept, a group playing
+ *   from its bus has settled levels so its segments are worked out for them
  *
  */
 void doMixDown(
     struct MasterLooper *looper,
-    jack_default_audio_sample_t *inBufferLeft,
-    jack_default_audio_sample_t *inBufferRight,
-    jack_default_audio_sample_t *mixdownBufferLeft,
-    jack_default_audio_sample_t *mixdownBufferRight,
+    const struct PortBuffers *io,
     jack_nframes_t nframes)
 {
-    uint32_t trackIdx;
-    jack_default_audio_sample_t sumLeft = 0;
-    jack_default_audio_sample_t sumRight = 0;
-    uint8_t sg = looper->selectedGroup;
-    uint8_t idx = 0;
-    uint8_t sample;
-    struct Track * track;
-    static bool bNoData = true;
-   for (sample = 0; sample < nframes; sample++)
-    {
-        sumLeft = 0;
-        sumRight = 0;
-        idx = 0;
-
-        // loop through all potential tracks in selected group for given sample
-        // some groups may contain same tracks (ie same drum track for group 1 and 2
-        // check track states as some tracks may be muted or off/empty/erased
-        // tracks can move groups - NULL will be assigned for the former group if track moves
-        while (idx < NUM_TRACKS)
-        {
-            track = looper->groupedTracks[sg][idx];
-            if ( (track != NULL) &&
-                 (track->currIdx >= track->startIdx) &&
-                 //(track->currIdx < track->endIdx) &&
-                 (track->state != TRACK_STATE_OFF) &&
-                 (track->state != TRACK_STATE_MUTE))
-            {
-
-                trackIdx = track->currIdx + sample;
-                if (trackIdx <= track->endIdx)
-                {
-
-if (track->channelLeft[trackIdx] == MAX_SAMPLE_VALUE)
-{
-    if (track->pulseIdx < 7)
-      track->pulseIdxArr[track->pulseIdx++] = trackIdx;
-}
-if ((bNoData) && (track->channelLeft[trackIdx] != 0.0))
-{
-    printf("T%d idx %d, CC %d\n", idx, trackIdx, looper->callCounter);
-    bNoData = false;
-}
+    jack_default_audio_sample_t *inBufferLeft = io->inL[0];
+    jack_default_audio_sample_t *inBufferRight = io->inR[0];
+    jack_default_audio_sample_t *outLeft = io->outL[0];
+    jack_default_audio_sample_t *outRight = io->outR[0];
+    bool shared = (looper->numPortPairs > 1);
+    struct MixSegment list[NUM_TRACKS * MIX_TRACK_SEGMENTS];
+    struct MixJob job = {
+        .list = list,
+        .parts = 1,
+        .nframes = nframes,
+        .mixLeft = outLeft,
+        .mixRight = outRight
+    };
+    uint8_t part;
+    uint8_t pair;
 
-                    sumLeft += track->channelLeft[trackIdx];
-                    if (sumLeft > 0.9 * MAX_SAMPLE_VALUE)
-                    {
-                        sumLeft *= 0.9;
-                    }
+    // with other pairs to feed the first one stays a plain track mix until they have it
+    startChannel(outLeft, (shared) ? NULL : inBufferLeft, nframes);
+    if (outRight)
+    {
+        startChannel(outRight, (shared) ? NULL : (inBufferRight) ? inBufferRight : inBufferLeft, nframes);
+    }
 
-                    sumRight += track->channelRight[trackIdx];
-                    if (sumRight > 0.9 * MAX_SAMPLE_VALUE)
-                    {
-                        sumRight *= 0.9;
-                    }
-                }
-            }
-            idx++;
+    // a settled group plays from its bus, otherwise mix its tracks
+    job.numSegments = 0;
+    if (groupBusMix(looper, outLeft, outRight, nframes))
+    {
+        if (looper->meteringOn)
+        {
+            job.numSegments = buildActiveList(looper, nframes, list);
         }
-        if (inBufferLeft)
+    }
+    else
+    {
+        job.numSegments = buildActiveList(looper, nframes, list);
+        if ((job.numSegments < MIX_PARALLEL_MIN_TRACKS) || (workersCount() == 0))
         {
-            sumLeft += inBufferLeft[sample];
-            if (sumLeft > 0.9 * MAX_SAMPLE_VALUE)
+            mixPart(0, &job);
+        }
+        else
+        {
+            job.parts = workersCount() + 1;
+            workersRun(mixPart, &job, job.parts);
+            for (part = 1; part < job.parts; part++)
             {
-                sumLeft *= 0.9;
+                dspAccumulate(outLeft, workersBus(part, 0), nframes);
+                if (outRight)
+                {
+                    dspAccumulate(outRight, workersBus(part, 1), nframes);
+                }
             }
         }
+    }
+
+    if (looper->meteringOn)
+    {
+        meterTracks(list, job.numSegments);
+    }
 
-        if (inBufferRight)
+    if (shared)
+    {
+        for (pair = 1; pair < looper->numPortPairs; pair++)
         {
-            sumRight += inBufferRight[sample];
-            if (sumRight > 0.9 * MAX_SAMPLE_VALUE)
+            monitorPair(io->outL[pair], io->inL[pair], outLeft, nframes);
+            if (io->outR[pair])
             {
-                sumRight *= 0.9;
+                monitorPair(io->outR[pair], (io->inR[pair]) ? io->inR[pair] : io->inL[pair],
+                    (outRight) ? outRight : outLeft, nframes);
             }
         }
+        dspAccumulate(outLeft, inBufferLeft, nframes);
+        if (outRight)
+        {
+            dspAccumulate(outRight, (inBufferRight) ? inBufferRight : inBufferLeft, nframes);
+        }
+    }
 
-        mixdownBufferLeft[sample] = sumLeft;
-        mixdownBufferRight[sample] = sumRight;
+    // one master stage after the plain sum, the result no longer depends on track order
+    dspSoftClip(outLeft, nframes);
+    if (outRight)
+    {
+        dspSoftClip(outRight, nframes);
     }
 }
-
-
@@ -0,0 +1,422 @@
+/**************************************************************
+ * Copyright (C) 2017 by Chan Russell, Robert                 *
+ *                                                            *
+ * Project: Audio Looper                                      *
+ *                                                            *
+ * This file contains the network user interface, UDP        *
+ * control and a telemetry stream for meters on a tablet      *
+ *                                                            *
+ * Functionality:                                             *
+ * - Bound to NET_BIND_ADDRESS, loopback unless the build     *
+ *   opens it up, there is no authentication                  *
+ * - Control: a datagram to NET_UDP_PORT holds one or more    *
+ *   serial commands back to back, see serial.c, they are     *
+ *   queued with the frame the datagram arrived on, except    *
+ *   quit, which is only taken from the serial port           *
+ * - Each datagram is answered with one 'p' accepted or 'f'   *
+ *   rejected per command, and the report of an 'i' command  *
+ * - Telemetry: every address that sent a subscribe command   *
+ *   in the last NET_CLIENT_TIMEOUT_S gets NET_TELEMETRY_HZ   *
+ *   packets a second, any other datagram subscribes nothing  *
+ * - A packet holds the looper and track states, indices,     *
+ *   the track peak meters since the last packet, DSP load    *
+ *   and xruns, in the Pi's own byte order, little endian     *
+ * - Runs on its own thread, nothing here waits on the        *
+ *   process callback                                         *
+ *                                                            *
+ *************************************************************/
+
+#include <stdio.h>
+#include <errno.h>
+#include <unistd.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdbool.h>
+#include <poll.h>
+#include <time.h>
+#include <sys/socket.h>
+#include <netinet/in.h>
+#include <arpa/inet.h>
+
+#include <jack/jack.h>
+
+#include "local.h"
+
+/**************************************************************
+ * Macros and defines                                         *
+ *************************************************************/
+#define NET_DATAGRAM_LENGTH     (MIN_SERIAL_DATA_LENGTH * SERIAL_FRAME_MAX_COMMANDS)
+#define NET_REPLY_LENGTH        (STATS_TEXT_LENGTH + SERIAL_FRAME_MAX_COMMANDS)
+#define NET_TELEMETRY_MAGIC     (0x504F4F4C)    // "LOOP"
+#define NET_TELEMETRY_VERSION   (1)
+#define NET_IDLE_POLL_MS        (1000)          // check for exit this often without telemetry
+#define NET_CMD_END             (13)            // last char of a subscribe command
+
+/**************************************************************
+ * Data types                                                 *
+ *************************************************************/
+// One track in a telemetry packet
+struct TelemetryTrack
+{
+    uint32_t currIdx;
+    uint32_t endIdx;
+    uint16_t peakLeft;              // since the last packet, METER_FULL_SCALE is full scale
+    uint16_t peakRight;
+    uint8_t state;                  // enum TrackState
+    uint8_t groups;                 // bit per group the track is in
+    uint8_t channels;
+    uint8_t inputPair;
+};
+
+// A telemetry packet, every field is naturally aligned so there is no padding
+struct TelemetryPacket
+{
+    uint32_t magic;
+    uint16_t version;
+    uint16_t numTracks;
+    uint32_t sequence;              // goes up by one a packet, a gap is a lost packet
+    uint32_t sampleRate;
+    uint32_t masterLength;          // of the selected group
+    uint32_t masterCurrIdx;
+    uint32_t xruns;
+    uint16_t dspLoad;               // last period, tenths of a percent of the period budget
+    uint16_t dspLoadMax;
+    uint8_t state;                  // enum SystemStates
+    uint8_t selectedGroup;
+    uint8_t selectedTrack;
+    uint8_t numPortPairs;
+    struct TelemetryTrack tracks[NUM_TRACKS];
+};
+
+struct NetClient
+{
+    struct sockaddr_in addr;
+    uint64_t lastHeardMs;
+    bool used;
+};
+
+static struct MasterLooper *looper;
+static int sock = -1;
+
+static void netReply(const char *text, size_t length);
+
+// Only used by the network thread
+static struct CommandParser netParser = {
+    .source = COMMAND_SOURCE_NETWORK,
+    .reply = netReply
+};
+static struct NetClient clients[NET_MAX_CLIENTS];
+static char reply[NET_REPLY_LENGTH];
+static size_t replyLength;
+static uint32_t sequence;
+
+/**************************************************************
+ * Static functions
+ *************************************************************/
+
+/*
+ * Function: nowMs
+ * Input: none
+ * Output: monotonic time in milliseconds
+ *
+ */
+static uint64_t nowMs(void)
+{
+    struct timespec now;
+    clock_gettime(CLOCK_MONOTONIC, &now);
+    return ((uint64_t)now.tv_sec * 1000) + (now.tv_nsec / 1000000);
+}
+
+/*
+ * Function: netReply
+ * Input: the answer to send
+ *        number of characters
+ * Output: none
+ * Description:
+ *   Collect the answers to a datagram, they go back in one datagram once
+ *   all of its commands are processed. What does not fit is dropped
+ *
+ */
+static void netReply(const char *text, size_t length)
+{
+    if (length > sizeof(reply) - replyLength)
+    {
+        length = sizeof(reply) - replyLength;
+    }
+    memcpy(&reply[replyLength], text, length);
+    replyLength += length;
+}
+
+/*
+ * Function: clientHeard
+ * Input: address a subscribe command came from
+ *        time it arrived
+ * Output: none
+ * Description:
+ *   Keep the address subscribed to telemetry. A new address takes a free
+ *   slot, or the one heard from longest ago if they are all taken
+ *
+ */
+static void clientHeard(const struct sockaddr_in *addr, uint64_t now)
+{
+    struct NetClient *slot = &clients[0];
+    uint8_t c;
+
+    for (c = 0; c < NET_MAX_CLIENTS; c++)
+    {
+        if ((clients[c].used) &&
+            (clients[c].addr.sin_addr.s_addr == addr->sin_addr.s_addr) &&
+            (clients[c].addr.sin_port == addr->sin_port))
+        {
+            slot = &clients[c];
+            break;
+        }
+        if ((slot->used) && ((!clients[c].used) || (clients[c].lastHeardMs < slot->lastHeardMs)))
+        {
+            slot = &clients[c];
+        }
+    }
+    if ((!slot->used) ||
+        (slot->addr.sin_addr.s_addr != addr->sin_addr.s_addr) || (slot->addr.sin_port != addr->sin_port))
+    {
+        printf("Network client %s:%d\n", inet_ntoa(addr->sin_addr), ntohs(addr->sin_port));
+    }
+    slot->addr = *addr;
+    slot->lastHeardMs = now;
+    slot->used = true;
+}
+
+/*
+ * Function: receiveDatagram
+ * Input: none
+ * Output: none
+ * Description:
+ *   Process every whole command in a datagram, like a serial frame each one
+ *   is stamped with the frame the datagram arrived on, then answer it
+ *   Subscribing is handled here, quit is refused
+ *
+ */
+static void receiveDatagram(void)
+{
+    char buf[NET_DATAGRAM_LENGTH];
+    struct sockaddr_in from;
+    socklen_t fromLength = sizeof(from);
+    uint32_t cmdLength = looper->min_serial_data_length;
+    jack_nframes_t frameTime;
+    ssize_t length;
+    uint32_t i;
+    bool subscribe;
+    char c;
+
+    length = recvfrom(sock, buf, sizeof(buf), 0, (struct sockaddr *)&from, &fromLength);
+    if (length < 0)
+    {
+        return;
+    }
+    frameTime = controlFrameTime();
+
+    replyLength = 0;
+    for (i = 0; i + cmdLength <= (uint32_t)length; i += cmdLength)
+    {
+        c = buf[i];
+        if ((c == SERIAL_CMD_QUIT_LC) || (c == SERIAL_CMD_QUIT_UC))
+        {
+            netReply("f", 1);
+        }
+        else if ((c == NET_CMD_SUBSCRIBE_LC) || (c == NET_CMD_SUBSCRIBE_UC))
+        {
+            subscribe = (buf[i + cmdLength - 1] == NET_CMD_END);
+            if (subscribe)
+            {
+                clientHeard(&from, nowMs());
+            }
+            netReply((subscribe) ? "p" : "f", 1);
+        }
+        else
+        {
+            serialDispatchCommand(&netParser, &buf[i], frameTime);
+        }
+    }
+    if ((replyLength > 0) &&
+        (sendto(sock, reply, replyLength, 0, (struct sockaddr *)&from, fromLength) < 0))
+    {
+        printf("Network reply failed, %s\n", strerror(errno));
+    }
+}
+
+/*
+ * Function: sendTelemetry
+ * Input: time now
+ * Output: none
+ * Description:
+ *   Drop the clients that have gone quiet and send every other one a packet
+ *   The looper is read while the process thread changes it, a packet is a
+ *   snapshot, the meters are taken so each peak is reported once
+ *   The mix only keeps the meters while there is a client
+ *
+ */
+static void sendTelemetry(uint64_t now)
+{
+    struct TelemetryPacket packet = {0};
+    struct TelemetryTrack *t;
+    struct Track *track;
+    float last;
+    float max;
+    uint8_t numClients = 0;
+    uint8_t idx;
+    uint8_t group;
+    uint8_t c;
+
+    for (c = 0; c < NET_MAX_CLIENTS; c++)
+    {
+        if ((clients[c].used) && (now - clients[c].lastHeardMs > NET_CLIENT_TIMEOUT_S * 1000))
+        {
+            clients[c].used = false;
+        }
+        numClients += (clients[c].used) ? 1 : 0;
+    }
+    looper->meteringOn = (numClients > 0);
+    if (numClients == 0)
+    {
+        return;
+    }
+
+    statsLoad(&last, &max);
+    packet.magic = NET_TELEMETRY_MAGIC;
+    packet.version = NET_TELEMETRY_VERSION;
+    packet.numTracks = NUM_TRACKS;
+    packet.sequence = sequence++;
+    packet.sampleRate = looper->sampleRate;
+    packet.masterLength = looper->masterLength[looper->selectedGroup];
+    packet.masterCurrIdx = looper->masterCurrIdx;
+    packet.xruns = statsXruns();
+    packet.dspLoad = (last < 65.5f) ? (uint16_t)(last * 1000.0f) : UINT16_MAX;
+    packet.dspLoadMax = (max < 65.5f) ? (uint16_t)(max * 1000.0f) : UINT16_MAX;
+    packet.state = looper->state;
+    packet.selectedGroup = looper->selectedGroup;
+    packet.selectedTrack = looper->selectedTrack;
+    packet.numPortPairs = looper->numPortPairs;
+    for (idx = 0; idx < NUM_TRACKS; idx++)
+    {
+        track = &looper->tracks[idx];
+        t = &packet.tracks[idx];
+        t->currIdx = track->currIdx;
+        t->endIdx = track->endIdx;
+        t->peakLeft = atomic_exchange_explicit(&track->meterLeft, 0, memory_order_relaxed);
+        t->peakRight = atomic_exchange_explicit(&track->meterRight, 0, memory_order_relaxed);
+        t->state = track->state;
+        t->channels = track->channels;
+        t->inputPair = track->inputPair;
+        for (group = 0; group < NUM_GROUPS; group++)
+        {
+            t->groups |= (looper->groupMembers[group] & (1u << idx)) ? (1u << group) : 0;
+        }
+    }
+
+    for (c = 0; c < NET_MAX_CLIENTS; c++)
+    {
+        if ((clients[c].used) &&
+            (sendto(sock, &packet, sizeof(packet), 0,
+                (struct sockaddr *)&clients[c].addr, sizeof(clients[c].addr)) < 0))
+        {
+            printf("Telemetry to %s failed, %s\n", inet_ntoa(clients[c].addr.sin_addr), strerror(errno));
+        }
+    }
+}
+
+/*
+ * Function: netThread
+ * Input: none
+ * Output: none
+ * Description:
+ *   Wait for datagrams until the next telemetry packet is due. An ordinary
+ *   thread, rtInit keeps it off the process thread's core
+ *
+ */
+static void *netThread(void *arg)
+{
+    struct pollfd fds[1];
+    uint64_t interval = (NET_TELEMETRY_HZ > 0) ? 1000 / NET_TELEMETRY_HZ : 0;
+    uint64_t next = nowMs() + interval;
+    uint64_t now;
+    int timeout;
+    int rc;
+
+    fds[0].fd = sock;
+    fds[0].events = POLLIN;
+    while (!looper->exitNow)
+    {
+        now = nowMs();
+        timeout = (interval == 0) ? NET_IDLE_POLL_MS : (next > now) ? (int)(next - now) : 0;
+        rc = poll(fds, 1, timeout);
+        if (rc == -1)
+        {
+            printf("Network poll error\n");
+        }
+        if ((rc > 0) && (fds[0].revents & POLLIN))
+        {
+            receiveDatagram();
+        }
+        now = nowMs();
+        if ((interval > 0) && (now >= next))
+        {
+            sendTelemetry(now);
+            // a late packet does not bring the next ones forward
+            next = (next + interval > now) ? next + interval : now + interval;
+        }
+    }
+
+    close(sock);
+    printf("network thread exiting\n");
+    pthread_exit(NULL);
+}
+
+/**************************************************************
+ * Public functions
+ *************************************************************/
+
+/*
+ * Function: netInit
+ * Input: pointer to the master looper context
+ * Output: pass/fail of init process
+ * Description:
+ *   Open the UDP port and start the network thread
+ *   serialInit must have been called, the commands are parsed there
+ *
+ */
+bool netInit(struct MasterLooper *mLooper)
+{
+    struct sockaddr_in addr = {0};
+    int rc;
+
+    looper = mLooper;
+    sock = socket(AF_INET, SOCK_DGRAM, 0);
+    if (sock < 0)
+    {
+        printf("Error opening network socket, %s\n", strerror(errno));
+        return false;
+    }
+    addr.sin_family = AF_INET;
+    addr.sin_port = htons(NET_UDP_PORT);
+    if (inet_pton(AF_INET, NET_BIND_ADDRESS, &addr.sin_addr) != 1)
+    {
+        printf("Error: bad network address %s\n", NET_BIND_ADDRESS);
+        close(sock);
+        return false;
+    }
+    if (bind(sock, (struct sockaddr *)&addr, sizeof(addr)) < 0)
+    {
+        printf("Error binding UDP port %s:%d, %s\n", NET_BIND_ADDRESS, NET_UDP_PORT, strerror(errno));
+        close(sock);
+        return false;
+    }
+
+    if ((rc = pthread_create(&looper->netTh, NULL, netThread, NULL)))
+    {
+        printf("Error: pthread_create, rc: %d\n", rc);
+        close(sock);
+        return false;
+    }
+    printf("Network control on UDP %s:%d, telemetry %d Hz\n", NET_BIND_ADDRESS, NET_UDP_PORT, NET_TELEMETRY_HZ);
+    return true;
+}
@@ -8,7 +8,9 @@
  *                                                            *
  * Functionality:                                             *
  * - Update indices during recording and playback             *
- * - Copy data from input buffers to mixdown output buffers   *
+ * - Mix tracks and input straight into the output buffers   *
+ * - Every port pair is handled in the one callback, each     *
+ *   track records from its own pair                          *
  *                                                            *
  *                                                            *
  *************************************************************/
@@ -38,6 +40,349 @@
  * Static functions
  *************************************************************/
 
+/*
+ * Function: recordWindow
+ * Input: pointer to the track being written
+ *        number of frames in the block
+ *        pointer to the track index the first kept frame is written to
+ * Output: number of leading input frames to drop
+ * Description:
+ *   The input a performer plays along to arrives recordOffset frames after the
+ *   material they heard was mixed, so it is written that far behind currIdx
+ *   Frames that would land before the start of the track are dropped
+ *
+ */
+static jack_nframes_t recordWindow(
+    struct Track *track,
+    jack_nframes_t nframes,
+    uint32_t *writeIdx)
+{
+    int64_t target = (int64_t)track->currIdx - track->recordOffset;
+    jack_nframes_t skip = 0;
+
+    if (target < (int64_t)track->startIdx)
+    {
+        skip = (track->startIdx - target < nframes) ? (jack_nframes_t)(track->startIdx - target) : nframes;
+    }
+    *writeIdx = (uint32_t)(target + skip);
+    return skip;
+}
+
+/*
+ * Function: overdubRange
+ * Input: pointer to the track being overdubbed
+ *        pointers to the input, right may be NULL
+ *        track index of the first input frame, may lie outside the track
+ *        number of frames
+ * Output: false if the pool ran out, nothing is written then
+ * Description:
+ *   Add the input that lands between startIdx and endIdx, the pass writes to
+ *   its own copies of the chunks, see undo.c
+ *   At the start of a pass that went round from endIdx the tail is heard
+ *   too, it gets the same input so the overdub crosses the seam at full level
+ *
+ */
+static bool overdubRange(
+    struct Track *track,
+    jack_default_audio_sample_t *inL,
+    jack_default_audio_sample_t *inR,
+    int64_t idx,
+    jack_nframes_t count)
+{
+    uint32_t passStart = (track->repeat) ? track->startIdx : 0;
+    jack_nframes_t drop = 0;
+    uint32_t since;
+
+    if (idx < (int64_t)track->startIdx)
+    {
+        drop = (track->startIdx - idx < count) ? (jack_nframes_t)(track->startIdx - idx) : count;
+    }
+    idx += drop;
+    count -= drop;
+    if (idx >= (int64_t)track->endIdx)
+    {
+        return true;
+    }
+    if (idx + count > track->endIdx)
+    {
+        count = track->endIdx - idx;
+    }
+    if (!undoTouch(track, (uint32_t)idx, count))
+    {
+        return false;
+    }
+    if (count > 0)
+    {
+        overdub(inL + drop, track->chunksLeft, (uint32_t)idx, count);
+        if ((inR) && (track->channels == 2))
+        {
+            overdub(inR + drop, track->chunksRight, (uint32_t)idx, count);
+        }
+    }
+
+    since = (uint32_t)idx - passStart;
+    if ((count == 0) || (track->cutIdx != track->endIdx) ||
+        (track->tailFrames < LOOP_SEAM_FADE_FRAMES) || (since >= LOOP_SEAM_FADE_FRAMES))
+    {
+        return true;
+    }
+    count = (LOOP_SEAM_FADE_FRAMES - since < count) ? LOOP_SEAM_FADE_FRAMES - since : count;
+    if (!undoTouch(track, track->endIdx + since, count))
+    {
+        return false;
+    }
+    overdub(inL + drop, track->chunksLeft, track->endIdx + since, count);
+    if ((inR) && (track->channels == 2))
+    {
+        overdub(inR + drop, track->chunksRight, track->endIdx + since, count);
+    }
+    return true;
+}
+
+/*
+ * Function: overdubTrack
+ * Input: pointer to the track being overdubbed
+ *        pointers to the input, right may be NULL
+ *        number of frames in the block
+ * Output: false if the pool ran out
+ * Description:
+ *   The input lands recordOffset frames behind currIdx. Just after the track
+ *   wraps, the input still due from before the wrap goes back to the end of
+ *   the loop it was played along to
+ *
+ */
+static bool overdubTrack(
+    struct Track *track,
+    jack_default_audio_sample_t *inL,
+    jack_default_audio_sample_t *inR,
+    jack_nframes_t nframes)
+{
+    uint32_t trackIdx;
+    jack_nframes_t skip = recordWindow(track, nframes, &trackIdx);
+
+    if ((skip > 0) &&
+        (!overdubRange(track, inL, inR, (int64_t)trackIdx - skip + track->wrapDelta, skip)))
+    {
+        return false;
+    }
+    return overdubRange(track, inL + skip, (inR) ? inR + skip : NULL, trackIdx, nframes - skip);
+}
+
+/*
+ * Function: recordTails
+ * Input: pointer to the master looper context
+ *        pointer to the buffers of every port pair for this block
+ *        number of frames in this block
+ * Output: none
+ * Description:
+ *   A take goes on recording for LOOP_SEAM_FADE_FRAMES past its end, from
+ *   its own input pair, so there is audio to fade out when its pass is cut
+ *   Without room for it the track's seams are cut straight
+ *
+ */
+static void recordTails(
+    struct MasterLooper *looper,
+    const struct PortBuffers *io,
+    jack_nframes_t nframes)
+{
+    struct Track *track;
+    jack_nframes_t count;
+    uint32_t idx;
+    uint8_t pair;
+    uint8_t t;
+
+    for (t = 0; t < NUM_TRACKS; t++)
+    {
+        track = &looper->tracks[t];
+        if (track->tailDue == 0)
+        {
+            continue;
+        }
+        count = (track->tailDue < nframes) ? track->tailDue : nframes;
+        idx = track->endIdx + track->tailFrames;
+        pair = (track->inputPair < looper->numPortPairs) ? track->inputPair : 0;
+        if (!trackReserve(track, idx, count))
+        {
+            track->tailDue = 0;
+            continue;
+        }
+        trackWrite(track->chunksLeft, idx, io->inL[pair], count);
+        if ((io->inR[pair]) && (track->channels == 2))
+        {
+            trackWrite(track->chunksRight, idx, io->inR[pair], count);
+        }
+        track->tailFrames += count;
+        track->tailDue -= count;
+        trackPublish(track);
+    }
+}
+
+/*
+ * Function: passthroughPair
+ * Input: pointers to one pair's input and output buffers, right may be NULL
+ *        number of frames in this block
+ * Output: none
+ *
+ */
+static void passthroughPair(
+    jack_default_audio_sample_t *inL,
+    jack_default_audio_sample_t *inR,
+    jack_default_audio_sample_t *outL,
+    jack_default_audio_sample_t *outR,
+    jack_nframes_t nframes)
+{
+    uint32_t byteSize = nframes * sizeof (jack_default_audio_sample_t);
+
+    memcpy (outL, inL, byteSize);
+    if((inR == NULL) && (outR)) // mono in, simulated mono out
+    {
+        memcpy (outR, inL, byteSize);
+    }
+    else if ((inR) && (outR)) // stereo in, stereo out
+    {
+        memcpy (outR, inR, byteSize);
+    }
+    // if mono, out left channel only
+}
+
+/*
+ * Function: processBlock
+ * Input: pointer to the master looper context
+ *        pointer to the buffers of every port pair for this block
+ *        number of frames in this block
+ * Output: none
+ * Description:
+ *   Run one stretch of frames that has no state change inside it
+ *
+ *   Copy data from input buffers to: track if recording or overdubbing
+ *                                  : the tail of a take that just stopped
+ *                                  : output buffer if bypass
+ *   Mix into the output buffers if not in bypass state
+ *   The selected track is written from its own input pair, calibration
+ *   always uses the first
+ *
+ *   Update the indices of all tracks and masterLength depending on state (calls function)
+ *
+ */
+static void processBlock(
+    struct MasterLooper *looper,
+    const struct PortBuffers *io,
+    jack_nframes_t nframes)
+{
+    // Keep track of previous state so we can capture transitions
+    static enum SystemStates prevSystemState = SYSTEM_STATE_PASSTHROUGH;
+
+    uint8_t sg = looper->selectedGroup;
+    uint8_t st = looper->selectedTrack;
+    struct Track *track = looper->groupedTracks[sg][st];
+    jack_default_audio_sample_t *inL = io->inL[0];
+    jack_default_audio_sample_t *inR = io->inR[0];
+    uint32_t trackIdx = 0;
+    jack_nframes_t skip;
+    jack_nframes_t count;
+    uint8_t pair;
+
+    if ((track) && (track->inputPair < looper->numPortPairs))
+    {
+        inL = io->inL[track->inputPair];
+        inR = io->inR[track->inputPair];
+    }
+
+    // the end of a take that just stopped, before it can be mixed
+    recordTails(looper, io, nframes);
+
+    // Record/Overdub/Playback
+    switch(looper->state)
+    {
+        case SYSTEM_STATE_PASSTHROUGH:
+        {
+            for (pair = 0; pair < looper->numPortPairs; pair++)
+            {
+                passthroughPair(io->inL[pair], io->inR[pair], io->outL[pair], io->outR[pair], nframes);
+            }
+            break;
+        }
+        case SYSTEM_STATE_OVERDUBBING:
+        {
+            // Overdubbing - only within the recorded part of the track
+            if (!overdubTrack(track, inL, inR, nframes))
+            {
+                // Protect ourselves - no room to keep the chunks for undo, stop overdubbing
+                logEvent(LOG_MSG_POOL_FULL, 0, 0, 0);
+                undoEnd(track);
+                trackNewTake(track);
+                looper->state = SYSTEM_STATE_PLAYBACK;
+                track->state = TRACK_STATE_PLAYBACK;
+            }
+            // pass through to mixdown
+        }
+        case SYSTEM_STATE_RECORDING:
+        {
+            stopTimer(TIMER_RECORD_START_DELAY);
+            if (prevSystemState != looper->state)
+            {
+                logEvent(LOG_MSG_REC_DATA_COPY, looper->masterCurrIdx, looper->callCounter, 0);
+            }
+            // overwrite track
+            if (looper->state == SYSTEM_STATE_RECORDING)
+            {
+                skip = recordWindow(track, nframes, &trackIdx);
+                count = nframes - skip;
+                if (!trackReserve(track, trackIdx, count))
+                {
+                    // Protect ourselves - Stop Recording, the track keeps what it has so far
+                    logEvent(LOG_MSG_POOL_FULL, 0, 0, 0);
+                    looper->state = SYSTEM_STATE_PLAYBACK;
+                    track->state = TRACK_STATE_PLAYBACK;
+                }
+                else if (count > 0)
+                {
+                    trackWrite(track->chunksLeft, trackIdx, inL + skip, count);
+                    if ((inR) && (track->channels == 2))
+                    {
+                        trackWrite(track->chunksRight, trackIdx, inR + skip, count);
+                    }
+                }
+            }
+            // pass through to mixdown
+        }
+        case SYSTEM_STATE_CALIBRATION:
+        {
+            if (looper->state == SYSTEM_STATE_CALIBRATION)
+            {
+                trackIdx = looper->tracks[1].currIdx;
+logEvent(LOG_MSG_CALIBRATION, trackIdx, 0, 0);
+                if (trackReserve(&looper->tracks[1], trackIdx, nframes))
+                {
+                    trackWrite(looper->tracks[1].chunksLeft, trackIdx, io->inL[0], nframes);
+                }
+            }
+            // pass through to mixdown
+        }
+        case SYSTEM_STATE_PLAYBACK:
+        {
+           if ((looper->state == SYSTEM_STATE_PLAYBACK) && (prevSystemState != looper->state))
+           {
+               logEvent(LOG_MSG_PLAY_DATA, looper->masterCurrIdx, looper->callCounter, 0);
+           }
+           stopTimer(TIMER_RECORD_STOP_DELAY);
+            // mixdown, straight into the output ports
+            doMixDown(looper, io, nframes);
+            break;
+        }
+        default:
+            break;
+    }
+
+    // Update indecies - all playback tracks, recording track, masterLength
+    if (looper->state != SYSTEM_STATE_PASSTHROUGH)
+    {
+        updateIndices(looper, nframes);
+    }
+
+    prevSystemState = looper->state;
+}
+
 /**************************************************************
  * Public functions
  *************************************************************/
@@ -54,27 +399,31 @@
  * Description:
  *   Update the indices for the tracks associated with the active group
  *   Updating includes playback and record states and handles the repeat track option
+ *   Called once per block, a block never runs past a repeat or master seam
+ *   in the indices it leaves behind, see trackSegments for the mix inside it
  *
  */
 void updateIndices(struct MasterLooper *looper, jack_nframes_t nframes) 
 {
     uint8_t sg = looper->selectedGroup;
     uint8_t st = looper->selectedTrack;
+    uint32_t members = looper->groupMembers[sg];
     uint8_t idx = 0;
+    uint32_t wrapped;
     struct Track * track;
     // update master current index
     looper->masterCurrIdx += nframes;
-    if (looper->masterCurrIdx > SAMPLE_LIMIT)
+    if (looper->masterCurrIdx > looper->sampleLimit)
     {
-        looper->masterCurrIdx = SAMPLE_LIMIT;
+        looper->masterCurrIdx = looper->sampleLimit;
     }
-    // loop through all potential tracks for a group
+    // loop through the tracks of the active group
     // some tracks may belong to more than one group - but that we only update the active group!
-    while (idx < NUM_TRACKS)
+    while (members)
     {
-        track = looper->groupedTracks[sg][idx];
-        if ( (track != NULL) &&
-             (track->state != TRACK_STATE_OFF)) 
+        idx = nextTrack(&members);
+        track = &looper->tracks[idx];
+        if (track->state != TRACK_STATE_OFF)
         {
             // for playback, we can let currIdx exceed endIdx for a track - mixdown won't mix it
             // if repeating, it will be reset below
@@ -85,18 +434,26 @@ void updateIndices(struct MasterLooper *looper, jack_nframes_t nframes)
                 ((looper->state == SYSTEM_STATE_CALIBRATION /*OVERDUBBING*/) ||
                 (looper->state == SYSTEM_STATE_RECORDING)))
             {
-                if (track->currIdx > SAMPLE_LIMIT)
+                if (track->currIdx > looper->sampleLimit)
                 {
-                    track->currIdx = SAMPLE_LIMIT;
+                    track->currIdx = looper->sampleLimit;
 
                     // Protect ourselves - Stop Recording/Overdubbing!!!!
-                    printf("\n\n ** BUFFER FULL - Switch to Playback\n\n");
+                    logEvent(LOG_MSG_BUFFER_FULL, 0, 0, 0);
                     looper->state = SYSTEM_STATE_PLAYBACK;
                 }
-                // update selected track's endIdx if necessary
-                if (track->currIdx > track->endIdx)
+                // update selected track's endIdx if necessary, the input lands recordOffset behind
+                if ((track->currIdx > track->recordOffset) &&
+                    (track->currIdx - track->recordOffset > track->endIdx))
                 {
-                    track->endIdx = track->currIdx;
+                    bool firstAudio = (track->endIdx == 0);
+                    track->endIdx = track->currIdx - track->recordOffset;
+                    if (firstAudio)
+                    {
+                        // the track counts as active from its first recorded frame
+                        trackUpdateActive(looper, idx);
+                    }
+                    trackPublish(track);
                 }
 
                 // update master track's masterLength if neccessary
@@ -105,277 +462,155 @@ void updateIndices(struct MasterLooper *looper, jack_nframes_t nframes)
                     looper->masterLength[sg] = track->endIdx;
                 }
             }
-            else // playback only - ensure we haven't exceeded endIdx
+            else if ((track->repeat) && (track->currIdx >= track->endIdx) && (track->endIdx > track->startIdx))
             {
-                // if repeat is enabled and at end for current track - reset track's currIdx
-                // if masterCurrIdx > masterLength - reset all tracks' currIdx
-                // if repeat NOT enabled but at end for current track - leave it - mixdown uses this to ignore track for mixing
-                if (track->repeat && (track->currIdx > track->endIdx))
-                {
-                    track->currIdx = track->startIdx;
-                }
-                if (looper->masterCurrIdx > looper->masterLength[sg])
+                // playback and overdub, a repeating track is a circular region and goes round on the frame it reaches endIdx
+                // if repeat NOT enabled and at end for current track - leave it - mixdown uses this to ignore track for mixing
+                wrapped = trackWrap(track->startIdx, track->endIdx, track->currIdx);
+                if (track->currIdx - nframes < track->endIdx)
                 {
-                    track->currIdx = (track->repeat) ? track->startIdx : 0;
+                    // played up to its end, not run past it straight from recording
+                    track->cutIdx = track->endIdx;
                 }
+                track->wrapDelta = track->currIdx - wrapped;
+                track->currIdx = wrapped;
             }
         }
-        idx++;
     }
-    // reset master's current index here, as we needed it above to know if we're resetting all tracks index or not
-    if ((looper->state == SYSTEM_STATE_PLAYBACK) && (looper->masterCurrIdx > looper->masterLength[sg]))
+    // the master wraps on the exact frame, playRecord ends a block there
+    // every track starts over with it, repeating ones from their startIdx
+    if (masterWraps(looper) && (looper->masterCurrIdx >= looper->masterLength[sg]))
     {
         looper->masterCurrIdx = 0;
+        members = looper->groupMembers[sg];
+        while (members)
+        {
+            track = &looper->tracks[nextTrack(&members)];
+            if (track->state != TRACK_STATE_OFF)
+            {
+                wrapped = (track->repeat) ? track->startIdx : 0;
+                if (track->currIdx != wrapped)
+                {
+                    // a repeat that just went round on this frame keeps its cut
+                    track->cutIdx = track->currIdx;
+                }
+                track->wrapDelta = track->currIdx - wrapped;
+                track->currIdx = wrapped;
+            }
+        }
     }
-/*
-    if (looper->masterLength[sg] >= TRACK_DEBUG_FRAME_COUNT)
-    {
-//        printf("\n\nTesting done\n\n");
-//        printf("quitting\n");
-        looper->exitNow = true;
-        looper->state = SYSTEM_STATE_PLAYBACK;
-    }
-*/
 }
 
 /*
  * Function: playRecord
  * Input: pointer to the master looper context
- *        pointer to the mixdown buffer for the left channel
- *        pointer to the mixdown buffer for the right channel
  *        number of frames Jack received
  * Output: return status, example code simple_client.c returns 0, this was copied here
  * Description:
  *   The process callback for this JACK application is called in a
  *   special realtime thread once for each audio cycle.
  *
- *   Copy data from input buffers to: track if recording or overdubbing
- *                                  : output buffer if bypass
- *   Copy data from mixdown buffers to: output buffer if not in bypass state
+ *   Queued commands are stamped with the absolute frame they were received on.
+ *   The period is split at each command's frame so the state change lands on
+ *   that exact sample: frames before it are processed in the old state, frames
+ *   from it onwards in the new one. Commands for a later period stay queued.
  *
- *   Update the indices of all tracks and masterLength depending on state (calls function)
+ *   Blocks are also split where the master loop wraps, so
+ *   updateIndices starts the loop over on the exact frame
+ *   A quantized command moves itself to the next grid point when it comes
+ *   due, and the period is split again there
+ *
+ *   Each block is handled by processBlock, see above
+ *   A finished track bounce is swapped in before the first block, and some
+ *   of the audio of released tracks is handed back to the pool
  *
  */
-int playRecord (
-    struct MasterLooper *looper,
-    jack_default_audio_sample_t *mixdownLeft,
-    jack_default_audio_sample_t *mixdownRight,
-    jack_nframes_t nframes)
+int playRecord (struct MasterLooper *looper, jack_nframes_t nframes)
 {
     startTimer(TIMER_PLAY_RECORD_DELAY);
 
-    // Keep track of previous state so we can capture transitions
-    // this will allow us to keep recording until the buffers are in sync
-    static enum SystemStates prevSystemState = SYSTEM_STATE_PASSTHROUGH;
-
-    // check for updated state(s)
-    controlStateCheck();
-
-    // block control state changes while in here!
-    looper->controlLocked = true;
-
-    uint32_t byteSize = (looper->rec_frame_delay > 0) ? (nframes - looper->rec_frame_delay) :
-                        (looper->play_frame_delay > 0) ? looper->play_frame_delay : nframes;
-
-//    byteSize = nframes; 
-    byteSize *= sizeof (jack_default_audio_sample_t);
+    jack_nframes_t pos = 0;
+    jack_nframes_t end;
+    jack_nframes_t frameTime;
+    int32_t eventOffset;
+    bool eventDue;
 
-    uint32_t offset = (looper->rec_frame_delay > 0) ? (looper->rec_frame_delay) * sizeof(jack_default_audio_sample_t) : 0;
+    // The input buffer of this cycle was captured captureLatency frames ago, a
+    // command received at frame F lines up with input sample F - windowStart
+    jack_nframes_t windowStart = jack_last_frame_time(looper->client) - looper->captureLatency;
 
-//    offset = 0;
-
-    uint8_t sg = looper->selectedGroup;
-    uint8_t st = looper->selectedTrack;
-    uint32_t trackIdx = 0;
-
-	jack_default_audio_sample_t *inL, *outL, *inR, *outR;
-	inL = jack_port_get_buffer (looper->input_portL, nframes);
-	outL = jack_port_get_buffer (looper->output_portL, nframes);
+    struct PortBuffers io;
+    struct PortBuffers block;
+    uint8_t pair;
 
     // mono devices will use only the left ports
     // if right ports are NULL, do not copy data
-    inR = NULL;
-    outR = NULL;
-    if (looper->input_portR)
-    {
-	    inR = jack_port_get_buffer (looper->input_portR, nframes);
-    } 
-    if (looper->output_portR)
+    for (pair = 0; pair < looper->numPortPairs; pair++)
     {
-	    outR = jack_port_get_buffer (looper->output_portR, nframes);
+        io.inL[pair] = jack_port_get_buffer (looper->input_portL[pair], nframes);
+        io.outL[pair] = jack_port_get_buffer (looper->output_portL[pair], nframes);
+        io.inR[pair] = (looper->input_portR[pair]) ?
+            jack_port_get_buffer (looper->input_portR[pair], nframes) : NULL;
+        io.outR[pair] = (looper->output_portR[pair]) ?
+            jack_port_get_buffer (looper->output_portR[pair], nframes) : NULL;
     }
 
+    // a finished bounce lands between periods
+    bounceApply();
 
-    // Record/Overdub/Playback
-    switch(looper->state)
+    // released tracks go back to the pool a little at a time
+    poolReclaim(POOL_RECLAIM_CHUNKS);
+
+    while (pos < nframes)
     {
-        case SYSTEM_STATE_PASSTHROUGH:
+        end = nframes;
+        eventDue = false;
+        if (controlPeekCommand(&frameTime))
         {
-            memcpy (outL, inL, byteSize);
-            if((inR == NULL) && (outR)) // mono in, simulated mono out
+            // late commands are applied at the current position
+            eventOffset = (int32_t)(frameTime - windowStart);
+            if (eventOffset < (int32_t)pos)
             {
-                memcpy (outR, inL, byteSize);
+                eventOffset = pos;
             }
-            else if ((inR) && (outR)) // stereo in, stereo out
+            if (eventOffset < (int32_t)nframes)
             {
-                memcpy (outR, inR, byteSize);
+                end = eventOffset;
+                eventDue = true;
             }
-            // if mono, out left channel only
-            break;
         }
-        case SYSTEM_STATE_OVERDUBBING:
-        {
-            trackIdx = looper->groupedTracks[sg][st]->currIdx;
-            // If recording to a playing track the track is moved out
-            // indices are advanced by 128 frames, so recording must be
-            // reset by 128 frames to line up with what was played
-            if (getNumActiveTracks() > 1)
-            {
-                trackIdx -= 128;
-            }
 
-            // Overdubbing
-            overdub(
-                inL + offset,
-                &looper->groupedTracks[sg][st]->channelLeft[trackIdx],
-                nframes - looper->rec_frame_delay);
-            if (inR)
-            {
-                overdub(
-                    inR + offset,
-                    &looper->groupedTracks[sg][st]->channelRight[trackIdx],
-                    nframes - looper->rec_frame_delay);
-            }
-            // pass through to mixdown
-        }
-        case SYSTEM_STATE_RECORDING:
+        // the master loop wraps on its exact frame, a command past it waits
+        // for the next block
+        if ((masterWraps(looper)) &&
+            (looper->masterLength[looper->selectedGroup] > looper->masterCurrIdx) &&
+            (pos + (looper->masterLength[looper->selectedGroup] - looper->masterCurrIdx) < end))
         {
-            stopTimer(TIMER_RECORD_START_DELAY);
-            if (prevSystemState != looper->state)
-            {
-                printf("RecDataCopy masterIDX %d, callCounter %d, offset %d, bytes %d\n", looper->masterCurrIdx, looper->callCounter, offset, byteSize);
-            }
-            // overwrite track
-            if (looper->state != SYSTEM_STATE_OVERDUBBING)
-            {
-                // If only one track, then record starting from index 0
-                // If more than one track, then assume playing to the other track(s) so take into account
-                // the buffer delay - 2 128frame buffers out and 2 buffers in or 512 frames/samples!
-                // Tracks will have to be treated as circular buffers?
-                // Corner cases: 
-                //   single track: currIdx is 0 - first recording of data
-                //   > 1 track: check master track's currIdx, see if started over (4 buffer delay)
-                //              - subtracking 4 buffers should be circular, if < 0, sub remainder from master's endIdx
-                // ** ^^ work out on blocks first in book!!! 
-                trackIdx = looper->groupedTracks[sg][st]->currIdx;
-                if (getNumActiveTracks() > 1)
-                {
-                    // Check if master reset
-                    // TODO redo this whole buffer-index thing after much white-boarding
-                    if (((int)looper->masterCurrIdx - 4*128) < 0)
-                    {
-                    }
-                    else
-                    {
-                        trackIdx -= 512;
-                    }
-                }
-
-                memcpy (
-                    &looper->groupedTracks[sg][st]->channelLeft[trackIdx],
-                    inL + offset,
-                    byteSize);
-                if (inR)
-                {
-                    memcpy (
-                        &looper->groupedTracks[sg][st]->channelRight[trackIdx],
-                        inR + offset,
-                        byteSize);
-                }
-
-            }
-            // pass through to mixdown
+            end = pos + (looper->masterLength[looper->selectedGroup] - looper->masterCurrIdx);
+            eventDue = false;
         }
-        case SYSTEM_STATE_CALIBRATION:
+
+        if (end > pos)
         {
-            if ((looper->state != SYSTEM_STATE_OVERDUBBING) &&
-                (looper->state != SYSTEM_STATE_RECORDING))
+            for (pair = 0; pair < looper->numPortPairs; pair++)
             {
-                trackIdx = looper->tracks[1].currIdx;
-printf("PRCal t0idx %d, t1idx %d\n", trackIdx + offset, trackIdx);
-                memcpy (
-                    &looper->tracks[1].channelLeft[trackIdx],
-                    inL + offset,
-                    byteSize);
+                block.inL[pair] = io.inL[pair] + pos;
+                block.inR[pair] = (io.inR[pair]) ? io.inR[pair] + pos : NULL;
+                block.outL[pair] = io.outL[pair] + pos;
+                block.outR[pair] = (io.outR[pair]) ? io.outR[pair] + pos : NULL;
             }
-            // pass through to mixdown
+            processBlock(looper, &block, end - pos);
         }
-        case SYSTEM_STATE_PLAYBACK:
+        pos = end;
+
+        if (eventDue)
         {
-           if ((looper->state == SYSTEM_STATE_PLAYBACK) && (prevSystemState != looper->state))
-           {
-               printf("Play masterIDX %d, callCounter %d, bytes %d\n", looper->masterCurrIdx, looper->callCounter, byteSize);
-           }
-           stopTimer(TIMER_RECORD_STOP_DELAY);
-            // if we just finished recording, we need to capture the last little bit
-            // of data, if playing only we'd miss it - it will likely be part of this
-            // buffer (nframes) but not all of it
-#if 1
-            if (looper->play_frame_delay > 0)
-            {   
-                trackIdx = looper->groupedTracks[sg][st]->currIdx;
-                offset = 0; // want only first few frames
-                memcpy (
-                    &looper->groupedTracks[sg][st]->channelLeft[trackIdx],
-                    inL + offset,
-                    byteSize);
-                if (inR)
-                {
-                    memcpy (
-                        &looper->groupedTracks[sg][st]->channelRight[trackIdx],
-                        inR + offset,
-                        byteSize);
-                }
-                // for output mix, we want full 128 frames so restore byteSize
-                byteSize = nframes * sizeof (jack_default_audio_sample_t);
-            }
-#endif
-            // mixdown
-            // when mixing - take into account 2 buffer delay otherwise recorded will be behind
-            doMixDown(looper, inL, outL, mixdownLeft, mixdownRight, nframes);
-            // output mix
-            memcpy (outL, mixdownLeft, byteSize);
-            if (inR && outR)
-            {
-                memcpy (outR, mixdownRight, byteSize);
-            }
-            if (!inR && outR) // simulate mono
-            {
-                memcpy (outR, mixdownLeft, byteSize);
-            }
-            break;
+            controlApplyCommand(windowStart + pos);
         }
-        default:
-            break;
-    }
-
-    // Update indecies - all playback tracks, recording track, masterLength
-    if (looper->state != SYSTEM_STATE_PASSTHROUGH)
-    {
-        updateIndices(looper, nframes);
     }
 
-    looper->rec_frame_delay = 0;
-    looper->play_frame_delay = 0;
-
-    // block control state changes while in here!
-    looper->controlLocked = false;
-
-    prevSystemState = looper->state;
     looper->callCounter++;
 
     stopTimer(TIMER_PLAY_RECORD_DELAY);
     return 0;      
 }
-
-
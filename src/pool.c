@@ -0,0 +1,403 @@
+/**************************************************************
+ * Copyright (C) 2017 by Chan Russell, Robert                 *
+ *                                                            *
+ * Project: Audio Looper                                      *
+ *                                                            *
+ * This file contains the track storage, a pool of fixed size *
+ * sample chunks shared by all tracks                         *
+ *                                                            *
+ * Functionality:                                             *
+ * - Allocate and lock the chunk pool once at startup         *
+ * - Hand chunks to a track as its recording grows            *
+ * - Release a track in constant time, its chunk tables are   *
+ *   swapped for clean ones and drained a little each period  *
+ * - Clear the unwritten head of a chunk when it is handed    *
+ *   out, stale audio never shows through a new take          *
+ * - Hand out single chunks for the overdub undo copies       *
+ * - Write input into a track across chunk boundaries         *
+ *                                                            *
+ *************************************************************/
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdbool.h>
+#include <sys/mman.h>
+
+#include "local.h"
+
+/**************************************************************
+ * Macros and defines                                         *
+ *************************************************************/
+#define POOL_ALIGNMENT      (64)
+#define POOL_SPARE_TABLES   (NUM_TRACKS)    // a whole reset is swapped out before any draining is needed
+
+/**************************************************************
+ * Data types                                                 *
+ *************************************************************/
+// A pair of chunk tables, the chunks of a released one are handed back from next onwards
+struct TableSet
+{
+    track_sample_t **left;
+    track_sample_t **right;
+    uint32_t numChunks;
+    uint32_t next;
+};
+
+struct ChunkPool
+{
+    track_sample_t *samples;   // numChunks * CHUNK_FRAMES samples
+    track_sample_t **freeList; // stack of free chunks
+    uint32_t numChunks;
+    uint32_t freeCount;
+    uint32_t trackMaxChunks;                // chunk table entries per track channel
+    struct TableSet spare[POOL_SPARE_TABLES];       // clean tables, every entry NULL
+    struct TableSet released[POOL_SPARE_TABLES];    // tables of released tracks still being drained
+    uint8_t numSpare;
+    uint8_t numReleased;
+};
+
+// Only touched from the process thread
+static struct ChunkPool pool;
+
+/**************************************************************
+ * Static functions
+ *************************************************************/
+
+/*
+ * Function: poolOwns
+ * Input: pointer to a chunk
+ * Output: true if the chunk came out of the pool
+ * Description:
+ *   Tracks loaded from a session point at file mappings instead, see session.c
+ *
+ */
+static bool poolOwns(const track_sample_t *chunk)
+{
+    return (chunk >= pool.samples) &&
+           (chunk < pool.samples + ((size_t)pool.numChunks * CHUNK_FRAMES));
+}
+
+/*
+ * Function: reclaimTables
+ * Input: most chunk table entries to hand back
+ * Output: what is left of the budget
+ * Description:
+ *   Drain released tables into the pool, a table is clean again once every
+ *   entry it used is NULL. Chunks mapped from a session file are dropped
+ *   from the table and stay mapped
+ *
+ */
+static uint32_t reclaimTables(uint32_t budget)
+{
+    struct TableSet *set;
+
+    while ((pool.numReleased > 0) && (budget > 0))
+    {
+        set = &pool.released[pool.numReleased - 1];
+        for (; (set->next < set->numChunks) && (budget > 0); set->next++, budget--)
+        {
+            poolGiveChunk(set->left[set->next]);
+            poolGiveChunk(set->right[set->next]);
+            set->left[set->next] = NULL;
+            set->right[set->next] = NULL;
+        }
+        if (set->next == set->numChunks)
+        {
+            pool.spare[pool.numSpare++] = *set;
+            pool.numReleased--;
+        }
+    }
+    return budget;
+}
+
+/*
+ * Function: takeChunk
+ * Input: none
+ * Output: a free chunk, NULL if the pool is empty
+ * Description:
+ *   Anything released but not yet drained is handed back first when the free
+ *   list runs dry
+ *
+ */
+static track_sample_t *takeChunk(void)
+{
+    if (pool.freeCount == 0)
+    {
+        poolReclaim(UINT32_MAX);
+    }
+    return (pool.freeCount > 0) ? pool.freeList[--pool.freeCount] : NULL;
+}
+
+/*
+ * Function: reserveChannel
+ * Input: pointer to a channel's chunk table
+ *        first track index to be written
+ *        first and last chunk numbers to make available
+ * Output: true if every chunk in the range is allocated
+ * Description:
+ *   Allocate any missing chunks in the range from the pool. A take is written
+ *   forwards from its first index, so only the head of the first chunk is
+ *   never written, it is cleared of whatever the chunk held before
+ *
+ */
+static bool reserveChannel(
+    track_sample_t **chunks,
+    uint32_t idx,
+    uint32_t firstChunk,
+    uint32_t lastChunk)
+{
+    uint32_t c;
+    for (c = firstChunk; c <= lastChunk; c++)
+    {
+        if (chunks[c] == NULL)
+        {
+            chunks[c] = takeChunk();
+            if (chunks[c] == NULL)
+            {
+                return false;
+            }
+            if (c == firstChunk)
+            {
+                memset(chunks[c], 0, (idx & CHUNK_FRAMES_MASK) * sizeof(track_sample_t));
+            }
+        }
+    }
+    return true;
+}
+
+/**************************************************************
+ * Public functions
+ *************************************************************/
+
+/*
+ * Function: poolInit
+ * Input: pointer to the master looper context, sampleRate must be set
+ * Output: pass/fail of the allocation
+ * Description:
+ *   Allocate the chunk pool in one block, sized for POOL_LENGTH_S seconds at
+ *   the server's sample rate, and lock it into memory so handing chunks to a
+ *   recording track never page faults. Failing to lock is reported but not fatal,
+ *   the pool is written through once instead
+ *   Every track gets chunk tables big enough to borrow the whole pool, and
+ *   there are POOL_SPARE_TABLES more to swap in when tracks are released
+ *
+ */
+bool poolInit(struct MasterLooper *looper)
+{
+    uint32_t numChunks = ((uint64_t)looper->sampleRate * POOL_LENGTH_S) / CHUNK_FRAMES;
+    size_t bytes = (size_t)numChunks * CHUNK_FRAMES * sizeof(track_sample_t);
+    uint32_t c;
+    int track;
+
+    if (posix_memalign((void **)&pool.samples, POOL_ALIGNMENT, bytes))
+    {
+        printf("Error allocating %zu byte track pool\n", bytes);
+        return false;
+    }
+    pool.freeList = malloc(numChunks * sizeof(track_sample_t *));
+    if (pool.freeList == NULL)
+    {
+        printf("Error allocating track pool free list\n");
+        return false;
+    }
+    for (track = 0; track < NUM_TRACKS; track++)
+    {
+        looper->tracks[track].chunksLeft = calloc(numChunks, sizeof(track_sample_t *));
+        looper->tracks[track].chunksRight = calloc(numChunks, sizeof(track_sample_t *));
+        if ((looper->tracks[track].chunksLeft == NULL) || (looper->tracks[track].chunksRight == NULL))
+        {
+            printf("Error allocating chunk tables for track %d\n", track);
+            return false;
+        }
+    }
+    for (track = 0; track < POOL_SPARE_TABLES; track++)
+    {
+        pool.spare[track].left = calloc(numChunks, sizeof(track_sample_t *));
+        pool.spare[track].right = calloc(numChunks, sizeof(track_sample_t *));
+        if ((pool.spare[track].left == NULL) || (pool.spare[track].right == NULL))
+        {
+            printf("Error allocating spare chunk tables\n");
+            return false;
+        }
+    }
+    pool.numSpare = POOL_SPARE_TABLES;
+    if (mlock(pool.samples, bytes))
+    {
+        printf("Warning: could not lock track pool, %s\n", strerror(errno));
+        // the pages are at least there before the first take, not faulted in by it
+        memset(pool.samples, 0, bytes);
+    }
+
+    pool.numChunks = numChunks;
+    pool.freeCount = numChunks;
+    pool.trackMaxChunks = numChunks;
+    for (c = 0; c < numChunks; c++)
+    {
+        // hand out from the start of the block first
+        pool.freeList[c] = &pool.samples[(size_t)(numChunks - 1 - c) * CHUNK_FRAMES];
+    }
+    looper->trackMaxChunks = numChunks;
+    looper->sampleLimit = numChunks * CHUNK_FRAMES;
+    printf("Track pool %d chunks, %d s of audio per channel, %zu MB\n",
+        numChunks, (numChunks * CHUNK_FRAMES) / looper->sampleRate, bytes >> 20);
+    return true;
+}
+
+/*
+ * Function: poolFreeChunks
+ * Input: none
+ * Output: number of chunks not owned by any track
+ * Description:
+ *   For status reporting
+ *
+ */
+uint32_t poolFreeChunks(void)
+{
+    return pool.freeCount;
+}
+
+/*
+ * Function: poolTakeChunk
+ * Input: none
+ * Output: a free chunk, NULL if the pool is empty
+ *
+ */
+track_sample_t *poolTakeChunk(void)
+{
+    return takeChunk();
+}
+
+/*
+ * Function: poolGiveChunk
+ * Input: pointer to a chunk no table refers to any more
+ * Output: none
+ * Description:
+ *   Return a chunk to the pool, one mapped from a session file is dropped
+ *
+ */
+void poolGiveChunk(track_sample_t *chunk)
+{
+    if ((chunk) && (poolOwns(chunk)))
+    {
+        pool.freeList[pool.freeCount++] = chunk;
+    }
+}
+
+/*
+ * Function: poolReclaim
+ * Input: most chunks to hand back
+ * Output: none
+ * Description:
+ *   Process thread, once per period with a small budget. Drain what released
+ *   tracks and dropped undo layers still hold
+ *
+ */
+void poolReclaim(uint32_t budget)
+{
+    undoReclaim(reclaimTables(budget));
+}
+
+/*
+ * Function: trackReserve
+ * Input: pointer to the track
+ *        first track index to be written
+ *        number of frames to be written
+ * Output: true if the whole range is backed by chunks, false if the pool ran out
+ * Description:
+ *   Make sure the track's channels have chunks for the given range before it is
+ *   written, mono tracks never take right channel chunks
+ *
+ */
+bool trackReserve(struct Track *track, uint32_t idx, jack_nframes_t count)
+{
+    uint32_t firstChunk = idx >> CHUNK_FRAMES_SHIFT;
+    uint32_t lastChunk = (idx + count - 1) >> CHUNK_FRAMES_SHIFT;
+
+    if (count == 0)
+    {
+        return true;
+    }
+    if (lastChunk >= pool.trackMaxChunks)
+    {
+        return false;
+    }
+    if ((!reserveChannel(track->chunksLeft, idx, firstChunk, lastChunk)) ||
+        ((track->channels == 2) && (!reserveChannel(track->chunksRight, idx, firstChunk, lastChunk))))
+    {
+        return false;
+    }
+    if (lastChunk >= track->numChunks)
+    {
+        track->numChunks = lastChunk + 1;
+    }
+    return true;
+}
+
+/*
+ * Function: trackRelease
+ * Input: pointer to the track
+ * Output: none
+ * Description:
+ *   Hand all of the track's audio back to the pool, the track is empty afterwards
+ *   Its overdub history goes with it. Constant time, the track gets clean
+ *   tables and its old ones are drained by poolReclaim
+ *
+ */
+void trackRelease(struct Track *track)
+{
+    struct TableSet clean;
+    struct TableSet *set;
+
+    undoClear(track);
+    track->cutIdx = 0;
+    track->tailFrames = 0;
+    track->tailDue = 0;
+    if (track->numChunks == 0)
+    {
+        return;
+    }
+    if (pool.numSpare == 0)
+    {
+        // released faster than drained, finish the draining now
+        reclaimTables(UINT32_MAX);
+    }
+    clean = pool.spare[--pool.numSpare];
+    set = &pool.released[pool.numReleased++];
+    set->left = track->chunksLeft;
+    set->right = track->chunksRight;
+    set->numChunks = track->numChunks;
+    set->next = 0;
+    track->chunksLeft = clean.left;
+    track->chunksRight = clean.right;
+    track->numChunks = 0;
+}
+
+/*
+ * Function: trackWrite
+ * Input: pointer to the channel's chunk table
+ *        first track index to write
+ *        pointer to the source samples
+ *        number of frames to write
+ * Output: none
+ * Description:
+ *   Copy samples into a channel, converting to the storage format, the range
+ *   must already be reserved
+ *
+ */
+void trackWrite(
+    track_sample_t **chunks,
+    uint32_t idx,
+    const jack_default_audio_sample_t *src,
+    jack_nframes_t count)
+{
+    jack_nframes_t run;
+    while (count > 0)
+    {
+        run = chunkRun(idx, count);
+        dspTrackStore(chunkSample(chunks, idx), src, run);
+        idx += run;
+        src += run;
+        count -= run;
+    }
+}
@@ -0,0 +1,106 @@
+/**************************************************************
+ * Copyright (C) 2017 by Chan Russell, Robert                 *
+ *                                                            *
+ * Project: Audio Looper                                      *
+ *                                                            *
+ * This file contains a wait-free single producer, single     *
+ * consumer queue of fixed size records                       *
+ *                                                            *
+ * Functionality:                                             *
+ * - Hand records from a non-realtime thread to the Jack      *
+ *   process callback (or back) without locks                 *
+ * - Neither side ever blocks, a full queue rejects the push  *
+ *                                                            *
+ *************************************************************/
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdbool.h>
+
+#include "local.h"
+
+/**************************************************************
+ * Macros and defines                                         *
+ *************************************************************/
+
+/**************************************************************
+ * Data types                                                 *
+ *************************************************************/
+
+/**************************************************************
+ * Static functions
+ *************************************************************/
+
+/**************************************************************
+ * Public functions
+ *************************************************************/
+
+/*
+ * Function: queueInit
+ * Input: pointer to the queue
+ *        pointer to the record storage, slots * recordSize bytes
+ *        number of slots, must be a power of two
+ *        size of one record in bytes
+ * Output: none
+ * Description:
+ *   Attach the storage to the queue and mark it empty
+ *   Must be called before either thread touches the queue
+ *
+ */
+void queueInit(struct SpscQueue *q, void *storage, uint32_t slots, size_t recordSize)
+{
+    q->records = storage;
+    q->mask = slots - 1;
+    q->recordSize = recordSize;
+    atomic_store_explicit(&q->head, 0, memory_order_relaxed);
+    atomic_store_explicit(&q->tail, 0, memory_order_relaxed);
+}
+
+/*
+ * Function: queuePush
+ * Input: pointer to the queue
+ *        pointer to the record to copy in
+ * Output: true if queued, false if the queue is full
+ * Description:
+ *   Producer side only - copy the record into the next free slot and publish it
+ *
+ */
+bool queuePush(struct SpscQueue *q, const void *record)
+{
+    uint32_t head = atomic_load_explicit(&q->head, memory_order_relaxed);
+    uint32_t tail = atomic_load_explicit(&q->tail, memory_order_acquire);
+
+    if ((head - tail) > q->mask)
+    {
+        return false;
+    }
+
+    memcpy(&q->records[(head & q->mask) * q->recordSize], record, q->recordSize);
+    atomic_store_explicit(&q->head, head + 1, memory_order_release);
+    return true;
+}
+
+/*
+ * Function: queuePop
+ * Input: pointer to the queue
+ *        pointer to the record to copy out to
+ * Output: true if a record was read, false if the queue is empty
+ * Description:
+ *   Consumer side only - copy out the oldest record and release its slot
+ *
+ */
+bool queuePop(struct SpscQueue *q, void *record)
+{
+    uint32_t tail = atomic_load_explicit(&q->tail, memory_order_relaxed);
+    uint32_t head = atomic_load_explicit(&q->head, memory_order_acquire);
+
+    if (head == tail)
+    {
+        return false;
+    }
+
+    memcpy(record, &q->records[(tail & q->mask) * q->recordSize], q->recordSize);
+    atomic_store_explicit(&q->tail, tail + 1, memory_order_release);
+    return true;
+}
@@ -0,0 +1,171 @@
+/**************************************************************
+ * Copyright (C) 2017 by Chan Russell, Robert                 *
+ *                                                            *
+ * Project: Audio Looper                                      *
+ *                                                            *
+ * This file contains the realtime setup done at startup so   *
+ * the first take runs as smoothly as the hundredth           *
+ *                                                            *
+ * Functionality:                                             *
+ * - Keep every thread but the Jack process thread off        *
+ *   RT_PROCESS_CORE, the process thread is pinned to it      *
+ * - Lock all memory, current and future, before activating   *
+ * - Fault in the process thread's stack and register it with *
+ *   the log before its first period                          *
+ * - Report the process thread's scheduling and any failures  *
+ *                                                            *
+ *************************************************************/
+
+#define _GNU_SOURCE
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdbool.h>
+#include <unistd.h>
+#include <errno.h>
+#include <sched.h>
+#include <pthread.h>
+#include <sys/mman.h>
+
+#include <jack/jack.h>
+
+#include "local.h"
+
+/**************************************************************
+ * Macros and defines                                         *
+ *************************************************************/
+
+/**************************************************************
+ * Data types                                                 *
+ *************************************************************/
+static struct MasterLooper *looper;
+static long numCores;
+
+/**************************************************************
+ * Static functions
+ *************************************************************/
+
+/*
+ * Function: prefaultStack
+ * Input: none
+ * Output: none
+ * Description:
+ *   Write a byte in each page of RT_STACK_PREFAULT_BYTES of the calling
+ *   thread's stack so the pages are there before the thread needs them. The
+ *   writes go through a volatile pointer and the function is never inlined,
+ *   so the compiler cannot drop the array as dead
+ *
+ */
+static void __attribute__((noinline)) prefaultStack(void)
+{
+    uint8_t stack[RT_STACK_PREFAULT_BYTES];
+    volatile uint8_t *page = stack;
+    long pageSize = sysconf(_SC_PAGESIZE);
+    size_t offset;
+
+    // top down, the stack grows a page at a time below what is in use
+    for (offset = sizeof(stack); offset > 0; offset -= (offset > (size_t)pageSize) ? (size_t)pageSize : offset)
+    {
+        page[offset - 1] = 0;
+    }
+}
+
+/*
+ * Function: threadInit
+ * Input: void args currently not used
+ * Output: none
+ * Description:
+ *   Jack calls this on the process thread once, before its first period,
+ *   so printing here costs the audio nothing
+ *
+ */
+static void threadInit(void *arg)
+{
+    struct sched_param param;
+    cpu_set_t cpus;
+    int policy = SCHED_OTHER;
+
+    // from here on the process thread's log records are queued, not printed
+    logSetProcessThread(pthread_self());
+    prefaultStack();
+    if (numCores > 1)
+    {
+        CPU_ZERO(&cpus);
+        CPU_SET(RT_PROCESS_CORE, &cpus);
+        if (pthread_setaffinity_np(pthread_self(), sizeof(cpus), &cpus))
+        {
+            printf("Warning: could not pin the process thread to core %d\n", RT_PROCESS_CORE);
+        }
+    }
+    pthread_getschedparam(pthread_self(), &policy, &param);
+    printf("Realtime: process thread %s priority %d on core %d\n",
+        (policy == SCHED_FIFO) ? "SCHED_FIFO" : (policy == SCHED_RR) ? "SCHED_RR" : "not realtime",
+        (policy == SCHED_OTHER) ? 0 : param.sched_priority, sched_getcpu());
+}
+
+/**************************************************************
+ * Public functions
+ *************************************************************/
+
+/*
+ * Function: rtInit
+ * Input: pointer to the master looper context
+ * Output: none
+ * Description:
+ *   First thing in main. Move the main thread off RT_PROCESS_CORE, every
+ *   thread started after this inherits it unless it picks its own cores
+ *
+ */
+void rtInit(struct MasterLooper *mLooper)
+{
+    cpu_set_t cpus;
+    long core;
+
+    looper = mLooper;
+    numCores = sysconf(_SC_NPROCESSORS_ONLN);
+    if (numCores < 2)
+    {
+        printf("Realtime: single core, threads share it with the process thread\n");
+        return;
+    }
+    CPU_ZERO(&cpus);
+    for (core = 0; core < numCores; core++)
+    {
+        if (core != RT_PROCESS_CORE)
+        {
+            CPU_SET(core, &cpus);
+        }
+    }
+    if (pthread_setaffinity_np(pthread_self(), sizeof(cpus), &cpus))
+    {
+        printf("Warning: could not keep threads off core %d\n", RT_PROCESS_CORE);
+    }
+}
+
+/*
+ * Function: rtPrepare
+ * Input: none
+ * Output: none
+ * Description:
+ *   Just before the client is activated, once everything the process thread
+ *   uses is allocated. Lock and fault in all memory, and have the process
+ *   thread set itself up when Jack starts it. A failure to lock is reported
+ *   but not fatal, the pool is still written through once, see poolInit
+ *
+ */
+void rtPrepare(void)
+{
+    if (mlockall(MCL_CURRENT | MCL_FUTURE))
+    {
+        printf("Warning: could not lock memory, %s, raise the memlock limit\n", strerror(errno));
+    }
+    else
+    {
+        printf("Realtime: all memory locked\n");
+    }
+    if (!jack_is_realtime(looper->client))
+    {
+        printf("Warning: Jack is not running realtime\n");
+    }
+    jack_set_thread_init_callback(looper->client, threadInit, NULL);
+}
@@ -0,0 +1,658 @@
+/**************************************************************
+ * Copyright (C) 2017 by Chan Russell, Robert                 *
+ *                                                            *
+ * Project: Audio Looper                                      *
+ *                                                            *
+ * This file contains the serial user interface               *
+ *                                                            *
+ * Functionality: (commands are in ASCII)                     *
+ * - Record: record a track and assign track to a group       *
+ *   rXXgY: command - r, track XX, group Y,                   *
+ * - Overdub: overdub on a track                              *
+ *   oXX00: command - o, track XX, pad 00                     *
+ * - Mute: mute a track                                       *
+ *   mXX00: command - m, track XX, pad 00                     *
+ * - Unmute: unmute a track                                   *
+ *   uXX00: command - u, track XX, pad 00                     *
+ * - Play: stop recording and play all tracks on active group *
+ *   p0000, pXX00r: command - p, track XX, pad 00,            *
+ *       optional r for repeat on, s for repeat off           *
+ *       track is only valid when changing repeat status and  *
+ *       in playback mode already -- track is ignored if cmd  *
+ *       is used to stop recording or overdubbing             *
+ * - Track: add a track to a group                            *
+ *   tXXgY: command - t, track XX, group Y                    *
+ * - Delete: remove a track from a group                      *
+ *   dXXgY: command - d, track XX, group Y                    *
+ * - Group: set active group                                  *
+ *   gY000: command - g, group Y, pad 000                     *
+ * - Stop: reset and return to passthrough state              *
+ *   s0000: command - s, pad 0000                             *
+ * - Quit: stops the looper application and Jack server       *
+ *   q0000: command - q, pad 0000                             *
+ * - Log: set log level, 0 error, 1 warn, 2 info, 3 debug     *
+ *   lY000: command - l, level Y, pad 000                     *
+ * - Info: report timer percentiles, DSP load and xruns       *
+ *   iY000: command - i, Y 1 to clear after reporting, pad 000*
+ * - Volume: set a track's gain, ramped by the mix            *
+ *   vXXNN: command - v, track XX, level NN, 50 is unity      *
+ * - Balance: set a track's pan, ramped by the mix            *
+ *   bXXNN: command - b, track XX, pan NN, 01 left, 50 centre,*
+ *       99 right                                             *
+ * - Flatten: bounce a group's playing tracks into one track  *
+ *   fXXgY: command - f, track XX, group Y, the track must be *
+ *       one of them or empty, muted tracks are kept          *
+ * - Undo: take back a track's last overdub pass, in playback *
+ *   zXX00: command - z, track XX, pad 00                     *
+ * - Redo: put back the last overdub pass undone              *
+ *   yXX00: command - y, track XX, pad 00                     *
+ * - Quantize: start and stop later recordings on a grid      *
+ *   n00NN: command - n, pad 00, NN points in the group's     *
+ *       first loop, 01 the loop itself, 00 off               *
+ * - Input: set the port pair a track records from            *
+ *   aXXNN: command - a, track XX, pair NN, 00 the first      *
+ *                                                            *
+ * Framing:                                                   *
+ * - A command is sent bare, 6 bytes as above, or in a frame  *
+ *   STX, length, 1 to 8 commands back to back, checksum      *
+ *   length is the bytes of commands, a multiple of 6         *
+ *   checksum is the XOR of the length and command bytes      *
+ * - Every command in a frame is queued with the same frame   *
+ *   time, in order, so a controller can send a sequence      *
+ * - Each command is answered 'p' accepted or 'f' rejected    *
+ * - A frame failing its checksum, a bad length or a bare    *
+ *   command with a bad last char is skipped a byte at a time *
+ *   until a command or frame lines up again, so nothing sent *
+ *   after a stray start byte is lost                         *
+ *                                                            *
+ *************************************************************/
+
+#include <stdio.h>
+#include <errno.h>
+#include <unistd.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdbool.h>
+#include <poll.h>
+
+#include <jack/jack.h>
+#include <wiringPi.h>
+#include <wiringSerial.h>
+
+#include "local.h"
+
+/**************************************************************
+ * Macros and defines                                         *
+ *************************************************************/
+#define SERIAL_RING_SIZE        (256)   // power of 2, holds several full frames
+#define SERIAL_RING_MASK        (SERIAL_RING_SIZE - 1)
+
+/**************************************************************
+ * Data types                                                 *
+ *************************************************************/
+static struct MasterLooper *looper;
+
+static void serialReply(const char *text, size_t length);
+
+// Commands from the serial port, only used by the control thread
+static struct CommandParser serialParser = {
+    .source = COMMAND_SOURCE_SERIAL,
+    .reply = serialReply
+};
+
+// Bytes read but not yet parsed, free running indices only used by the control thread
+static uint8_t ring[SERIAL_RING_SIZE];
+static uint32_t ringHead;               // next byte to parse
+static uint32_t ringTail;               // next byte to fill
+
+/**************************************************************
+ * Static functions
+ *************************************************************/
+
+/*
+ * Function: serialReply
+ * Input: the answer to send
+ *        number of characters
+ * Output: none
+ *
+ */
+static void serialReply(const char *text, size_t length)
+{
+    if (write(looper->sfd, text, length) < 0)
+    {
+        printf("Error writing to the serial port, %s\n", strerror(errno));
+    }
+}
+
+/*
+ * Function: replyChar
+ * Input: pointer to the parser the command came through
+ *        the answer, SERIAL_CMD_ACCEPTED or SERIAL_CMD_REJECTED
+ * Output: none
+ *
+ */
+static void replyChar(const struct CommandParser *parser, char c)
+{
+    parser->reply(&c, 1);
+}
+
+/*
+ * Function: reportStatus
+ * Input: pointer to the parser the command came through
+ *        true to clear the statistics once reported
+ * Output: none
+ * Description:
+ *   Send the timer percentiles, DSP load and xrun count back to the interface
+ *
+ */
+static void reportStatus(const struct CommandParser *parser, bool reset)
+{
+    char text[STATS_TEXT_LENGTH];
+
+    parser->reply(text, statsFormat(text, sizeof(text)));
+    if (reset)
+    {
+        statsReset();
+    }
+}
+
+/*
+ * Function: parseLevel
+ * Input: character buffer from UART
+ *        pointer to the level to fill
+ * Output: false if the level digits are not digits
+ *
+ */
+static bool parseLevel(const char buf[], uint8_t *level)
+{
+    if ((buf[SERIAL_LEVEL_UPPER_DIGIT] < '0') || (buf[SERIAL_LEVEL_UPPER_DIGIT] > '9') ||
+        (buf[SERIAL_LEVEL_LOWER_DIGIT] < '0') || (buf[SERIAL_LEVEL_LOWER_DIGIT] > '9'))
+    {
+        return false;
+    }
+    *level = (buf[SERIAL_LEVEL_UPPER_DIGIT] - 48) * 10;
+    *level += (buf[SERIAL_LEVEL_LOWER_DIGIT] - 48);
+    return true;
+}
+
+/*
+ * Function: validLastChar
+ * Input: last character of a command
+ * Output: true for carriage return, char 13, or a repeat option
+ *
+ */
+static bool validLastChar(char c)
+{
+    return (c == 13) || (c == SERIAL_CMD_OPTION_REPEAT_ON) || (c == SERIAL_CMD_OPTION_REPEAT_OFF);
+}
+
+/*
+ * Function: processUART
+ * Input: pointer to the parser the command came through
+ *        character buffer from UART
+ *        absolute frame the command arrived on
+ * Output: none
+ * Description:
+ *   Processing the UART buffer for 5 characters plus either 'r' for repeat or
+ *   carriage return, char 13.
+ *   Commands are processed and data, track or group, is checked and the command
+ *   is queued for the process callback, stamped with the absolute frame it arrived on
+ *   The answer goes back through the parser, so other interfaces take the
+ *   same commands
+ *
+ */
+static void processUART(struct CommandParser *parser, char buf[], jack_nframes_t frameTime)
+{
+    struct ControlCommand *uartCmd = &parser->cmd;
+    bool invalidData = false;
+    bool queueCommand = true;
+
+    if ((looper->min_serial_data_length >= MIN_SERIAL_DATA_LENGTH) &&
+        (!validLastChar(buf[SERIAL_LAST_CHAR])))
+    {
+        printf("Invalid last char\n");
+        replyChar(parser, SERIAL_CMD_REJECTED);
+        return;
+    }
+
+    switch(buf[SERIAL_CMD_OFFSET])
+    {
+        case SERIAL_CMD_OVERDUB_LC:
+        case SERIAL_CMD_OVERDUB_UC:
+            uartCmd->event = SYSTEM_EVENT_OVERDUB_TRACK;
+            uartCmd->track = (buf[SERIAL_TRACK_UPPER_DIGIT] - 48) * 10;
+            uartCmd->track += (buf[SERIAL_TRACK_LOWER_DIGIT] - 48);
+            break;
+        case SERIAL_CMD_RECORD_LC:
+        case SERIAL_CMD_RECORD_UC:
+            if ((buf[SERIAL_SUB_CMD_OFFSET] == SERIAL_CMD_GROUP_SELECT_LC) ||
+                (buf[SERIAL_SUB_CMD_OFFSET] == SERIAL_CMD_GROUP_SELECT_UC))
+            {
+                printf("Recording CC %d\n",looper->callCounter);
+                uartCmd->event = SYSTEM_EVENT_RECORD_TRACK;
+                uartCmd->track = (buf[SERIAL_TRACK_UPPER_DIGIT] - 48) * 10;
+                uartCmd->track += (buf[SERIAL_TRACK_LOWER_DIGIT] - 48);
+                uartCmd->group = (buf[SERIAL_TRACK_GROUP_LOWER_DIGIT] - 48);
+            }
+            break;
+        case SERIAL_CMD_TRACK_MUTE_LC: // set track to mute
+        case SERIAL_CMD_TRACK_MUTE_UC:
+            uartCmd->event = SYSTEM_EVENT_MUTE_TRACK;
+            uartCmd->track = (buf[SERIAL_TRACK_UPPER_DIGIT] - 48) * 10;
+            uartCmd->track += (buf[SERIAL_TRACK_LOWER_DIGIT] - 48);
+            break;
+        case SERIAL_CMD_GAIN_LC: // set track gain
+        case SERIAL_CMD_GAIN_UC:
+            uartCmd->event = SYSTEM_EVENT_SET_GAIN;
+            uartCmd->track = (buf[SERIAL_TRACK_UPPER_DIGIT] - 48) * 10;
+            uartCmd->track += (buf[SERIAL_TRACK_LOWER_DIGIT] - 48);
+            invalidData = !parseLevel(buf, &uartCmd->value);
+            break;
+        case SERIAL_CMD_PAN_LC: // set track pan
+        case SERIAL_CMD_PAN_UC:
+            uartCmd->event = SYSTEM_EVENT_SET_PAN;
+            uartCmd->track = (buf[SERIAL_TRACK_UPPER_DIGIT] - 48) * 10;
+            uartCmd->track += (buf[SERIAL_TRACK_LOWER_DIGIT] - 48);
+            invalidData = !parseLevel(buf, &uartCmd->value);
+            break;
+        case SERIAL_CMD_UNDO_LC: // undo the track's last overdub
+        case SERIAL_CMD_UNDO_UC:
+            uartCmd->event = SYSTEM_EVENT_UNDO_TRACK;
+            uartCmd->track = (buf[SERIAL_TRACK_UPPER_DIGIT] - 48) * 10;
+            uartCmd->track += (buf[SERIAL_TRACK_LOWER_DIGIT] - 48);
+            break;
+        case SERIAL_CMD_REDO_LC: // redo the track's last undone overdub
+        case SERIAL_CMD_REDO_UC:
+            uartCmd->event = SYSTEM_EVENT_REDO_TRACK;
+            uartCmd->track = (buf[SERIAL_TRACK_UPPER_DIGIT] - 48) * 10;
+            uartCmd->track += (buf[SERIAL_TRACK_LOWER_DIGIT] - 48);
+            break;
+        case SERIAL_CMD_INPUT_LC: // set the port pair a track records from
+        case SERIAL_CMD_INPUT_UC:
+            uartCmd->event = SYSTEM_EVENT_SET_INPUT;
+            uartCmd->track = (buf[SERIAL_TRACK_UPPER_DIGIT] - 48) * 10;
+            uartCmd->track += (buf[SERIAL_TRACK_LOWER_DIGIT] - 48);
+            invalidData = (!parseLevel(buf, &uartCmd->value)) || (uartCmd->value >= looper->numPortPairs);
+            break;
+        case SERIAL_CMD_QUANTIZE_LC: // set the record start and stop grid
+        case SERIAL_CMD_QUANTIZE_UC:
+            uartCmd->event = SYSTEM_EVENT_SET_QUANTIZE;
+            invalidData = !parseLevel(buf, &uartCmd->value);
+            break;
+        case SERIAL_CMD_BOUNCE_LC: // bounce group into a track
+        case SERIAL_CMD_BOUNCE_UC:
+            if ((buf[SERIAL_SUB_CMD_OFFSET] == SERIAL_CMD_GROUP_SELECT_LC) ||
+                (buf[SERIAL_SUB_CMD_OFFSET] == SERIAL_CMD_GROUP_SELECT_UC))
+            {
+                uartCmd->event = SYSTEM_EVENT_BOUNCE_GROUP;
+                uartCmd->track = (buf[SERIAL_TRACK_UPPER_DIGIT] - 48) * 10;
+                uartCmd->track += (buf[SERIAL_TRACK_LOWER_DIGIT] - 48);
+                uartCmd->group = (buf[SERIAL_TRACK_GROUP_LOWER_DIGIT] - 48);
+            }
+            else
+            {
+                invalidData = true;
+            }
+            break;
+        case SERIAL_CMD_TRACK_UNMUTE_LC: // set track to play
+        case SERIAL_CMD_TRACK_UNMUTE_UC:
+            uartCmd->event = SYSTEM_EVENT_UNMUTE_TRACK;
+            uartCmd->track = (buf[SERIAL_TRACK_UPPER_DIGIT] - 48) * 10;
+            uartCmd->track += (buf[SERIAL_TRACK_LOWER_DIGIT] - 48);
+            break;
+        case SERIAL_CMD_ADD_TRACK2GROUP_LC: // add track to group
+        case SERIAL_CMD_ADD_TRACK2GROUP_UC:
+            if ((buf[SERIAL_SUB_CMD_OFFSET] == SERIAL_CMD_GROUP_SELECT_LC) ||
+                (buf[SERIAL_SUB_CMD_OFFSET] == SERIAL_CMD_GROUP_SELECT_UC))
+            {
+                uartCmd->event = SYSTEM_EVENT_ADD_TRACK_TO_GROUP;
+                uartCmd->track = (buf[SERIAL_TRACK_UPPER_DIGIT] - 48) * 10;
+                uartCmd->track += (buf[SERIAL_TRACK_LOWER_DIGIT] - 48);
+                uartCmd->group = (buf[SERIAL_TRACK_GROUP_LOWER_DIGIT] - 48);
+            }
+            break;
+        case SERIAL_CMD_RMV_TRACK_GROUP_LC: // remove track from group
+        case SERIAL_CMD_RMV_TRACK_GROUP_UC:
+            if ((buf[SERIAL_SUB_CMD_OFFSET] == SERIAL_CMD_GROUP_SELECT_LC) ||
+                (buf[SERIAL_SUB_CMD_OFFSET] == SERIAL_CMD_GROUP_SELECT_UC))
+            {
+                uartCmd->event = SYSTEM_EVENT_REMOVE_TRACK_FROM_GROUP;
+                uartCmd->track = (buf[SERIAL_TRACK_UPPER_DIGIT] - 48) * 10;
+                uartCmd->track += (buf[SERIAL_TRACK_LOWER_DIGIT] - 48);
+                uartCmd->group = (buf[SERIAL_TRACK_GROUP_LOWER_DIGIT] - 48);
+            }
+            break;
+        case SERIAL_CMD_GROUP_SELECT_LC: // select active group
+        case SERIAL_CMD_GROUP_SELECT_UC:
+            uartCmd->event = SYSTEM_EVENT_SET_ACTIVE_GROUP;
+            uartCmd->group = (buf[SERIAL_GROUP_SELECT_LOWER_DIGIT] - 48);
+            break;
+        case SERIAL_CMD_PLAY_LC: // set system to play
+        case SERIAL_CMD_PLAY_UC:
+            uartCmd->event = SYSTEM_EVENT_PLAY_TRACK;
+            printf("Playing CC %d\n", looper->callCounter);
+            if (buf[SERIAL_LAST_CHAR] == SERIAL_CMD_OPTION_REPEAT_ON)
+            {
+                uartCmd->track = (buf[SERIAL_TRACK_UPPER_DIGIT] - 48) * 10;
+                uartCmd->track += (buf[SERIAL_TRACK_LOWER_DIGIT] - 48);
+                uartCmd->repeat = true;
+            }
+            if (buf[SERIAL_LAST_CHAR] == SERIAL_CMD_OPTION_REPEAT_OFF)
+            {
+                uartCmd->track = (buf[SERIAL_TRACK_UPPER_DIGIT] - 48) * 10;
+                uartCmd->track += (buf[SERIAL_TRACK_LOWER_DIGIT] - 48);
+                uartCmd->repeat = false;
+            }
+            break;
+        case SERIAL_CMD_SYSTEM_RESET_LC: // set system to passthrough
+        case SERIAL_CMD_SYSTEM_RESET_UC:
+            uartCmd->track = 0;
+            uartCmd->group = 0;
+            uartCmd->event = SYSTEM_EVENT_PASSTHROUGH;
+            break;
+        case SERIAL_CMD_QUIT_LC: // exit application
+        case SERIAL_CMD_QUIT_UC:
+            printf("quitting\n");
+            looper->exitNow = true;
+            queueCommand = false;
+            break;
+        case SERIAL_CMD_LOG_LEVEL_LC: // change log level, handled here - nothing for the process thread
+        case SERIAL_CMD_LOG_LEVEL_UC:
+            invalidData = !logSetLevel(buf[SERIAL_LOG_LEVEL_DIGIT] - 48);
+            queueCommand = false;
+            break;
+        case SERIAL_CMD_STATUS_LC: // report diagnostics, read here - nothing for the process thread
+        case SERIAL_CMD_STATUS_UC:
+            reportStatus(parser, buf[SERIAL_STATUS_RESET_DIGIT] == '1');
+            queueCommand = false;
+            break;
+        default:
+            invalidData = true;
+            break;
+    }
+
+    if ((uartCmd->track >= 0) && (uartCmd->track < NUM_TRACKS) &&
+        (uartCmd->group >= 0) && (uartCmd->group < NUM_GROUPS) &&
+        (invalidData == false))    
+    {
+        uartCmd->frameTime = frameTime;
+        if ((queueCommand) && (!controlQueueCommand(parser->source, uartCmd)))
+        {
+            printf("\n** Command queue full\n");
+            replyChar(parser, SERIAL_CMD_REJECTED);
+        }
+        else
+        {
+            replyChar(parser, SERIAL_CMD_ACCEPTED);
+        }
+    }
+    else
+    {
+        printf("\n** Invalid Cmd or Cmd args\n");
+        replyChar(parser, SERIAL_CMD_REJECTED);
+    }
+}
+
+/*
+ * Function: ringPeek
+ * Input: offset from the next byte to parse
+ * Output: the byte
+ *
+ */
+static uint8_t ringPeek(uint32_t offset)
+{
+    return ring[(ringHead + offset) & SERIAL_RING_MASK];
+}
+
+/*
+ * Function: readSerial
+ * Input: none
+ * Output: number of bytes read
+ * Description:
+ *   Read everything the port has waiting that fits in the ring, one read
+ *   for each contiguous part. Asking for no more than is waiting keeps the
+ *   read from blocking
+ *
+ */
+static uint32_t readSerial(void)
+{
+    uint32_t total = 0;
+    uint32_t contiguous;
+    int avail = serialDataAvail(looper->sfd);
+    int n;
+
+    while ((avail > 0) && (ringTail - ringHead < SERIAL_RING_SIZE))
+    {
+        contiguous = SERIAL_RING_SIZE - (ringTail & SERIAL_RING_MASK);
+        if (contiguous > SERIAL_RING_SIZE - (ringTail - ringHead))
+        {
+            contiguous = SERIAL_RING_SIZE - (ringTail - ringHead);
+        }
+        if (contiguous > (uint32_t)avail)
+        {
+            contiguous = avail;
+        }
+        n = read(looper->sfd, &ring[ringTail & SERIAL_RING_MASK], contiguous);
+        if (n <= 0)
+        {
+            break;
+        }
+        ringTail += n;
+        total += n;
+        avail -= n;
+    }
+    return total;
+}
+
+/*
+ * Function: parseSerial
+ * Input: absolute frame the bytes arrived by
+ * Output: none
+ * Description:
+ *   Process every whole command and frame in the ring, a partial one is left
+ *   for the next read. Anything that does not line up, a frame that fails
+ *   its checksum included, is dropped a byte at a time, so the next good
+ *   command or frame is found wherever it starts
+ *
+ */
+static void parseSerial(jack_nframes_t frameTime)
+{
+    char buf[MIN_SERIAL_DATA_LENGTH * SERIAL_FRAME_MAX_COMMANDS];
+    uint32_t cmdLength = looper->min_serial_data_length;
+    uint32_t dropped = 0;
+    uint32_t count;
+    uint32_t length;
+    uint32_t i;
+    uint8_t checksum;
+
+    while ((count = ringTail - ringHead) > 0)
+    {
+        if (ringPeek(0) == SERIAL_FRAME_START)
+        {
+            if (count < SERIAL_FRAME_HEADER_LENGTH)
+            {
+                break;
+            }
+            length = ringPeek(1);
+            if ((length == 0) || (length % cmdLength) ||
+                (length > cmdLength * SERIAL_FRAME_MAX_COMMANDS))
+            {
+                ringHead++;
+                dropped++;
+                continue;
+            }
+            if (count < SERIAL_FRAME_HEADER_LENGTH + length + 1)
+            {
+                break;
+            }
+            checksum = length;
+            for (i = 0; i < length; i++)
+            {
+                buf[i] = ringPeek(SERIAL_FRAME_HEADER_LENGTH + i);
+                checksum ^= buf[i];
+            }
+            checksum ^= ringPeek(SERIAL_FRAME_HEADER_LENGTH + length);
+            if (checksum != 0)
+            {
+                // a stray start byte gives a length that cannot be trusted either,
+                // rescan from the next byte
+                ringHead++;
+                dropped++;
+                continue;
+            }
+            ringHead += SERIAL_FRAME_HEADER_LENGTH + length + 1;
+            for (i = 0; i < length; i += cmdLength)
+            {
+                serialDispatchCommand(&serialParser, &buf[i], frameTime);
+            }
+        }
+        else
+        {
+            // bare command, a frame starting inside it means it was cut short
+            for (i = 1; (i < count) && (i < cmdLength) && (ringPeek(i) != SERIAL_FRAME_START); i++);
+            if ((i < count) && (i < cmdLength))
+            {
+                ringHead += i;
+                dropped += i;
+                continue;
+            }
+            if (count < cmdLength)
+            {
+                break;
+            }
+            if (!validLastChar(ringPeek(cmdLength - 1)))
+            {
+                ringHead++;
+                dropped++;
+                continue;
+            }
+            for (i = 0; i < cmdLength; i++)
+            {
+                buf[i] = ringPeek(i);
+            }
+            ringHead += cmdLength;
+            serialDispatchCommand(&serialParser, buf, frameTime);
+        }
+    }
+
+    if (dropped)
+    {
+        printf("\n** Serial framing error, %u bytes skipped\n", dropped);
+    }
+}
+
+/*
+ * Function:  controlThread
+ * Input: none
+ * Output: none
+ * Description:
+ *   Main control thread to monitor user input interfaces
+ *   Each wakeup reads all the bytes waiting and processes every command in
+ *   them. A partial command still there when the poll times out is dropped
+ *
+ */
+static void *controlThread(void *arg)
+{
+    struct pollfd fds[1];
+    fds[0].fd = looper->sfd;
+    fds[0].events = POLLIN;
+    int timeout = 20 * 1000; // check for exit every 1 sec
+    int rc;
+    jack_nframes_t frameTime;
+    serialFlush(looper->sfd);
+    while(!looper->exitNow)
+    {
+        rc = poll(fds, 1, timeout);
+        if (rc == -1)
+        {
+            printf("Poll error\n");
+        }
+        if ((rc == 0) && (ringTail != ringHead))
+        {
+            printf("\n** Serial timeout, %u bytes dropped\n", ringTail - ringHead);
+            ringHead = ringTail;
+        }
+        if ((rc > 0) && (fds[0].revents & POLLIN))
+        {
+            frameTime = controlFrameTime();
+            while (readSerial() > 0)
+            {
+                parseSerial(frameTime);
+            }
+        }
+    }
+
+    printf("control thread exiting\n");
+    pthread_exit(NULL);
+}
+
+
+/**************************************************************
+ * Public functions
+ *************************************************************/
+
+/*
+ * Function: serialDispatchCommand
+ * Input: pointer to the parser of the interface the command came through
+ *        one command, min_serial_data_length characters
+ *        absolute frame the command arrived on
+ * Output: none
+ * Description:
+ *   Start the latency timers the command is measured by, then process it
+ *   Called by each interface's own thread with its own parser, serialInit
+ *   must have run
+ *
+ */
+void serialDispatchCommand(struct CommandParser *parser, char buf[], jack_nframes_t frameTime)
+{
+    if ((buf[0] == 'r') || (buf[0] == 'R') || (buf[0] == 'o') || (buf[0] == 'O'))
+    {
+        startTimer(TIMER_RECORD_START_DELAY);
+    }
+    if ((buf[0] == 'p') || (buf[0] == 'P'))
+    {
+        startTimer(TIMER_RECORD_STOP_DELAY);
+    }
+
+    startTimer(TIMER_UART_PROCESS);
+    processUART(parser, buf, frameTime);
+    stopTimer(TIMER_UART_PROCESS);
+}
+
+/*
+ * Function: serialInit
+ * Input: pointer to the master looper context
+ * Output: pass/fail of init process
+ * Description:
+ *   Intialize the serial port, create the serial monitoring thread
+ *   controlInit must have been called so commands can be queued
+ *
+ */
+bool serialInit(struct MasterLooper *mLooper)
+{
+    looper = mLooper;
+
+    if (wiringPiSetup() == -1)
+    {
+        printf("WiringPiSetup failed\n");
+        return false;
+    }
+
+    looper->sfd = serialOpen("/dev/ttyAMA0",  115200);
+    if (looper->sfd < 0)
+    {
+        printf("Error setting up serial port\n");
+        return false;
+    }
+    serialFlush(looper->sfd);
+    looper->min_serial_data_length = MIN_SERIAL_DATA_LENGTH;
+
+    // Setup interface monitoring thread
+    int rc;
+    if ((rc = pthread_create(&looper->controlTh, NULL, controlThread, NULL)))
+    {
+        printf("Error: pthread_create, rc: %d\n", rc);
+        return false;
+    }
+    return true;
+}
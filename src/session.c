@@ -0,0 +1,606 @@
+/**************************************************************
+ * Copyright (C) 2017 by Chan Russell, Robert                 *
+ *                                                            *
+ * Project: Audio Looper                                      *
+ *                                                            *
+ * This file contains session persistence, tracks are kept on *
+ * disk as they are recorded and reloaded at startup          *
+ *                                                            *
+ * Functionality:                                             *
+ * - Low priority writer thread streams each track's recorded *
+ *   range [0, endIdx) and its seam tail to one raw file per  *
+ *   channel                                                  *
+ * - Compact header with groups, states, repeat flags and     *
+ *   master lengths, replaced atomically when it changes      *
+ * - Reload maps the track files, no audio is copied          *
+ *                                                            *
+ * Layout in the session directory:                           *
+ *   session.meta       struct SessionHeader                  *
+ *   trackXX_L.raw      left channel samples, track_sample_t  *
+ *   trackXX_R.raw      right channel samples, stereo only    *
+ *                                                            *
+ *************************************************************/
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdbool.h>
+#include <unistd.h>
+#include <errno.h>
+#include <limits.h>
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+
+#include "local.h"
+
+/**************************************************************
+ * Macros and defines                                         *
+ *************************************************************/
+#define SESSION_MAGIC           (0x504F4F4C)    // "LOOP"
+#define SESSION_VERSION         (1)
+#define SESSION_WRITE_PERIOD_US (500 * 1000)
+#define SESSION_META            "session.meta"
+#define SESSION_CHANNELS        (2)
+
+/**************************************************************
+ * Data types                                                 *
+ *************************************************************/
+struct SessionTrack
+{
+    uint32_t startIdx;
+    uint32_t endIdx;                        // frames in each channel file
+    uint8_t  state;
+    uint8_t  repeat;
+    uint8_t  channels;                      // 0 from older sessions, load as stereo
+    uint8_t  tailFrames;                    // of them past the track's end, 0 from older sessions
+};
+
+struct SessionHeader
+{
+    uint32_t magic;
+    uint32_t version;
+    uint32_t sampleRate;
+    uint32_t sampleBytes;
+    uint32_t numGroups;
+    uint32_t numTracks;
+    uint32_t selectedGroup;
+    uint32_t masterLength[NUM_GROUPS];
+    uint32_t groupMembers[NUM_GROUPS];
+    struct SessionTrack tracks[NUM_TRACKS];
+};
+
+// What the writer has on disk for one track
+struct TrackWriter
+{
+    int fd[SESSION_CHANNELS];               // open while a take is being streamed, -1 otherwise
+    uint32_t takeId;                        // take the files hold
+    uint32_t persisted;                     // frames of that take on disk
+    uint8_t channels;                       // channel files the take has
+    bool pending;                           // take not yet renamed over the track's files
+    bool removed;                           // the files were deleted for an empty take
+};
+
+static struct MasterLooper *looper;
+static char sessionDir[PATH_MAX];
+static struct TrackWriter writers[NUM_TRACKS];
+static struct SessionHeader lastHeader;     // header as last written
+static pthread_t sessionTh;
+static const char CHANNEL_SUFFIX[SESSION_CHANNELS] = { 'L', 'R' };
+
+/**************************************************************
+ * Static functions
+ *************************************************************/
+
+/*
+ * Function: trackPath
+ * Input: buffer for the path, PATH_MAX long
+ *        track and channel
+ *        true for the file a new take is written to before it is renamed
+ * Output: none
+ *
+ */
+static void trackPath(char *path, uint8_t track, uint8_t channel, bool temporary)
+{
+    snprintf(path, PATH_MAX, "%s/track%02d_%c.raw%s",
+        sessionDir, track, CHANNEL_SUFFIX[channel], (temporary) ? ".tmp" : "");
+}
+
+/*
+ * Function: channelChunks
+ * Input: track and channel
+ * Output: the channel's chunk table
+ *
+ */
+static track_sample_t **channelChunks(struct Track *track, uint8_t channel)
+{
+    return (channel == 0) ? track->chunksLeft : track->chunksRight;
+}
+
+/*
+ * Function: closeWriter
+ * Input: pointer to the track's writer
+ * Output: none
+ *
+ */
+static void closeWriter(struct TrackWriter *w)
+{
+    uint8_t channel;
+    for (channel = 0; channel < SESSION_CHANNELS; channel++)
+    {
+        if (w->fd[channel] >= 0)
+        {
+            close(w->fd[channel]);
+            w->fd[channel] = -1;
+        }
+    }
+}
+
+/*
+ * Function: appendChannel
+ * Input: file to append to
+ *        channel's chunk table
+ *        first frame and number of frames to write
+ * Output: pass/fail of the writes
+ * Description:
+ *   Write straight out of the chunks, one write per contiguous run, chunks
+ *   the track never recorded are skipped
+ *
+ */
+static bool appendChannel(int fd, track_sample_t **chunks, uint32_t idx, uint32_t count)
+{
+    const track_sample_t *chunk;
+    size_t bytes;
+    jack_nframes_t run;
+
+    while (count > 0)
+    {
+        run = chunkRun(idx, count);
+        bytes = run * sizeof(track_sample_t);
+        chunk = chunks[idx >> CHUNK_FRAMES_SHIFT];
+        // a chunk before startIdx was never recorded, the file keeps a hole that reads as silence
+        if ((chunk) &&
+            (pwrite(fd, chunk + (idx & CHUNK_FRAMES_MASK), bytes, (off_t)idx * sizeof(track_sample_t)) != (ssize_t)bytes))
+        {
+            return false;
+        }
+        idx += run;
+        count -= run;
+    }
+    return true;
+}
+
+/*
+ * Function: saveTrack
+ * Input: track number
+ * Output: true if the files on disk changed
+ * Description:
+ *   Append what the track recorded since the last pass. A new take is written to
+ *   temporary files and renamed over the old ones once complete, so a mapping
+ *   from the loaded session is never truncated under the process thread
+ *   The take id is checked again after copying, if the process thread released
+ *   or overdubbed the take meanwhile the copy is thrown away and redone
+ *
+ */
+static bool saveTrack(uint8_t t)
+{
+    struct Track *track = &looper->tracks[t];
+    struct TrackWriter *w = &writers[t];
+    char path[PATH_MAX];
+    char tmpPath[PATH_MAX];
+    uint32_t takeId = atomic_load_explicit(&track->takeId, memory_order_acquire);
+    uint32_t end = atomic_load_explicit(&track->savedEnd, memory_order_acquire);
+    uint8_t channel;
+
+    if ((takeId != w->takeId) || (end < w->persisted))
+    {
+        closeWriter(w);
+        w->takeId = takeId;
+        w->channels = track->channels;
+        w->persisted = 0;
+        w->pending = true;
+        w->removed = false;
+    }
+
+    if (end == 0)
+    {
+        // track was reset or its new take has no audio yet, the old take is gone
+        if (!w->removed)
+        {
+            for (channel = 0; channel < SESSION_CHANNELS; channel++)
+            {
+                trackPath(path, t, channel, false);
+                unlink(path);
+            }
+            w->removed = true;
+            return true;
+        }
+        return false;
+    }
+    if (end == w->persisted)
+    {
+        return false;
+    }
+
+    for (channel = 0; channel < w->channels; channel++)
+    {
+        if (w->fd[channel] < 0)
+        {
+            trackPath(tmpPath, t, channel, true);
+            w->fd[channel] = open(tmpPath, O_WRONLY | O_CREAT | O_TRUNC, 0644);
+            if (w->fd[channel] < 0)
+            {
+                printf("Session: cannot create %s, %s\n", tmpPath, strerror(errno));
+                closeWriter(w);
+                return false;
+            }
+        }
+        if (!appendChannel(w->fd[channel], channelChunks(track, channel), w->persisted, end - w->persisted))
+        {
+            printf("Session: write failed for track %d, %s\n", t, strerror(errno));
+            // start the take over next pass
+            closeWriter(w);
+            w->persisted = 0;
+            w->pending = true;
+            return false;
+        }
+    }
+
+    atomic_thread_fence(memory_order_acquire);
+    if (atomic_load_explicit(&track->takeId, memory_order_relaxed) != takeId)
+    {
+        return false;
+    }
+
+    for (channel = 0; channel < SESSION_CHANNELS; channel++)
+    {
+        if (channel >= w->channels)
+        {
+            // mono take, drop the right channel of an older stereo take
+            if (w->pending)
+            {
+                trackPath(path, t, channel, false);
+                unlink(path);
+            }
+            continue;
+        }
+        fdatasync(w->fd[channel]);
+        if (w->pending)
+        {
+            trackPath(tmpPath, t, channel, true);
+            trackPath(path, t, channel, false);
+            rename(tmpPath, path);
+        }
+    }
+    w->pending = false;
+    w->persisted = end;
+    return true;
+}
+
+/*
+ * Function: buildHeader
+ * Input: pointer to the header to fill
+ * Output: none
+ * Description:
+ *   Snapshot the looper for the header, only frames already on disk are listed
+ *   The process thread may change fields while they are read, a torn snapshot
+ *   is corrected on the next pass
+ *
+ */
+static void buildHeader(struct SessionHeader *header)
+{
+    uint8_t t;
+    uint8_t group;
+
+    memset(header, 0, sizeof(*header));
+    header->magic = SESSION_MAGIC;
+    header->version = SESSION_VERSION;
+    header->sampleRate = looper->sampleRate;
+    header->sampleBytes = sizeof(track_sample_t);
+    header->numGroups = NUM_GROUPS;
+    header->numTracks = NUM_TRACKS;
+    header->selectedGroup = looper->selectedGroup;
+    for (group = 0; group < NUM_GROUPS; group++)
+    {
+        header->masterLength[group] = looper->masterLength[group];
+        header->groupMembers[group] = looper->groupMembers[group];
+    }
+    for (t = 0; t < NUM_TRACKS; t++)
+    {
+        header->tracks[t].endIdx = (writers[t].pending) ? 0 : writers[t].persisted;
+        header->tracks[t].tailFrames = ((header->tracks[t].endIdx > looper->tracks[t].endIdx) &&
+            (header->tracks[t].endIdx - looper->tracks[t].endIdx <= LOOP_SEAM_FADE_FRAMES)) ?
+            header->tracks[t].endIdx - looper->tracks[t].endIdx : 0;
+        header->tracks[t].startIdx = looper->tracks[t].startIdx;
+        header->tracks[t].repeat = looper->tracks[t].repeat;
+        header->tracks[t].channels = writers[t].channels;
+        header->tracks[t].state = (header->tracks[t].endIdx == 0) ? TRACK_STATE_OFF :
+            (looper->tracks[t].state == TRACK_STATE_MUTE) ? TRACK_STATE_MUTE : TRACK_STATE_PLAYBACK;
+    }
+}
+
+/*
+ * Function: saveHeader
+ * Input: none
+ * Output: none
+ * Description:
+ *   Write the header if anything in it changed, through a temporary file so a
+ *   power cut leaves either the old or the new header
+ *
+ */
+static void saveHeader(void)
+{
+    struct SessionHeader header;
+    char path[PATH_MAX];
+    char tmpPath[PATH_MAX];
+    int fd;
+
+    buildHeader(&header);
+    if (memcmp(&header, &lastHeader, sizeof(header)) == 0)
+    {
+        return;
+    }
+
+    snprintf(path, PATH_MAX, "%s/" SESSION_META, sessionDir);
+    snprintf(tmpPath, PATH_MAX, "%s/" SESSION_META ".tmp", sessionDir);
+    fd = open(tmpPath, O_WRONLY | O_CREAT | O_TRUNC, 0644);
+    if (fd < 0)
+    {
+        printf("Session: cannot create %s, %s\n", tmpPath, strerror(errno));
+        return;
+    }
+    if ((write(fd, &header, sizeof(header)) != sizeof(header)) || (fsync(fd)))
+    {
+        printf("Session: header write failed, %s\n", strerror(errno));
+        close(fd);
+        return;
+    }
+    close(fd);
+    if (rename(tmpPath, path) == 0)
+    {
+        lastHeader = header;
+    }
+}
+
+/*
+ * Function: sessionThread
+ * Input: none
+ * Output: none
+ * Description:
+ *   Low priority thread, periodically save new audio then the header, the
+ *   header only ever lists audio that is already on disk
+ *
+ */
+static void *sessionThread(void *arg)
+{
+    uint8_t t;
+
+    while (!looper->exitNow)
+    {
+        usleep(SESSION_WRITE_PERIOD_US);
+        for (t = 0; t < NUM_TRACKS; t++)
+        {
+            saveTrack(t);
+        }
+        saveHeader();
+    }
+    for (t = 0; t < NUM_TRACKS; t++)
+    {
+        saveTrack(t);
+        closeWriter(&writers[t]);
+    }
+    saveHeader();
+    pthread_exit(NULL);
+}
+
+/*
+ * Function: mapChannel
+ * Input: track and channel
+ *        number of frames the header lists
+ * Output: pass/fail
+ * Description:
+ *   Map the channel file and point the chunk table into it, the pages are
+ *   populated and locked so the process thread never faults on them.
+ *   The mapping is private, overdubs do not touch the file until the writer
+ *   saves the new take. It stays mapped until exit even if the track is rerecorded
+ *
+ */
+static bool mapChannel(uint8_t t, uint8_t channel, uint32_t frames)
+{
+    char path[PATH_MAX];
+    struct stat st;
+    uint32_t numChunks = (frames + CHUNK_FRAMES - 1) >> CHUNK_FRAMES_SHIFT;
+    size_t bytes = (size_t)numChunks * CHUNK_FRAMES * sizeof(track_sample_t);
+    track_sample_t **chunks = channelChunks(&looper->tracks[t], channel);
+    track_sample_t *samples;
+    uint32_t c;
+    int fd;
+
+    trackPath(path, t, channel, false);
+    fd = open(path, O_RDONLY);
+    if (fd < 0)
+    {
+        printf("Session: cannot open %s, %s\n", path, strerror(errno));
+        return false;
+    }
+    if ((fstat(fd, &st)) || ((size_t)st.st_size < (size_t)frames * sizeof(track_sample_t)))
+    {
+        printf("Session: %s is shorter than the header says\n", path);
+        close(fd);
+        return false;
+    }
+    // pages past the end of the file are never read, tracks stop at endIdx
+    samples = mmap(NULL, bytes, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_POPULATE, fd, 0);
+    close(fd);
+    if (samples == MAP_FAILED)
+    {
+        printf("Session: cannot map %s, %s\n", path, strerror(errno));
+        return false;
+    }
+    if (mlock(samples, (size_t)frames * sizeof(track_sample_t)))
+    {
+        printf("Warning: could not lock %s, %s\n", path, strerror(errno));
+    }
+    for (c = 0; c < numChunks; c++)
+    {
+        chunks[c] = &samples[(size_t)c * CHUNK_FRAMES];
+    }
+    return true;
+}
+
+/*
+ * Function: loadSession
+ * Input: none
+ * Output: none
+ * Description:
+ *   Restore the tracks, groups and master lengths from the session directory
+ *   A missing or mismatched header leaves the looper empty
+ *
+ */
+static void loadSession(void)
+{
+    struct SessionHeader header;
+    struct Track *track;
+    char path[PATH_MAX];
+    uint8_t t;
+    uint8_t group;
+    int fd;
+
+    snprintf(path, PATH_MAX, "%s/" SESSION_META, sessionDir);
+    fd = open(path, O_RDONLY);
+    if (fd < 0)
+    {
+        printf("Session: none in %s, starting empty\n", sessionDir);
+        return;
+    }
+    if (read(fd, &header, sizeof(header)) != sizeof(header))
+    {
+        memset(&header, 0, sizeof(header));
+    }
+    close(fd);
+    if ((header.magic != SESSION_MAGIC) || (header.version != SESSION_VERSION) ||
+        (header.sampleBytes != sizeof(track_sample_t)) ||
+        (header.numGroups != NUM_GROUPS) || (header.numTracks != NUM_TRACKS) ||
+        (header.selectedGroup >= NUM_GROUPS))
+    {
+        printf("Session: %s is not a session for this build, starting empty\n", path);
+        return;
+    }
+    if (header.sampleRate != looper->sampleRate)
+    {
+        printf("Session: recorded at %d Hz, server runs at %d Hz, starting empty\n",
+            header.sampleRate, looper->sampleRate);
+        return;
+    }
+
+    for (t = 0; t < NUM_TRACKS; t++)
+    {
+        track = &looper->tracks[t];
+        if ((header.tracks[t].endIdx == 0) || (header.tracks[t].endIdx > looper->sampleLimit))
+        {
+            continue;
+        }
+        track->numChunks = (header.tracks[t].endIdx + CHUNK_FRAMES - 1) >> CHUNK_FRAMES_SHIFT;
+        track->channels = (header.tracks[t].channels == 1) ? 1 : 2;
+        if ((!mapChannel(t, 0, header.tracks[t].endIdx)) ||
+            ((track->channels == 2) && (!mapChannel(t, 1, header.tracks[t].endIdx))))
+        {
+            trackRelease(track);
+            continue;
+        }
+        track->startIdx = header.tracks[t].startIdx;
+        track->tailFrames = ((header.tracks[t].tailFrames <= LOOP_SEAM_FADE_FRAMES) &&
+            (header.tracks[t].tailFrames < header.tracks[t].endIdx)) ? header.tracks[t].tailFrames : 0;
+        track->endIdx = header.tracks[t].endIdx - track->tailFrames;
+        track->currIdx = (header.tracks[t].repeat) ? track->startIdx : 0;
+        track->repeat = header.tracks[t].repeat;
+        track->state = header.tracks[t].state;
+        trackPublish(track);
+        // the files already hold this take
+        writers[t].takeId = atomic_load_explicit(&track->takeId, memory_order_relaxed);
+        writers[t].persisted = header.tracks[t].endIdx;
+        writers[t].channels = track->channels;
+        printf("Session: track %d, %d frames\n", t, track->endIdx);
+    }
+
+    for (group = 0; group < NUM_GROUPS; group++)
+    {
+        looper->masterLength[group] = header.masterLength[group];
+        looper->barLength[group] = header.masterLength[group];
+        for (t = 0; t < NUM_TRACKS; t++)
+        {
+            if ((header.groupMembers[group] & (1u << t)) && (looper->tracks[t].endIdx > 0))
+            {
+                looper->groupedTracks[group][t] = &looper->tracks[t];
+                looper->groupMembers[group] |= 1u << t;
+            }
+        }
+    }
+    for (t = 0; t < NUM_TRACKS; t++)
+    {
+        trackUpdateActive(looper, t);
+    }
+    looper->selectedGroup = header.selectedGroup;
+    looper->masterCurrIdx = 0;
+    if (looper->numActiveTracks[looper->selectedGroup] > 0)
+    {
+        looper->state = SYSTEM_STATE_PLAYBACK;
+    }
+}
+
+/**************************************************************
+ * Public functions
+ *************************************************************/
+
+/*
+ * Function: sessionInit
+ * Input: pointer to the master looper context, the pool must be set up
+ *        session directory, created if missing
+ * Output: pass/fail of init process
+ * Description:
+ *   Load the session in the directory, if there is one, then start the writer
+ *   Call before the client is activated
+ *
+ */
+bool sessionInit(struct MasterLooper *mLooper, const char *dir)
+{
+    uint8_t t;
+    int rc;
+
+    looper = mLooper;
+    snprintf(sessionDir, sizeof(sessionDir), "%s", dir);
+    if ((mkdir(sessionDir, 0755)) && (errno != EEXIST))
+    {
+        printf("Session: cannot create %s, %s\n", sessionDir, strerror(errno));
+        return false;
+    }
+    for (t = 0; t < NUM_TRACKS; t++)
+    {
+        writers[t].fd[0] = -1;
+        writers[t].fd[1] = -1;
+        writers[t].removed = true;     // never delete files a failed load left behind
+    }
+
+    loadSession();
+    buildHeader(&lastHeader);
+
+    if ((rc = pthread_create(&sessionTh, NULL, sessionThread, NULL)))
+    {
+        printf("Error: pthread_create, rc: %d\n", rc);
+        return false;
+    }
+    return true;
+}
+
+/*
+ * Function: sessionJoin
+ * Input: none
+ * Output: none
+ * Description:
+ *   Wait for the writer to save the last audio and exit, exitNow must be set
+ *
+ */
+void sessionJoin(void)
+{
+    pthread_join(sessionTh, NULL);
+}
@@ -0,0 +1,413 @@
+/**************************************************************
+ * Copyright (C) 2017 by Chan Russell, Robert                 *
+ *                                                            *
+ * Project: Audio Looper                                      *
+ *                                                            *
+ * This file contains the overdub undo history, copy on write *
+ * chunk layers on top of a track's audio                     *
+ *                                                            *
+ * Functionality:                                             *
+ * - The first time an overdub pass writes to a chunk, the    *
+ *   chunk is copied and the copy takes its place in the      *
+ *   track, the original is kept in the pass's layer          *
+ * - Undo and redo swap a layer's chunks with the track's,    *
+ *   pointers only, so they run inside one period             *
+ * - Up to UNDO_LAYERS passes per track, a new pass drops     *
+ *   whatever was undone and, when full, the oldest pass      *
+ * - Dropped layers are handed back a little each period,     *
+ *   see poolReclaim                                          *
+ * - Process thread only, like the pool                       *
+ *                                                            *
+ *************************************************************/
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdbool.h>
+
+#include "local.h"
+
+/**************************************************************
+ * Macros and defines                                         *
+ *************************************************************/
+#define TOUCHED_WORD(CHUNK)     ((CHUNK) >> 5)
+#define TOUCHED_BIT(CHUNK)      (1u << ((CHUNK) & 31))
+#define UNDO_DROPPED_LAYERS     (NUM_TRACKS * UNDO_LAYERS)
+
+/**************************************************************
+ * Data types                                                 *
+ *************************************************************/
+
+// One chunk a pass replaced, holds whichever version is not in the track
+struct UndoEntry
+{
+    struct UndoEntry *next;
+    track_sample_t *left;
+    track_sample_t *right;          // NULL for a mono track
+    uint32_t chunk;                 // chunk number
+};
+
+static struct MasterLooper *looper;
+
+// Every entry owns a copy taken from the pool, so there are never more
+// entries in use than the pool has chunks
+static struct UndoEntry *entries;
+static struct UndoEntry *freeEntries;
+
+// Layers waiting to be handed back, each a list of entries
+static struct UndoEntry *dropped[UNDO_DROPPED_LAYERS];
+static uint16_t numDropped;
+
+// Chunks the pass under way has copied already, one overdub runs at a time
+static uint32_t *touched;
+static uint32_t touchedWords;
+
+/**************************************************************
+ * Static functions
+ *************************************************************/
+
+/*
+ * Function: freeLayer
+ * Input: first entry of the layer
+ * Output: none
+ * Description:
+ *   Queue the layer for undoReclaim, an empty one has nothing to hand back
+ *
+ */
+static void freeLayer(struct UndoEntry *entry)
+{
+    if (entry == NULL)
+    {
+        return;
+    }
+    if (numDropped == UNDO_DROPPED_LAYERS)
+    {
+        undoReclaim(UINT32_MAX);
+    }
+    dropped[numDropped++] = entry;
+}
+
+/*
+ * Function: dropLayers
+ * Input: pointer to the track's history
+ *        first layer to drop
+ *        number of layers to drop
+ * Output: none
+ * Description:
+ *   Free the layers and close the gap they leave
+ *
+ */
+static void dropLayers(struct TrackHistory *history, uint8_t first, uint8_t count)
+{
+    uint8_t layer;
+
+    for (layer = first; layer < first + count; layer++)
+    {
+        freeLayer(history->layers[layer]);
+    }
+    memmove(&history->layers[first], &history->layers[first + count],
+        (history->numLayers - first - count) * sizeof(history->layers[0]));
+    history->numLayers -= count;
+    history->applied -= (history->applied > first) ? count : 0;
+    memset(&history->layers[history->numLayers], 0,
+        (UNDO_LAYERS - history->numLayers) * sizeof(history->layers[0]));
+}
+
+/*
+ * Function: swapLayer
+ * Input: pointer to the track
+ *        first entry of the layer
+ * Output: number of chunks swapped
+ * Description:
+ *   Exchange the layer's chunks with the track's, the same swap undoes and
+ *   redoes a pass
+ *
+ */
+static uint32_t swapLayer(struct Track *track, struct UndoEntry *entry)
+{
+    track_sample_t *chunk;
+    uint32_t count = 0;
+
+    for (; entry; entry = entry->next, count++)
+    {
+        chunk = track->chunksLeft[entry->chunk];
+        track->chunksLeft[entry->chunk] = entry->left;
+        entry->left = chunk;
+        if (entry->right)
+        {
+            chunk = track->chunksRight[entry->chunk];
+            track->chunksRight[entry->chunk] = entry->right;
+            entry->right = chunk;
+        }
+    }
+    return count;
+}
+
+/*
+ * Function: copyFrames
+ * Input: pointer to the copy
+ *        pointer to the chunk
+ *        frames of the chunk inside the track
+ * Output: none
+ * Description:
+ *   Only the track's frames are read, a chunk mapped from a session file
+ *   ends with the file, the rest of the copy is cleared
+ *
+ */
+static void copyFrames(track_sample_t *copy, const track_sample_t *chunk, uint32_t frames)
+{
+    memcpy(copy, chunk, frames * sizeof(track_sample_t));
+    memset(copy + frames, 0, (CHUNK_FRAMES - frames) * sizeof(track_sample_t));
+}
+
+/*
+ * Function: copyChunk
+ * Input: pointer to the track
+ *        chunk number
+ * Output: false if the pool or the entries ran out, the chunk is left as it was
+ * Description:
+ *   Put a copy of the chunk in the track and keep the original in the layer
+ *   of the pass under way
+ *
+ */
+static bool copyChunk(struct Track *track, uint32_t c)
+{
+    struct TrackHistory *history = &track->history;
+    struct UndoEntry *entry = freeEntries;
+    uint32_t first = c << CHUNK_FRAMES_SHIFT;
+    uint32_t recorded = track->endIdx + track->tailFrames;
+    uint32_t frames = (recorded - first < CHUNK_FRAMES) ? recorded - first : CHUNK_FRAMES;
+    track_sample_t *left;
+    track_sample_t *right = NULL;
+
+    if (entry == NULL)
+    {
+        // every entry may be waiting in a dropped layer
+        undoReclaim(UINT32_MAX);
+        entry = freeEntries;
+    }
+    if (entry == NULL)
+    {
+        return false;
+    }
+    left = poolTakeChunk();
+    if ((left) && (track->channels == 2))
+    {
+        right = poolTakeChunk();
+        if (right == NULL)
+        {
+            poolGiveChunk(left);
+            left = NULL;
+        }
+    }
+    if (left == NULL)
+    {
+        return false;
+    }
+
+    copyFrames(left, track->chunksLeft[c], frames);
+    entry->left = track->chunksLeft[c];
+    track->chunksLeft[c] = left;
+    entry->right = NULL;
+    if (right)
+    {
+        copyFrames(right, track->chunksRight[c], frames);
+        entry->right = track->chunksRight[c];
+        track->chunksRight[c] = right;
+    }
+    entry->chunk = c;
+
+    freeEntries = entry->next;
+    entry->next = history->layers[history->applied - 1];
+    history->layers[history->applied - 1] = entry;
+    return true;
+}
+
+/**************************************************************
+ * Public functions
+ *************************************************************/
+
+/*
+ * Function: undoInit
+ * Input: pointer to the master looper context, the pool must be set up
+ * Output: pass/fail of the allocation
+ * Description:
+ *   Allocate an entry for every chunk in the pool and the touched map for
+ *   one track
+ *
+ */
+bool undoInit(struct MasterLooper *mLooper)
+{
+    uint32_t e;
+
+    looper = mLooper;
+    entries = calloc(looper->trackMaxChunks, sizeof(struct UndoEntry));
+    touchedWords = TOUCHED_WORD(looper->trackMaxChunks) + 1;
+    touched = calloc(touchedWords, sizeof(uint32_t));
+    if ((entries == NULL) || (touched == NULL))
+    {
+        printf("Error allocating the undo history\n");
+        return false;
+    }
+    for (e = 0; e < looper->trackMaxChunks; e++)
+    {
+        entries[e].next = freeEntries;
+        freeEntries = &entries[e];
+    }
+    printf("Undo %d overdub passes per track\n", UNDO_LAYERS);
+    return true;
+}
+
+/*
+ * Function: undoBegin
+ * Input: pointer to the track about to be overdubbed
+ * Output: none
+ * Description:
+ *   Open a layer for the new pass. Passes that were undone can no longer be
+ *   redone, and the oldest pass is forgotten if every layer is taken
+ *
+ */
+void undoBegin(struct Track *track)
+{
+    struct TrackHistory *history = &track->history;
+
+    if (history->numLayers > history->applied)
+    {
+        dropLayers(history, history->applied, history->numLayers - history->applied);
+    }
+    if (history->numLayers == UNDO_LAYERS)
+    {
+        dropLayers(history, 0, 1);
+    }
+    history->layers[history->numLayers++] = NULL;
+    history->applied = history->numLayers;
+    memset(touched, 0, touchedWords * sizeof(uint32_t));
+}
+
+/*
+ * Function: undoEnd
+ * Input: pointer to the track that was overdubbed
+ * Output: none
+ * Description:
+ *   Close the pass, one that wrote nothing leaves no layer to undo
+ *
+ */
+void undoEnd(struct Track *track)
+{
+    struct TrackHistory *history = &track->history;
+
+    if ((history->applied > 0) && (history->layers[history->applied - 1] == NULL))
+    {
+        dropLayers(history, history->applied - 1, 1);
+    }
+}
+
+/*
+ * Function: undoTouch
+ * Input: pointer to the track being overdubbed
+ *        first track index about to be written
+ *        number of frames
+ * Output: false if the pool ran out, nothing may be written then
+ * Description:
+ *   Copy every chunk in the range the pass has not written to yet, then the
+ *   overdub goes into the copies. Costs one chunk copy per chunk per pass
+ *
+ */
+bool undoTouch(struct Track *track, uint32_t idx, jack_nframes_t count)
+{
+    uint32_t c;
+    uint32_t lastChunk;
+
+    if ((count == 0) || (track->history.applied == 0))
+    {
+        return (count == 0);
+    }
+    lastChunk = (idx + count - 1) >> CHUNK_FRAMES_SHIFT;
+    for (c = idx >> CHUNK_FRAMES_SHIFT; c <= lastChunk; c++)
+    {
+        if (touched[TOUCHED_WORD(c)] & TOUCHED_BIT(c))
+        {
+            continue;
+        }
+        if (!copyChunk(track, c))
+        {
+            return false;
+        }
+        touched[TOUCHED_WORD(c)] |= TOUCHED_BIT(c);
+    }
+    return true;
+}
+
+/*
+ * Function: undoClear
+ * Input: pointer to the track
+ * Output: none
+ * Description:
+ *   Forget every pass, the chunks the layers hold go back to the pool
+ *
+ */
+void undoClear(struct Track *track)
+{
+    if (track->history.numLayers > 0)
+    {
+        dropLayers(&track->history, 0, track->history.numLayers);
+    }
+    track->history.applied = 0;
+}
+
+/*
+ * Function: undoStep
+ * Input: pointer to the track, not being overdubbed
+ *        false to undo the last pass, true to redo the last one undone
+ * Output: number of chunks swapped, 0 if there was nothing to do
+ * Description:
+ *   Swap a pass in or out of the track. The caller tells the readers of the
+ *   track's audio that it changed
+ *
+ */
+uint32_t undoStep(struct Track *track, bool redo)
+{
+    struct TrackHistory *history = &track->history;
+
+    if (!redo)
+    {
+        if (history->applied == 0)
+        {
+            return 0;
+        }
+        return swapLayer(track, history->layers[--history->applied]);
+    }
+    if (history->applied == history->numLayers)
+    {
+        return 0;
+    }
+    return swapLayer(track, history->layers[history->applied++]);
+}
+
+/*
+ * Function: undoReclaim
+ * Input: most entries to hand back
+ * Output: none
+ * Description:
+ *   Return the chunks of dropped layers to the pool and their entries to the
+ *   free list, see poolReclaim
+ *
+ */
+void undoReclaim(uint32_t budget)
+{
+    struct UndoEntry *entry;
+
+    for (; (numDropped > 0) && (budget > 0); budget--)
+    {
+        entry = dropped[numDropped - 1];
+        dropped[numDropped - 1] = entry->next;
+        if (entry->next == NULL)
+        {
+            numDropped--;
+        }
+        poolGiveChunk(entry->left);
+        poolGiveChunk(entry->right);
+        entry->next = freeEntries;
+        freeEntries = entry;
+    }
+}
@@ -7,13 +7,17 @@
  * diagnostics.                                               *
  *                                                            *
  * Functionality:                                             *
- * - Timers with nonosecond granularity                       *
- *                                                            *
+ * - Timers with nonosecond granularity, CLOCK_MONOTONIC      *
+ * - Per timer log2 histograms for p50/p99/p999/max           *
+ * - DSP load as a fraction of the period budget              *
+ * - Xrun counting                                            *
+ * - Status report that can be queried while running          *
  *                                                            *
  *************************************************************/
 
 #include <stdlib.h>
 #include <stdio.h>
+#include <string.h>
 #include <stdbool.h>
 #include <unistd.h>
 #include <time.h>
@@ -23,23 +27,35 @@
 /**************************************************************
  * Macros and defines                                         *
  *************************************************************/
-#define MAX_TIME_SAMPLES    (10)
+#define TIMER_HISTOGRAM_BUCKETS (40)    // bucket b counts [2^b, 2^(b+1)) ns, up to ~9 minutes
+#define NS_PER_S                (1000000000ULL)
+#define LOAD_AVERAGE_WEIGHT     (0.01f) // exponential average over roughly 100 periods
 
 /**************************************************************
  * Data types                                                 *
  *************************************************************/
 struct TimerConstruct
 {
-    long int start_time;
-    long int time_differences[MAX_TIME_SAMPLES];
-    long int time_differenceMax;
-    int differencesIndex;
+    uint64_t start_time;
+    uint64_t last;
+    uint64_t max;
+    uint32_t count;
+    uint32_t histogram[TIMER_HISTOGRAM_BUCKETS];
     bool started;
 };
 typedef struct TimerConstruct tc_t;
 
-static struct timespec gettime_now;
+struct LoadStats
+{
+    float last;                 // fraction of the period spent in playRecord
+    float average;
+    float max;
+    uint32_t overBudget;        // periods where playRecord took longer than the period
+};
+
 static tc_t timers[TIMER_COUNT];
+static struct LoadStats load;
+static _Atomic uint32_t xruns;
 static const char *TIMER_STRING[] = {
     FOREACH_TIMER(GENERATE_STRING)
 };
@@ -48,6 +64,57 @@ static const char *TIMER_STRING[] = {
  * Static functions
  *************************************************************/
 
+/*
+ * Function: nowNs
+ * Input: none
+ * Output: monotonic time in nanoseconds
+ * Description:
+ *   CLOCK_MONOTONIC does not jump when NTP adjusts the wall clock
+ *
+ */
+static uint64_t nowNs(void)
+{
+    struct timespec now;
+    clock_gettime(CLOCK_MONOTONIC, &now);
+    return ((uint64_t)now.tv_sec * NS_PER_S) + now.tv_nsec;
+}
+
+/*
+ * Function: histogramBucket
+ * Input: duration in nanoseconds
+ * Output: histogram bucket, floor(log2(ns))
+ *
+ */
+static uint8_t histogramBucket(uint64_t ns)
+{
+    uint8_t bucket = 63 - __builtin_clzll(ns | 1);
+    return (bucket < TIMER_HISTOGRAM_BUCKETS) ? bucket : TIMER_HISTOGRAM_BUCKETS - 1;
+}
+
+/*
+ * Function: timerPercentile
+ * Input: pointer to the timer
+ *        percentile wanted, in tenths of a percent
+ * Output: upper bound of the bucket holding the percentile, in nanoseconds
+ *
+ */
+static uint64_t timerPercentile(const tc_t *timer, uint32_t permille)
+{
+    uint64_t target = ((uint64_t)timer->count * permille + 999) / 1000;
+    uint64_t seen = 0;
+    uint8_t bucket;
+
+    for (bucket = 0; bucket < TIMER_HISTOGRAM_BUCKETS; bucket++)
+    {
+        seen += timer->histogram[bucket];
+        if ((seen >= target) && (seen > 0))
+        {
+            return 2ULL << bucket;
+        }
+    }
+    return timer->max;
+}
+
 /**************************************************************
  * Public functions
  *************************************************************/
@@ -64,14 +131,13 @@ void startTimer(uint8_t index)
 {
     if (index >= TIMER_COUNT)
     {
-        printf("\n!!Invalid Timer Start!\n");
+        logEvent(LOG_MSG_TIMER_INVALID, index, 0, 0);
         return;
     }
-    clock_gettime(CLOCK_REALTIME, &gettime_now);
-    timers[index].start_time = gettime_now.tv_nsec;
+    timers[index].start_time = nowNs();
     if (timers[index].started)
     {
-        printf("\n!! Timer %d already started\n", index);
+        logEvent(LOG_MSG_TIMER_STARTED, index, 0, 0);
     }
     timers[index].started = true;
 }
@@ -82,14 +148,14 @@ void startTimer(uint8_t index)
  * Output: none
  * Description:
  *   If the timer was started grab the latest timestamp and store it
- *   Update the maximum difference observed and store the last 10 samples
+ *   Update the maximum difference observed and the timer's histogram
  *
  */
 void stopTimer(uint8_t index)
 {
     if (index >= TIMER_COUNT)
     {
-        printf("\n!!Invalid Timer Start!\n");
+        logEvent(LOG_MSG_TIMER_INVALID, index, 0, 0);
         return;
     }
     if (!timers[index].started)
@@ -97,56 +163,168 @@ void stopTimer(uint8_t index)
         return;
     }
 
-    clock_gettime(CLOCK_REALTIME, &gettime_now);
-    int long time_diff = gettime_now.tv_nsec - timers[index].start_time;
-    if (time_diff < 0)
-    {
-        time_diff += 1000000000; // rolls over every 1 second
-    }
+    uint64_t time_diff = nowNs() - timers[index].start_time;
 
     timers[index].started = false;
+    timers[index].last = time_diff;
+    timers[index].count++;
+    timers[index].histogram[histogramBucket(time_diff)]++;
+    timers[index].max = (time_diff > timers[index].max) ? time_diff : timers[index].max;
+}
 
-    timers[index].time_differences[timers[index].differencesIndex] = time_diff;
-    timers[index].differencesIndex++;
-    if (timers[index].differencesIndex > MAX_TIME_SAMPLES)
+/*
+ * Function: timerLastNs
+ * Input: index of timer
+ * Output: the most recent duration measured by the timer, in nanoseconds
+ *
+ */
+uint64_t timerLastNs(uint8_t index)
+{
+    return (index < TIMER_COUNT) ? timers[index].last : 0;
+}
+
+/*
+ * Function: statsRecordLoad
+ * Input: time spent processing the period, in nanoseconds
+ *        number of frames in the period
+ *        sample rate
+ * Output: none
+ * Description:
+ *   Record the processing time as a fraction of the time the period lasts
+ *   Called from the process thread once per period
+ *
+ */
+void statsRecordLoad(uint64_t busyNs, jack_nframes_t nframes, jack_nframes_t sampleRate)
+{
+    uint64_t budgetNs = ((uint64_t)nframes * NS_PER_S) / sampleRate;
+    float fraction;
+
+    if (budgetNs == 0)
     {
-        timers[index].differencesIndex = 0;
+        return;
     }
+    fraction = (float)busyNs / budgetNs;
+    load.last = fraction;
+    load.average += LOAD_AVERAGE_WEIGHT * (fraction - load.average);
+    load.max = (fraction > load.max) ? fraction : load.max;
+    if (fraction > 1.0f)
+    {
+        load.overBudget++;
+    }
+}
 
-    timers[index].time_differenceMax = 
-        (time_diff > timers[index].time_differenceMax) ? time_diff : timers[index].time_differenceMax;
-
+/*
+ * Function: statsCountXrun
+ * Input: none
+ * Output: none
+ * Description:
+ *   Count an xrun reported by the Jack server, any thread
+ *
+ */
+void statsCountXrun(void)
+{
+    atomic_fetch_add_explicit(&xruns, 1, memory_order_relaxed);
 }
 
 /*
- * Function: printTimers
+ * Function: statsXruns
  * Input: none
+ * Output: number of xruns since start or the last reset
+ *
+ */
+uint32_t statsXruns(void)
+{
+    return atomic_load_explicit(&xruns, memory_order_relaxed);
+}
+
+/*
+ * Function: statsLoad
+ * Input: pointers to the load of the last period and the highest so far
  * Output: none
  * Description:
- *   Display the data from the timer tables
- *   Clear the tables
+ *   Fractions of the period budget, read while the process thread may be
+ *   updating them
+ *
  */
-void printTimers(void)
+void statsLoad(float *last, float *max)
 {
+    *last = load.last;
+    *max = load.max;
+}
+
+/*
+ * Function: statsFormat
+ * Input: pointer to the text buffer
+ *        size of the buffer
+ * Output: number of characters written
+ * Description:
+ *   Format the timer percentiles, DSP load and xrun count as text
+ *   Values are read while the process thread may be updating them, this is a
+ *   snapshot for humans, not an exact count
+ *
+ */
+size_t statsFormat(char *buf, size_t len)
+{
+    size_t used = 0;
     int i = 0;
-    int j = 0;
-    printf("\n\nTimers\n");
 
-    for (i = 0; i < TIMER_COUNT; i++)
+    for (i = 0; (i < TIMER_COUNT) && (used < len); i++)
     {
-        if (timers[i].time_differenceMax > 0)
+        if (timers[i].count > 0)
         {
-            printf("Timer %s\n", TIMER_STRING[i]);
-            printf("    Max %d ns\n", timers[i].time_differenceMax);
-            printf("    Last %d entries\n", MAX_TIME_SAMPLES);
-            for (j = 0; j < MAX_TIME_SAMPLES; j++)
-            {
-                printf("    %d ns\n", timers[i].time_differences[j]);
-            }
-            printf("\n");
+            used += snprintf(&buf[used], len - used,
+                "%s n %u p50 %llu p99 %llu p999 %llu max %llu ns\r\n",
+                TIMER_STRING[i], timers[i].count,
+                (unsigned long long)timerPercentile(&timers[i], 500),
+                (unsigned long long)timerPercentile(&timers[i], 990),
+                (unsigned long long)timerPercentile(&timers[i], 999),
+                (unsigned long long)timers[i].max);
         }
     }
+    if (used < len)
+    {
+        used += snprintf(&buf[used], len - used,
+            "DSP load last %.1f%% avg %.1f%% max %.1f%% over budget %u\r\nXruns %u\r\n",
+            load.last * 100.0f, load.average * 100.0f, load.max * 100.0f,
+            load.overBudget, statsXruns());
+    }
+    return (used < len) ? used : len - 1;
+}
 
-    memset(timers, 0, sizeof(timers));
+/*
+ * Function: statsReset
+ * Input: none
+ * Output: none
+ * Description:
+ *   Clear the histograms, load and xrun count
+ *
+ */
+void statsReset(void)
+{
+    int i = 0;
+    for (i = 0; i < TIMER_COUNT; i++)
+    {
+        timers[i].count = 0;
+        timers[i].max = 0;
+        memset(timers[i].histogram, 0, sizeof(timers[i].histogram));
+    }
+    memset(&load, 0, sizeof(load));
+    atomic_store_explicit(&xruns, 0, memory_order_relaxed);
 }
 
+/*
+ * Function: printTimers
+ * Input: none
+ * Output: none
+ * Description:
+ *   Display the data from the timer tables
+ *   Clear the tables
+ */
+void printTimers(void)
+{
+    char buf[STATS_TEXT_LENGTH];
+
+    statsFormat(buf, sizeof(buf));
+    printf("\n\nTimers\n%s\n", buf);
+    statsReset();
+}
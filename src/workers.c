@@ -0,0 +1,387 @@
+/**************************************************************
+ * Copyright (C) 2017 by Chan Russell, Robert                 *
+ *                                                            *
+ * Project: Audio Looper                                      *
+ *                                                            *
+ * This file contains the mix worker pool, used to spread the *
+ * mixdown of large groups over the spare cores               *
+ *                                                            *
+ * Functionality:                                             *
+ * - Up to MIX_WORKERS threads at the Jack client priority,   *
+ *   each pinned to its own core                              *
+ * - The process thread starts a job with one atomic store    *
+ *   and a futex wake, no locks                               *
+ * - Parts are claimed by whichever thread gets there first,  *
+ *   the process thread included, so a worker that wakes late *
+ *   only ever costs its own part                             *
+ * - Workers only run at realtime priority, a normal thread   *
+ *   could be descheduled holding a claimed part, without it  *
+ *   the process thread mixes alone                           *
+ * - A partial stereo bus per part after the first            *
+ *                                                            *
+ *************************************************************/
+
+#define _GNU_SOURCE
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdbool.h>
+#include <unistd.h>
+#include <errno.h>
+#include <sched.h>
+#include <linux/futex.h>
+#include <sys/syscall.h>
+
+#include "local.h"
+
+/**************************************************************
+ * Macros and defines                                         *
+ *************************************************************/
+#if defined(__x86_64__) || defined(__i386__)
+#define CPU_RELAX()     __builtin_ia32_pause()
+#elif defined(__arm__) || defined(__aarch64__)
+#define CPU_RELAX()     __asm__ __volatile__("yield")
+#else
+#define CPU_RELAX()
+#endif
+
+// Job claim word, number of parts and the next part to hand out
+#define CLAIM_WORD(PARTS, NEXT)     (((uint32_t)(PARTS) << 8) | (NEXT))
+#define CLAIM_PARTS(WORD)           ((WORD) >> 8)
+#define CLAIM_NEXT(WORD)            ((WORD) & 0xff)
+
+/**************************************************************
+ * Data types                                                 *
+ *************************************************************/
+struct Worker
+{
+    pthread_t thread;
+    uint8_t id;
+};
+
+static struct MasterLooper *looper;
+static struct Worker workers[MIX_WORKERS];
+static uint8_t numWorkers;
+static jack_default_audio_sample_t *busLeft[MIX_WORKERS];   // part p mixes into bus p - 1
+static jack_default_audio_sample_t *busRight[MIX_WORKERS];
+static jack_nframes_t busFrames;                // frames each partial bus holds
+
+// Current job, written by the process thread before the claim word is released
+static void (*jobFunction)(uint8_t part, void *arg);
+static void *jobArg;
+static _Atomic uint32_t claim;                  // CLAIM_WORD of the current job
+static _Atomic uint8_t done;                    // parts of the current job finished
+static _Atomic uint32_t generation;             // bumped to start a job, the futex word
+static _Atomic bool stopping;                   // set by workersJoin, not exitNow, a job may still be under way
+
+/**************************************************************
+ * Static functions
+ *************************************************************/
+
+/*
+ * Function: futexWait
+ * Input: pointer to the futex word
+ *        value the caller last saw
+ * Output: none
+ * Description:
+ *   Sleep while the word still holds the value, returns early on any wake
+ *
+ */
+static void futexWait(_Atomic uint32_t *word, uint32_t seen)
+{
+    syscall(SYS_futex, (uint32_t *)word, FUTEX_WAIT_PRIVATE, seen, NULL, NULL, 0);
+}
+
+/*
+ * Function: futexWake
+ * Input: pointer to the futex word
+ * Output: none
+ * Description:
+ *   Wake every thread sleeping on the word, never blocks
+ *
+ */
+static void futexWake(_Atomic uint32_t *word)
+{
+    syscall(SYS_futex, (uint32_t *)word, FUTEX_WAKE_PRIVATE, INT_MAX, NULL, NULL, 0);
+}
+
+/*
+ * Function: claimPart
+ * Input: pointer to the part to fill
+ * Output: false once every part of the current job has been handed out
+ * Description:
+ *   The parts count lives in the claim word, so a thread still holding a
+ *   finished job's word can never claim a part twice. A successful claim
+ *   reads from the process thread's release, the job fields are visible
+ *
+ */
+static bool claimPart(uint8_t *part)
+{
+    uint32_t word = atomic_load_explicit(&claim, memory_order_acquire);
+    do
+    {
+        if (CLAIM_NEXT(word) >= CLAIM_PARTS(word))
+        {
+            return false;
+        }
+    } while (!atomic_compare_exchange_weak_explicit(&claim, &word, word + 1,
+                memory_order_acq_rel, memory_order_acquire));
+    *part = CLAIM_NEXT(word);
+    return true;
+}
+
+/*
+ * Function: runParts
+ * Input: none
+ * Output: none
+ * Description:
+ *   Run parts of the current job until none are left
+ *
+ */
+static void runParts(void)
+{
+    uint8_t part;
+    while (claimPart(&part))
+    {
+        jobFunction(part, jobArg);
+        atomic_fetch_add_explicit(&done, 1, memory_order_release);
+    }
+}
+
+/*
+ * Function: workerThread
+ * Input: pointer to the worker
+ * Output: none
+ * Description:
+ *   Sleep until the generation moves on, then help with the job
+ *
+ */
+static void *workerThread(void *arg)
+{
+    uint32_t seen = atomic_load_explicit(&generation, memory_order_acquire);
+    uint32_t gen;
+
+    while (!atomic_load_explicit(&stopping, memory_order_relaxed))
+    {
+        gen = atomic_load_explicit(&generation, memory_order_acquire);
+        if (gen == seen)
+        {
+            futexWait(&generation, seen);
+            continue;
+        }
+        seen = gen;
+        runParts();
+    }
+    pthread_exit(NULL);
+}
+
+/*
+ * Function: startWorker
+ * Input: pointer to the worker
+ *        core to pin it to
+ *        SCHED_FIFO priority
+ * Output: 0 or the pthread_create error, EPERM without realtime permission
+ *
+ */
+static int startWorker(struct Worker *w, int core, int priority)
+{
+    pthread_attr_t attr;
+    struct sched_param param;
+    cpu_set_t cpus;
+    int rc;
+
+    pthread_attr_init(&attr);
+    CPU_ZERO(&cpus);
+    CPU_SET(core, &cpus);
+    pthread_attr_setaffinity_np(&attr, sizeof(cpus), &cpus);
+    param.sched_priority = priority;
+    pthread_attr_setinheritsched(&attr, PTHREAD_EXPLICIT_SCHED);
+    pthread_attr_setschedpolicy(&attr, SCHED_FIFO);
+    pthread_attr_setschedparam(&attr, &param);
+    rc = pthread_create(&w->thread, &attr, workerThread, w);
+    pthread_attr_destroy(&attr);
+    return rc;
+}
+
+/*
+ * Function: allocateBus
+ * Input: bus index
+ *        number of frames
+ * Output: pass/fail of the allocation
+ *
+ */
+static bool allocateBus(uint8_t bus, jack_nframes_t nframes)
+{
+    jack_default_audio_sample_t *left = calloc(nframes, sizeof(jack_default_audio_sample_t));
+    jack_default_audio_sample_t *right = calloc(nframes, sizeof(jack_default_audio_sample_t));
+
+    if ((left == NULL) || (right == NULL))
+    {
+        free(left);
+        free(right);
+        printf("Mix bus %d: cannot allocate %d frame bus\n", bus, nframes);
+        return false;
+    }
+    free(busLeft[bus]);
+    free(busRight[bus]);
+    busLeft[bus] = left;
+    busRight[bus] = right;
+    return true;
+}
+
+/**************************************************************
+ * Public functions
+ *************************************************************/
+
+/*
+ * Function: workersInit
+ * Input: pointer to the master looper context
+ *        SCHED_FIFO priority for the workers, negative if Jack is not realtime
+ * Output: pass/fail of init process
+ * Description:
+ *   Start one worker per spare core, at most MIX_WORKERS. Core 0 is left to
+ *   the Jack process thread, RT_PROCESS_CORE. workersResize must have sized the buses
+ *   A single core system, or one without realtime scheduling, gets no
+ *   workers and mixes on the process thread
+ *
+ */
+bool workersInit(struct MasterLooper *mLooper, int priority)
+{
+    long cores = sysconf(_SC_NPROCESSORS_ONLN);
+    uint8_t idx;
+    int rc;
+
+    looper = mLooper;
+    numWorkers = 0;
+    if (priority < 0)
+    {
+        printf("Mix workers off, the process thread is not realtime\n");
+        return true;
+    }
+    for (idx = 0; (idx < MIX_WORKERS) && (idx + 1 < cores); idx++)
+    {
+        workers[idx].id = idx + 1;
+        if (!allocateBus(idx, busFrames))
+        {
+            return false;
+        }
+        rc = startWorker(&workers[idx], idx + 1, priority);
+        if (rc == EPERM)
+        {
+            printf("Mix worker %d: no realtime permission, mixing on the process thread\n", workers[idx].id);
+            break;
+        }
+        if (rc)
+        {
+            printf("Error: pthread_create, rc: %d\n", rc);
+            return false;
+        }
+        numWorkers++;
+    }
+    printf("Mix workers %d, parallel mix from %d tracks\n", numWorkers, MIX_PARALLEL_MIN_TRACKS);
+    return true;
+}
+
+/*
+ * Function: workersResize
+ * Input: number of frames per period
+ * Output: pass/fail of the allocation
+ * Description:
+ *   Grow the partial buses for a longer period, never called from the
+ *   process thread. Also sets the size workersInit allocates
+ *
+ */
+bool workersResize(jack_nframes_t nframes)
+{
+    uint8_t idx;
+
+    if (nframes <= busFrames)
+    {
+        return true;
+    }
+    for (idx = 0; idx < numWorkers; idx++)
+    {
+        if (!allocateBus(idx, nframes))
+        {
+            return false;
+        }
+    }
+    busFrames = nframes;
+    return true;
+}
+
+/*
+ * Function: workersJoin
+ * Input: none
+ * Output: none
+ * Description:
+ *   Stop the workers and wait for them, the process callback must no longer
+ *   run, close the Jack client first
+ *
+ */
+void workersJoin(void)
+{
+    uint8_t idx;
+
+    atomic_store_explicit(&stopping, true, memory_order_relaxed);
+    atomic_fetch_add_explicit(&generation, 1, memory_order_release);
+    futexWake(&generation);
+    for (idx = 0; idx < numWorkers; idx++)
+    {
+        pthread_join(workers[idx].thread, NULL);
+    }
+    numWorkers = 0;
+}
+
+/*
+ * Function: workersCount
+ * Input: none
+ * Output: number of running workers, a job can have one more part than this
+ *
+ */
+uint8_t workersCount(void)
+{
+    return numWorkers;
+}
+
+/*
+ * Function: workersBus
+ * Input: job part, 1 to workersCount()
+ *        channel, 0 left, 1 right
+ * Output: the partial bus for that part, whichever thread runs it
+ *
+ */
+jack_default_audio_sample_t *workersBus(uint8_t part, uint8_t channel)
+{
+    return (channel == 0) ? busLeft[part - 1] : busRight[part - 1];
+}
+
+/*
+ * Function: workersRun
+ * Input: function to run for each part
+ *        argument passed to every part
+ *        number of parts, 1 to workersCount() + 1
+ * Output: none
+ * Description:
+ *   Process thread only. Wake the workers and claim parts alongside them,
+ *   then wait for parts other threads are still running. Returns once every
+ *   part is done and its writes are visible. If no worker wakes in time the
+ *   process thread simply runs the whole job itself
+ *
+ */
+void workersRun(void (*function)(uint8_t part, void *arg), void *arg, uint8_t parts)
+{
+    jobFunction = function;
+    jobArg = arg;
+    atomic_store_explicit(&done, 0, memory_order_relaxed);
+    atomic_store_explicit(&claim, CLAIM_WORD(parts, 0), memory_order_release);
+    atomic_fetch_add_explicit(&generation, 1, memory_order_release);
+    futexWake(&generation);
+
+    runParts();
+
+    while (atomic_load_explicit(&done, memory_order_acquire) != parts)
+    {
+        CPU_RELAX();
+    }
+}